@@ -3,806 +3,7143 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory_resource>
 #include <set>
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
 #include <iomanip>
 #include <sstream>
 #include <cctype>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TEXTCMP_X86 1
+#include <immintrin.h>
+#endif
+
+// Building with -DTEXTCMP_TRACE (make trace) times every TRACE_SCOPE and
+// writes a per-run summary and a Chrome trace; it also counts allocations
+#if defined(TEXTCMP_TRACE) && !defined(TEXTCMP_COUNT_ALLOCATIONS)
+#define TEXTCMP_COUNT_ALLOCATIONS 1
+#endif
+
+// Building with -DTEXTCMP_COUNT_ALLOCATIONS (make bench) counts every
+// allocation so benchmarks can report allocations per stage
+#ifdef TEXTCMP_COUNT_ALLOCATIONS
+#include <new>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "unicode_tables.h"
 
 using namespace std;
 
-// Structure to hold document statistics
-struct DocumentStats {
-    string filename;
-    int wordCount;
-    int sentenceCount;
-    double avgSentenceLength;
-    string longestSentence;
-    int longestSentenceWordCount;
-    set<string> uniqueWords;
-    map<string, int> wordFrequency;
-    vector<pair<string, int>> topWords;
-};
+#ifdef TEXTCMP_TRACE
+// Times the enclosing block on the calling thread: wall and CPU time, major
+// page faults and allocations, plus the bytes and tokens it reports with
+// TRACE_COUNT. CPU time well below wall time means the stage waited on I/O.
+class TraceScope {
+public:
+    explicit TraceScope(const char* name);
+    ~TraceScope();
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    void count(uint64_t addBytes, uint64_t addTokens) {
+        bytes += addBytes;
+        tokens += addTokens;
+    }
+
+private:
+    const char* name;
+    int64_t start;
+    int64_t cpuStart;
+    uint64_t faultsStart;
+    uint64_t allocationsStart;
+    uint64_t allocatedBytesStart;
+    uint64_t bytes = 0;
+    uint64_t tokens = 0;
+};
+
+// Collects the events of one run and reports them when it goes out of scope
+// at the end of main. Removes "--trace <file>" from args.
+class TraceSession {
+public:
+    explicit TraceSession(vector<string>& args);
+    ~TraceSession();
+
+private:
+    string tracePath;
+};
+
+#define TRACE_SCOPE(name) TraceScope traceScope(name)
+#define TRACE_COUNT(bytes, tokens) traceScope.count(bytes, tokens)
+#else
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_COUNT(bytes, tokens) ((void)sizeof(bytes), (void)sizeof(tokens))
+#endif
+
+// A sentence as a byte range of the document and its word count. Sentences end
+// at '.', '!' or '?' (inclusive) and only sentences with words are recorded.
+struct SentenceSpan {
+    uint64_t offset;
+    uint64_t length;
+    uint32_t words;
+};
+
+class CountMinSketch;
+
+// Structure to hold document statistics
+struct DocumentStats {
+    string filename;
+    int64_t wordCount;
+    int64_t sentenceCount;
+    double avgSentenceLength;
+    string longestSentence;
+    int longestSentenceWordCount;
+    vector<uint32_t> uniqueWords;   // sorted word IDs in the shared vocabulary
+    vector<int> wordFrequency;      // wordFrequency[i] counts uniqueWords[i]
+    vector<pair<string, int>> topWords;
+    vector<uint32_t> minHash;       // kMinHashSize-entry signature of uniqueWords
+    vector<SentenceSpan> sentences; // in document order
+    
+    // Set by streaming analysis, which keeps no sentence spans
+    map<uint32_t, uint64_t> sentenceLengths;     // words per sentence -> number of sentences
+    bool vocabularyTruncated = false;            // words past the vocabulary cap were only sketched
+    uint64_t overflowOccurrences = 0;
+    shared_ptr<const CountMinSketch> overflowCounts;
+};
+
+// A word present in both documents with its count in each
+struct CommonWordCount {
+    uint32_t id;
+    int count1;
+    int count2;
+};
+
+// Intersection and union sizes of two vocabularies. One result feeds the
+// similarity figure, the common-word count and the reports.
+struct VocabularyOverlap {
+    size_t common = 0;
+    size_t unionSize = 0;
+
+    VocabularyOverlap() = default;
+    VocabularyOverlap(size_t size1, size_t size2, size_t commonWords)
+        : common(commonWords), unionSize(size1 + size2 - commonWords) {}
+
+    // Jaccard similarity in percent
+    double jaccard() const {
+        if (unionSize == 0) return 0.0;
+        return static_cast<double>(common) / unionSize * 100.0;
+    }
+};
+
+// Read-only view over a document's bytes. Regular files are memory-mapped so
+// analysis runs directly on the page cache without copying; pipes, stdin ("-")
+// and anything else that cannot be mapped fall back to buffered reads.
+class FileBuffer {
+public:
+    FileBuffer() = default;
+    ~FileBuffer();
+    FileBuffer(FileBuffer&& other) noexcept;
+    FileBuffer& operator=(FileBuffer&& other) noexcept;
+    FileBuffer(const FileBuffer&) = delete;
+    FileBuffer& operator=(const FileBuffer&) = delete;
+
+    bool open(const string& filename);
+    string_view text() const { return mapped ? string_view(mapped, mappedSize) : string_view(owned); }
+    bool empty() const { return text().empty(); }
+
+private:
+    bool readStream(FILE* stream);
+    void release();
+
+    const char* mapped = nullptr;
+    size_t mappedSize = 0;
+    string owned;
+};
+
+// Character classes of the tokenizer's lookup tables. For ASCII they reproduce
+// the old normalize-then-split rules: letters are lowercased, sentence
+// terminators stay inside words, whitespace and other punctuation split words,
+// and everything else (digits, control bytes) is dropped without splitting.
+// Non-ASCII text is decoded as UTF-8 and classified by the generated
+// unicode_tables.h the same way; ideographs (Han, Hiragana) are one word each,
+// since those scripts do not separate words with spaces.
+enum CharClass : unsigned char {
+    CHAR_DROP,
+    CHAR_LETTER,
+    CHAR_TERMINATOR,
+    CHAR_SEPARATOR,
+    CHAR_IDEOGRAPH
+};
+
+struct CharTable {
+    unsigned char cls[256];
+    char lower[256];
+};
+
+constexpr CharTable buildCharTable() {
+    CharTable table{};
+    for (int c = 0; c < 256; c++) {
+        table.lower[c] = static_cast<char>(c);
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+            table.cls[c] = CHAR_LETTER;
+            table.lower[c] = static_cast<char>(c | 0x20);
+        } else if (c == '.' || c == '!' || c == '?') {
+            table.cls[c] = CHAR_TERMINATOR;
+        } else if (c == ' ' || (c >= '\t' && c <= '\r') || (c > ' ' && c < 0x7f && !(c >= '0' && c <= '9'))) {
+            table.cls[c] = CHAR_SEPARATOR;
+        } else {
+            table.cls[c] = CHAR_DROP;
+        }
+    }
+    return table;
+}
+
+constexpr CharTable kCharTable = buildCharTable();
+
+// Class (low 3 bits) and case folding delta index (the rest) of a code point
+constexpr uint16_t unicodeEntry(uint32_t cp) {
+    if (cp >= kUnicodeLimit) {
+        return CHAR_DROP;
+    }
+    uint32_t block = uint32_t(kUnicodeStage1[cp >> kUnicodeShift]) << kUnicodeShift;
+    return kUnicodeStage2[block | (cp & ((1u << kUnicodeShift) - 1))];
+}
+
+// Decodes the UTF-8 sequence at text (available bytes). Returns its length, 0
+// if it is a valid prefix cut off by the end of the bytes, or -1 if the first
+// byte does not start a valid sequence (overlong forms, surrogates and code
+// points past U+10FFFF are invalid).
+int decodeUtf8(const unsigned char* text, size_t available, uint32_t& cp);
+// Writes cp as UTF-8 to out (at least 4 bytes) and returns the length
+size_t encodeUtf8(uint32_t cp, char* out);
+// Whether the character starting at pos, or the one ending just before it, is
+// a letter, ideograph or ASCII digit (for whole-word matching)
+bool wordCharacterAt(string_view text, size_t pos);
+bool wordCharacterBefore(string_view text, size_t pos);
+
+// Word normalization between tokenizing and counting (--stop-words, --stem).
+// Stop words are left out of the vocabulary but still count as words of the
+// document and its sentences; stems are counted in place of their words.
+struct WordNormalization {
+    bool stopWords = false;
+    bool stem = false;
+
+    bool enabled() const { return stopWords || stem; }
+    // Distinguishes settings in cache keys; 0 when nothing is normalized
+    unsigned flags() const { return (stopWords ? 1u : 0u) | (stem ? 2u : 0u); }
+};
+
+bool isStopWord(string_view word);
+// Porter stemmer on an ASCII word in place; returns the stem's length, which is
+// never longer than the word. Words with other characters are left as they are.
+size_t stemWord(char* word, size_t length);
+// Normalizes a word in place: false for a stop word, otherwise length receives
+// the length of the normalized word. Trailing sentence terminators are dropped
+// first, so 'it?' is a stop word and 'Connected!' counts as 'connect'.
+bool normalizeWord(const WordNormalization& normalization, char* word, size_t& length);
+
+// Per-byte class bitmasks for one block of text (bit i describes byte i).
+// Letters are the bytes in none of the three masks.
+struct BlockMasks {
+    uint32_t terminator;
+    uint32_t separator;
+    uint32_t drop;
+};
+
+// Classifies one block starting at text, fills masks and writes the block with
+// every byte OR 0x20 to lowered (which lowercases letters and leaves the
+// terminators unchanged). Returns the block width: 32 for AVX2, 16 otherwise.
+// The SIMD variant is picked once at startup from the running CPU.
+using BlockClassifier = size_t (*)(const char* text, BlockMasks& masks, char* lowered);
+constexpr size_t kMaxBlockWidth = 32;
+size_t classifyBlockScalar(const char* text, BlockMasks& masks, char* lowered);
+#ifdef TEXTCMP_X86
+size_t classifyBlockSse2(const char* text, BlockMasks& masks, char* lowered);
+size_t classifyBlockAvx2(const char* text, BlockMasks& masks, char* lowered);
+#endif
+extern BlockClassifier classifyBlock;
+
+// Single-pass tokenizer. Text is classified a SIMD block at a time; blocks
+// without dropped bytes are split into words from the separator mask alone,
+// other blocks and the tail go through kCharTable byte by byte, decoding
+// non-ASCII characters as UTF-8 (invalid bytes are dropped). Each finished
+// word is handed to a callback as a view into the scanner's reusable word
+// buffer (valid only for the duration of the call). Text may be fed in several
+// pieces; a word or a UTF-8 character split between pieces is joined.
+//
+// The same pass segments sentences. A sentence's word count follows the old
+// per-sentence tokenization: a terminator always closes the sentence, so
+// "a.b" is one document word but one word in each of two sentences.
+class TokenScanner {
+public:
+    // Sentence spans are appended to sentences when it is set. A scanner for a
+    // piece of a larger text starts at that piece's offset.
+    explicit TokenScanner(vector<SentenceSpan>* sentences = nullptr, uint64_t start = 0)
+        : sentenceOut(sentences), offset(start), sentenceStart(start) {}
+
+    template <typename OnWord>
+    void feed(string_view text, OnWord&& onWord) {
+        const char* p = text.data();
+        const char* end = p + text.size();
+        BlockMasks masks;
+        char lowered[kMaxBlockWidth];
+        while (static_cast<size_t>(end - p) >= kMaxBlockWidth) {
+            size_t width = classifyBlock(p, masks, lowered);
+            if (masks.drop == 0 && pendingLength == 0) {
+                scanBlock(width, masks, lowered, onWord);
+            } else {
+                scanBytes(p, width, onWord);
+            }
+            p += width;
+            offset += width;
+        }
+        scanBytes(p, end - p, onWord);
+        offset += end - p;
+    }
+
+    // Flushes the word still open at the end of the text; an unfinished UTF-8
+    // character there is invalid and dropped
+    template <typename OnWord>
+    void flush(OnWord&& onWord) {
+        pendingLength = 0;
+        if (inWord && keepWord) {
+            wordEndOffset = offset;
+            emitWord(onWord);
+        }
+        inWord = false;
+    }
+
+    // Flushes the word and the sentence still open at the end of the text
+    template <typename OnWord>
+    void finish(OnWord&& onWord) {
+        flush(onWord);
+        closeSentence(offset);
+    }
+
+    // Words are normalized in the word buffer before they are handed out;
+    // stop words are not handed out at all
+    void normalizeWith(const WordNormalization& settings) { normalization = settings; }
+
+    size_t terminatorCount() const { return terminators; }
+    size_t stopWordCount() const { return stopWords; }
+
+    // For joining sentences across separately scanned pieces: where the first
+    // sentence closed (UINT64_MAX if none did) with the words it had in this
+    // piece, and the sentence still open
+    uint64_t firstSentenceEnd() const { return firstEnd; }
+    uint32_t firstSentenceWords() const { return firstWords; }
+    SentenceSpan openSentence() const { return SentenceSpan{sentenceStart, offset - sentenceStart, sentenceWords}; }
+
+    // Byte range of the word being passed to onWord (valid during the call)
+    uint64_t wordBegin() const { return wordStartOffset; }
+    uint64_t wordEnd() const { return wordEndOffset; }
+
+private:
+    void closeSentence(uint64_t end) {
+        if (firstEnd == UINT64_MAX) {
+            firstEnd = end;
+            firstWords = sentenceWords;
+        }
+        if (sentenceOut && sentenceWords > 0) {
+            sentenceOut->push_back(SentenceSpan{sentenceStart, end - sentenceStart, sentenceWords});
+        }
+        sentenceStart = end;
+        sentenceWords = 0;
+    }
+
+    // A sentence word starts at every letter not preceded by a letter (dropped
+    // bytes in between do not count); the block has no dropped bytes
+    void countSentenceWords(size_t width, uint32_t all, const BlockMasks& masks) {
+        uint32_t letters = ~(masks.terminator | masks.separator) & all;
+        uint32_t starts = letters & ~((letters << 1) | (afterLetter ? 1u : 0u));
+        uint32_t pending = masks.terminator;
+        while (pending) {
+            size_t t = __builtin_ctz(pending);
+            uint32_t upToTerminator = t == 31 ? UINT32_MAX : (2u << t) - 1;
+            sentenceWords += __builtin_popcount(starts & upToTerminator);
+            starts &= ~upToTerminator;
+            closeSentence(offset + t + 1);
+            pending &= pending - 1;
+        }
+        sentenceWords += __builtin_popcount(starts);
+        afterLetter = (letters >> (width - 1)) & 1;
+    }
+
+    template <typename OnWord>
+    void emitWord(OnWord& onWord) {
+        size_t length = wordLength;
+        if (normalization.enabled() && !normalizeWord(normalization, &word[0], length)) {
+            stopWords++;
+            return;
+        }
+        onWord(string_view(word.data(), length));
+    }
+
+    void append(const char* text, size_t length) {
+        if (wordLength + length > word.size()) {
+            word.resize(max(word.size() * 2, wordLength + length));
+        }
+        memcpy(&word[wordLength], text, length);
+        wordLength += length;
+    }
+
+    template <typename OnWord>
+    void scanBlock(size_t width, const BlockMasks& masks, const char* lowered, OnWord& onWord) {
+        terminators += __builtin_popcount(masks.terminator);
+        uint32_t all = width == 32 ? UINT32_MAX : (1u << width) - 1;
+        countSentenceWords(width, all, masks);
+        uint32_t separators = masks.separator;
+        size_t pos = 0;
+        while (pos < width) {
+            if (inWord) {
+                uint32_t rest = separators >> pos;
+                size_t stop = rest ? pos + __builtin_ctz(rest) : width;
+                if (keepWord) {
+                    append(lowered + pos, stop - pos);
+                }
+                if (stop == width) {
+                    break;
+                }
+                if (keepWord) {
+                    wordEndOffset = offset + stop;
+                    emitWord(onWord);
+                }
+                inWord = false;
+                pos = stop;
+            } else {
+                uint32_t rest = (~separators & all) >> pos;
+                if (!rest) {
+                    break;
+                }
+                pos += __builtin_ctz(rest);
+                // No dropped bytes here, so a non-terminator is a letter
+                inWord = true;
+                keepWord = !((masks.terminator >> pos) & 1);
+                wordLength = 0;
+                wordStartOffset = offset + pos;
+            }
+        }
+    }
+
+    // Ends the open word at byte offset at
+    template <typename OnWord>
+    void endWord(uint64_t at, OnWord& onWord) {
+        if (inWord) {
+            if (keepWord) {
+                wordEndOffset = at;
+                emitWord(onWord);
+            }
+            inWord = false;
+        }
+    }
+
+    void appendCodePoint(uint32_t cp) {
+        char bytes[4];
+        append(bytes, encodeUtf8(cp, bytes));
+    }
+
+    // Handles the character cp, whose UTF-8 bytes span [begin, end)
+    template <typename OnWord>
+    void scanCodePoint(uint32_t cp, const char* bytes, uint64_t begin, uint64_t end, OnWord& onWord) {
+        uint16_t entry = unicodeEntry(cp);
+        uint32_t folded = cp + kUnicodeFoldDelta[entry >> 3];
+        switch (entry & 7) {
+        case CHAR_LETTER:
+            if (!inWord) {
+                inWord = true;
+                keepWord = true;
+                wordLength = 0;
+                wordStartOffset = begin;
+            }
+            if (keepWord) {
+                appendCodePoint(folded);
+            }
+            if (!afterLetter) {
+                sentenceWords++;
+            }
+            afterLetter = true;
+            break;
+        case CHAR_TERMINATOR:
+            terminators++;
+            if (!inWord) {
+                inWord = true;
+                keepWord = false;
+            } else if (keepWord) {
+                append(bytes, end - begin);
+            }
+            afterLetter = false;
+            closeSentence(end);
+            break;
+        case CHAR_SEPARATOR:
+            afterLetter = false;
+            endWord(begin, onWord);
+            break;
+        case CHAR_IDEOGRAPH:
+            endWord(begin, onWord);
+            wordLength = 0;
+            appendCodePoint(folded);
+            wordStartOffset = begin;
+            wordEndOffset = end;
+            emitWord(onWord);
+            sentenceWords++;
+            afterLetter = false;
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Decodes the UTF-8 character starting at text[i] and returns the bytes it
+    // used; a character cut off by the end of the piece is kept for the next
+    template <typename OnWord>
+    size_t scanMultibyte(const char* text, size_t length, size_t i, OnWord& onWord) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(text + i);
+        uint32_t cp;
+        int used = decodeUtf8(bytes, length - i, cp);
+        if (used > 0) {
+            scanCodePoint(cp, text + i, offset + i, offset + i + used, onWord);
+            return used;
+        }
+        if (used < 0) {
+            return 1;
+        }
+        pendingLength = length - i;
+        memcpy(pending, bytes, pendingLength);
+        pendingStart = offset + i;
+        return pendingLength;
+    }
+
+    // Completes the character left over from the previous piece with the first
+    // bytes of text and returns how many of them it used
+    template <typename OnWord>
+    size_t scanPending(const char* text, size_t length, OnWord& onWord) {
+        unsigned char bytes[4];
+        memcpy(bytes, pending, pendingLength);
+        size_t more = min(length, sizeof(bytes) - pendingLength);
+        memcpy(bytes + pendingLength, text, more);
+        uint32_t cp;
+        int used = decodeUtf8(bytes, pendingLength + more, cp);
+        if (used == 0) {
+            memcpy(pending + pendingLength, text, length);
+            pendingLength += length;
+            return length;
+        }
+        size_t consumed = used > 0 ? used - pendingLength : 0;
+        pendingLength = 0;
+        if (used > 0) {
+            scanCodePoint(cp, reinterpret_cast<const char*>(bytes), pendingStart, offset + consumed, onWord);
+        }
+        return consumed;
+    }
+
+    template <typename OnWord>
+    void scanBytes(const char* text, size_t length, OnWord& onWord) {
+        size_t i = 0;
+        if (pendingLength > 0) {
+            i = scanPending(text, length, onWord);
+        }
+        while (i < length) {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            switch (kCharTable.cls[c]) {
+            case CHAR_LETTER:
+                if (!inWord) {
+                    inWord = true;
+                    keepWord = true;
+                    wordLength = 0;
+                    wordStartOffset = offset + i;
+                }
+                if (keepWord) {
+                    append(&kCharTable.lower[c], 1);
+                }
+                if (!afterLetter) {
+                    sentenceWords++;
+                }
+                afterLetter = true;
+                break;
+            case CHAR_TERMINATOR:
+                terminators++;
+                if (!inWord) {
+                    // Words must start with a letter
+                    inWord = true;
+                    keepWord = false;
+                } else if (keepWord) {
+                    append(&text[i], 1);
+                }
+                afterLetter = false;
+                closeSentence(offset + i + 1);
+                break;
+            case CHAR_SEPARATOR:
+                afterLetter = false;
+                endWord(offset + i, onWord);
+                break;
+            default:
+                if (c >= 0x80) {
+                    i += scanMultibyte(text, length, i, onWord);
+                    continue;
+                }
+                break;
+            }
+            i++;
+        }
+    }
+
+    string word = string(64, '\0');
+    size_t wordLength = 0;
+    bool inWord = false;
+    bool keepWord = false;
+    size_t terminators = 0;
+
+    vector<SentenceSpan>* sentenceOut;
+    uint64_t offset = 0;          // bytes fed before the current piece
+    uint64_t sentenceStart = 0;
+    uint32_t sentenceWords = 0;
+    bool afterLetter = false;
+    uint64_t firstEnd = UINT64_MAX;
+    uint32_t firstWords = 0;
+    uint64_t wordStartOffset = 0;
+    uint64_t wordEndOffset = 0;
+    unsigned char pending[4];     // start of a UTF-8 character split between pieces
+    size_t pendingLength = 0;
+    uint64_t pendingStart = 0;
+    WordNormalization normalization;
+    size_t stopWords = 0;
+};
+
+// Bump allocator for word bytes. Words are copied once into large blocks that
+// never move, so views into the arena stay valid for the arena's lifetime.
+class StringArena {
+public:
+    explicit StringArena(pmr::memory_resource* resource = pmr::get_default_resource()) : blocks(resource) {}
+    ~StringArena();
+    StringArena(const StringArena&) = delete;
+    StringArena& operator=(const StringArena&) = delete;
+
+    string_view store(string_view text);
+
+private:
+    static constexpr size_t kBlockSize = 1 << 16;
+
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    pmr::vector<Block> blocks;
+    size_t used = 0;
+    size_t capacity = 0;
+};
+
+uint64_t hashWord(string_view word);
+
+// Flat open-addressing (linear probing) table mapping each distinct word to a
+// dense index in insertion order. Slots hold only a hash tag and the index, so
+// probing touches one cache line; the word bytes live in a StringArena.
+class WordTable {
+public:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    // A document's local table lives in its analysis arena; see analysisArenaSize
+    explicit WordTable(pmr::memory_resource* resource = pmr::get_default_resource())
+        : slots(resource), words(resource), hashes(resource), arena(resource) {}
+
+    uint32_t insert(string_view word);
+    uint32_t find(string_view word) const;
+    size_t size() const { return words.size(); }
+    string_view word(uint32_t index) const { return words[index]; }
+    uint64_t hash(uint32_t index) const { return hashes[index]; }
+
+private:
+    struct Slot {
+        uint32_t tag;
+        uint32_t index;
+    };
+
+    void grow();
+
+    pmr::vector<Slot> slots;
+    pmr::vector<string_view> words;
+    pmr::vector<uint64_t> hashes;
+    StringArena arena;
+};
+
+// Process-wide vocabulary shared by all documents, so equal words get equal IDs
+// and documents can be compared by ID alone. Interning is thread-safe. Words
+// are also published into fixed chunks that never move, so word() needs no
+// lock for any ID the caller already holds.
+class WordInterner {
+public:
+    uint32_t intern(string_view word);
+    vector<uint32_t> internAll(const WordTable& local);
+    uint32_t find(string_view word) const;
+    string_view word(uint32_t id) const { return chunks[id >> kChunkBits][id & (kChunkSize - 1)]; }
+    size_t size() const;
+
+private:
+    static constexpr size_t kChunkBits = 16;
+    static constexpr size_t kChunkSize = size_t(1) << kChunkBits;
+
+    uint32_t insertLocked(string_view word);
+
+    WordTable table;
+    unique_ptr<string_view[]> chunks[size_t(1) << (32 - kChunkBits)];
+    mutable mutex lock;
+};
+
+// Fixed-size worker pool with one task deque per worker. Workers pop their own
+// deque from the back and steal from the front of the others when idle, so
+// uneven tasks (large documents, dense tiles) balance themselves.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads = 0);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void submit(function<void()> task);
+    void wait();
+    size_t size() const { return workers.size(); }
+
+private:
+    struct TaskQueue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    bool runOne(size_t self);
+    void workerLoop(size_t self);
+
+    vector<unique_ptr<TaskQueue>> queues;
+    vector<thread> workers;
+    mutex stateLock;
+    condition_variable wake;
+    condition_variable idle;
+    size_t queued = 0;
+    size_t pending = 0;
+    size_t nextQueue = 0;
+    bool stopping = false;
+};
+
+// Bounded selection of the k best items under a strict "better" order. The
+// items are kept in a heap with the worst of them on top, so offering n items
+// costs O(n log k) instead of a full sort. The order should be total (break
+// ties explicitly) for the result to be deterministic. Selections made over
+// separate shards of the input can be merged.
+template <typename T, typename Better>
+class TopK {
+public:
+    explicit TopK(size_t k = 0, Better better = Better()) : limit(k), better(better) {}
+
+    void offer(const T& item) {
+        if (heap.size() < limit) {
+            heap.push_back(item);
+            push_heap(heap.begin(), heap.end(), better);
+        } else if (limit > 0 && better(item, heap.front())) {
+            pop_heap(heap.begin(), heap.end(), better);
+            heap.back() = item;
+            push_heap(heap.begin(), heap.end(), better);
+        }
+    }
+
+    void merge(const TopK& other) {
+        for (const T& item : other.heap) {
+            offer(item);
+        }
+    }
+
+    // The selected items, best first; the selection is left empty
+    vector<T> take() {
+        sort(heap.begin(), heap.end(), better);
+        return move(heap);
+    }
+
+    size_t size() const { return heap.size(); }
+
+private:
+    size_t limit;
+    Better better;
+    vector<T> heap;
+};
+
+// MinHash signatures estimate the Jaccard similarity of two vocabularies from
+// the fraction of matching entries. Entry i is the minimum over the document's
+// words of a multiply-shift permutation of the word's 64-bit hash.
+constexpr size_t kMinHashSize = 128;
+vector<uint32_t> computeMinHash(const WordTable& words);
+vector<uint32_t> computeMinHash(const vector<uint32_t>& wordIds);
+double estimateJaccard(const vector<uint32_t>& signature1, const vector<uint32_t>& signature2);
+
+// Locality-sensitive index over MinHash signatures. Each signature is cut into
+// bands of rows; documents that agree on every row of any band share a bucket
+// and become a candidate pair. The band/row split puts the S-curve threshold
+// (1/bands)^(1/rows) as close as possible below the requested Jaccard
+// threshold, trading a few extra candidates for recall.
+class LshIndex {
+public:
+    explicit LshIndex(double thresholdPercent);
+    void add(uint32_t doc, const vector<uint32_t>& signature);
+    vector<pair<uint32_t, uint32_t>> candidatePairs() const;
+    size_t bandCount() const { return bands; }
+    size_t rowsPerBand() const { return rows; }
+
+private:
+    size_t bands = 1;
+    size_t rows = kMinHashSize;
+    vector<unordered_map<uint64_t, vector<uint32_t>>> buckets;
+};
+
+// Similarity measures offered by SimilarityEngine. Jaccard compares the
+// vocabularies as sets; the others use the word counts.
+enum SimilarityMetric {
+    METRIC_JACCARD,
+    METRIC_WEIGHTED_JACCARD,    // sum of min(counts) / sum of max(counts)
+    METRIC_COSINE,              // cosine of the count vectors
+    METRIC_TFIDF_COSINE,        // cosine of the counts weighted by corpus IDF
+    METRIC_CONTAINMENT,         // share of document A's words also in B
+    METRIC_OVERLAP              // shared words over the smaller document
+};
+
+struct SimilarityMetricInfo {
+    SimilarityMetric metric;
+    const char* key;            // --metric name
+    const char* label;
+};
+
+constexpr SimilarityMetricInfo kSimilarityMetrics[] = {
+    {METRIC_JACCARD, "jaccard", "Jaccard Similarity"},
+    {METRIC_WEIGHTED_JACCARD, "weighted-jaccard", "Weighted Jaccard Similarity"},
+    {METRIC_COSINE, "cosine", "Cosine Similarity (TF)"},
+    {METRIC_TFIDF_COSINE, "tfidf", "Cosine Similarity (TF-IDF)"},
+    {METRIC_CONTAINMENT, "containment", "Containment of A in B"},
+    {METRIC_OVERLAP, "overlap", "Overlap Coefficient"}
+};
+
+// A document as a sparse vector sorted by shared word ID. The norm and total
+// weight are computed once, so a comparison is one pass over the common words.
+struct TermVector {
+    const vector<uint32_t>* ids = nullptr;  // the document's uniqueWords
+    vector<float> weights;
+    double norm = 0;
+    double total = 0;
+};
+
+// One metric over many documents. For TF-IDF, fit() builds the IDF table once
+// for the corpus; vectors must be made after that by the same engine.
+class SimilarityEngine {
+public:
+    explicit SimilarityEngine(SimilarityMetric metric = METRIC_JACCARD) : metric(metric) {}
+    void fit(const vector<const DocumentStats*>& corpus);
+    TermVector vectorize(const DocumentStats& doc) const;
+    double score(const TermVector& a, const TermVector& b) const;   // in percent
+    SimilarityMetric kind() const { return metric; }
+    // Factor of a word's count in its weight: its IDF for TF-IDF, otherwise 1
+    float termWeight(uint32_t id) const;
+
+private:
+    SimilarityMetric metric;
+    vector<float> idf;          // by shared word ID
+    float unseenIdf = 1.0f;     // for words outside the corpus
+};
+
+struct SimilarityScore {
+    SimilarityMetric metric;
+    double percent;
+};
+
+// Corpus kept in memory by serve. For every word ID it holds the documents
+// that contain the word with their counts, bit-packed in blocks with a skip
+// entry per block. Queries are ranked by cosine (TF or TF-IDF, weighted as by
+// SimilarityEngine) with WAND-style pruning: every list has a bound on what it
+// adds to any score, and documents that cannot reach the k-th best score even
+// with all the bounds they could still collect are never scored in full.
+class InvertedIndex {
+public:
+    struct Hit {
+        uint32_t doc;
+        double percent;
+    };
+
+    InvertedIndex(const vector<DocumentStats>& docs, SimilarityMetric metric);
+    // query holds word IDs (WordTable::npos for words the corpus lacks) and
+    // counts; only documents sharing a word with it are returned
+    vector<Hit> topK(const DocumentStats& query, size_t k) const;
+    const string& documentName(uint32_t doc) const { return names[doc]; }
+    size_t documentCount() const { return names.size(); }
+    size_t postingCount() const { return postings; }
+    size_t indexBytes() const;
+
+private:
+    static constexpr uint32_t kBlockSize = 128;
+    // A list is skipped through rather than read whole once it is this many
+    // times longer than the candidate list
+    static constexpr size_t kProbeRatio = 4;
+    // Postings added per candidate between refreshes of the k-th best score
+    static constexpr size_t kRefreshRatio = 16;
+    static constexpr size_t kPadding = 8;     // zero bytes after the last block, for unpackBits
+
+    struct PostingList {
+        uint32_t firstBlock = 0;
+        uint32_t length = 0;
+        double maxWeight = 0;   // largest count / document norm in the list
+    };
+    struct Block {
+        uint32_t lastDoc;       // every document in the block is <= lastDoc
+        uint8_t docBits;        // width of each document less the previous block's lastDoc
+        uint8_t countBits;      // width of each count, packed after the documents
+        uint64_t offset;        // of the block's packed documents in data
+    };
+    class Cursor;
+
+    vector<string> names;
+    SimilarityEngine engine;
+    vector<double> scales;      // 1 / norm per document, under the engine's weights
+    vector<PostingList> lists;  // by word ID
+    vector<Block> blocks;
+    vector<uint8_t> data;
+    size_t postings = 0;
+};
+
+// What a comparison report shows; the same content feeds every format
+struct ReportContent {
+    const DocumentStats* doc1;
+    const DocumentStats* doc2;
+    VocabularyOverlap overlap;
+    const vector<CommonWordCount>* commonWords;
+    vector<SimilarityScore> scores;
+    const vector<pair<string, string>>* replacements = nullptr;    // set for the report after a replacement
+};
+
+// A k-word shingle: its hash, the position of its first word and its byte
+// range in the document
+struct Shingle {
+    uint64_t hash;
+    uint32_t position;
+    uint64_t begin;
+    uint64_t end;
+};
+
+// Every shingle of a document and the winnowed subset used as fingerprints
+struct ShingledDocument {
+    vector<Shingle> shingles;           // by position
+    vector<uint32_t> fingerprints;      // positions of the selected shingles
+};
+
+// A run of shingles found at the same relative position in both documents
+struct PassageMatch {
+    uint64_t begin1, end1;      // byte range in the first document
+    uint64_t begin2, end2;      // byte range in the second document
+    uint32_t words;
+};
+
+enum ReportFormat {
+    REPORT_TEXT,
+    REPORT_JSON,
+    REPORT_CSV
+};
+
+// Output assembled in one large pre-sized buffer with to_chars formatting and
+// written with a single call (save), or streamed to a file in large blocks
+// (open / close) when it may not fit in memory, like batch matrices.
+// Floating-point values are written fixed with two decimals, as every report
+// shows them. "-" is standard output.
+class ReportBuffer {
+public:
+    ReportBuffer() { data.reserve(kBlockSize); }
+    ~ReportBuffer() { close(); }
+    ReportBuffer(const ReportBuffer&) = delete;
+    ReportBuffer& operator=(const ReportBuffer&) = delete;
+
+    bool open(const string& path);
+    bool close();           // false when a write failed
+    bool save(const string& path) { return open(path) && close(); }
+
+    ReportBuffer& operator<<(string_view text) {
+        data.append(text);
+        return spill();
+    }
+    ReportBuffer& operator<<(char c) {
+        data.push_back(c);
+        return spill();
+    }
+    template <typename T, typename = enable_if_t<is_integral_v<T> && !is_same_v<T, bool>>>
+    ReportBuffer& operator<<(T value) {
+        char digits[24];
+        data.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr);
+        return spill();
+    }
+    ReportBuffer& operator<<(double value);
+
+    void jsonString(string_view text);      // quoted and escaped
+    void csvField(string_view text);        // quoted when needed
+    const string& text() const { return data; }
+
+private:
+    static constexpr size_t kBlockSize = size_t(1) << 20;
+
+    ReportBuffer& spill() {
+        if (sink && data.size() >= kBlockSize) {
+            flush();
+        }
+        return *this;
+    }
+    void flush();
+
+    string data;
+    FILE* sink = nullptr;
+    bool failed = false;
+};
+
+// While it lives, console messages written to cout go to stderr instead, so a
+// report written to "-" is the only thing on standard output
+class ConsoleToStderr {
+public:
+    explicit ConsoleToStderr(bool active) : saved(active ? cout.flush().rdbuf(cerr.rdbuf()) : nullptr) {}
+    ~ConsoleToStderr() {
+        if (saved) {
+            cout.rdbuf(saved);
+        }
+    }
+    ConsoleToStderr(const ConsoleToStderr&) = delete;
+    ConsoleToStderr& operator=(const ConsoleToStderr&) = delete;
+
+private:
+    streambuf* saved;
+};
+
+// Rows of named columns: tab-separated text, CSV with the same header line,
+// or a JSON array of objects keyed by column name
+class TableWriter {
+public:
+    TableWriter(ReportBuffer& out, ReportFormat format, vector<string> columns);
+    TableWriter& text(string_view value);
+    TableWriter& number(double value);
+    TableWriter& integer(uint64_t value);
+    void endRow();
+    void finish();
+
+private:
+    void beginCell();
+
+    ReportBuffer& out;
+    ReportFormat format;
+    vector<string> columns;
+    size_t column = 0;
+    size_t rows = 0;
+};
+
+// One side of a diff: tokens (words or sentences) as interned IDs, with the
+// byte range each came from
+struct DiffSequence {
+    vector<uint32_t> ids;
+    vector<uint64_t> begins;
+    vector<uint64_t> ends;
+};
+
+enum DiffKind {
+    DIFF_EQUAL,
+    DIFF_DELETE,
+    DIFF_INSERT
+};
+
+// length tokens at position a of the first sequence and b of the second
+struct DiffRun {
+    DiffKind kind;
+    size_t a;
+    size_t b;
+    size_t length;
+};
+
+// Approximate counts in fixed memory: a word increments one counter in each
+// of kDepth rows and its estimate is the smallest of them, so estimates may
+// overcount but never undercount
+class CountMinSketch {
+public:
+    explicit CountMinSketch(size_t widthBits = 20);
+    void add(uint64_t hash);
+    uint32_t estimate(uint64_t hash) const;
+
+private:
+    static constexpr size_t kDepth = 4;
+    size_t index(uint64_t hash, size_t row) const;
+
+    size_t widthBits;
+    vector<uint32_t> counters;
+};
+
+// Settings for analyzing documents too large to load (--stream)
+struct StreamOptions {
+    bool enabled = false;
+    size_t chunkSize = size_t(16) << 20;
+    size_t maxVocabulary = 0;               // 0 keeps every word exactly
+};
+
+// Case-insensitive, whole-word multi-pattern matcher over an Aho-Corasick
+// automaton. Bytes are lowercased and mapped to byte classes first (every byte
+// that occurs in no pattern shares class 0), so the dense transition table
+// only has one column per distinct pattern byte. A match only counts when the
+// bytes around it are not alphanumeric. Overlapping matches resolve
+// leftmost-longest, like rescanning after each replacement would, and are
+// reported in text order.
+class ReplacementEngine {
+public:
+    struct Match {
+        size_t start;
+        size_t end;
+        uint32_t pattern;
+    };
+
+    explicit ReplacementEngine(const vector<pair<string, string>>& replacements);
+
+    // Calls onMatch(start, end, pattern) for every match. A start position is
+    // decided once no longer match starting there can still end, i.e. after
+    // maxLength more bytes; the undecided starts live in a small ring buffer.
+    template <typename OnMatch>
+    void scan(string_view text, OnMatch&& onMatch) const {
+        vector<Match> window(windowMask + 1, Match{SIZE_MAX, 0, 0});
+        size_t next = 0;   // first start position not decided yet
+        auto decideBefore = [&](size_t limit) {
+            while (next < limit) {
+                const Match& candidate = window[next & windowMask];
+                if (candidate.start == next) {
+                    onMatch(candidate.start, candidate.end, candidate.pattern);
+                    next = candidate.end;
+                } else {
+                    next++;
+                }
+            }
+        };
+        uint32_t state = 0;
+        for (size_t i = 0; i < text.size(); i++) {
+            state = transitions[state * classCount + byteClass[static_cast<unsigned char>(text[i])]];
+            for (uint32_t node = terminal[state] >= 0 ? state : outputLink[state]; node != 0; node = outputLink[node]) {
+                uint32_t pattern = terminal[node];
+                size_t end = i + 1;
+                size_t start = end - patterns[pattern].size();
+                if (start < next || wordCharacterBefore(text, start) || wordCharacterAt(text, end)) {
+                    continue;
+                }
+                Match& candidate = window[start & windowMask];
+                if (candidate.start != start || end > candidate.end) {
+                    candidate = Match{start, end, pattern};
+                }
+            }
+            if (i + 1 >= maxLength) {
+                decideBefore(i + 2 - maxLength);
+            }
+        }
+        decideBefore(text.size());
+    }
+
+    // Writes text to out with every match replaced; counts[i] receives the
+    // number of replacements of pattern i and matches, if given, every match
+    size_t rewrite(string_view text, ostream& out, vector<size_t>& counts, vector<Match>* matches = nullptr) const;
+    size_t patternCount() const { return patterns.size(); }
+    const string& pattern(uint32_t index) const { return patterns[index]; }
+    const string& substitute(uint32_t index) const { return substitutes[index]; }
+
+private:
+    vector<string> patterns;         // lowercased old words
+    vector<string> substitutes;
+    unsigned char byteClass[256] = {};
+    size_t classCount = 1;
+    size_t maxLength = 0;
+    size_t windowMask = 0;           // ring buffer size - 1, a power of two above maxLength
+    vector<uint32_t> transitions;    // state * classCount + class
+    vector<int32_t> terminal;        // pattern ending exactly at the state, or -1
+    vector<uint32_t> outputLink;     // nearest proper suffix state that is terminal, 0 if none
+};
+
+// On-disk cache of analyzed documents, one entry file per document path in the
+// cache directory. An entry stays valid while the document's size, modification
+// time and content hash match the ones it was written for; anything else
+// (including an entry from another format version) is treated as a miss and
+// rewritten. Entries are memory-mapped on load. Words are stored as text and
+// interned again, since shared word IDs only hold within one process.
+class DocumentCache {
+public:
+    void configure(const string& cacheDirectory, bool enable);
+    bool enabled() const { return active; }
+    bool load(const string& filename, string_view content, DocumentStats& stats) const;
+    void store(const string& filename, string_view content, const DocumentStats& stats) const;
+
+private:
+    string entryPath(const string& filename) const;
+
+    string directory = ".text_comparator_cache";
+    bool active = true;
+};
+
+// Analyzed documents kept in memory across the commands of one process, so a
+// job file can compare and rewrite the same documents many times while each
+// is analyzed once. An entry is reused while the file's size and modification
+// time are unchanged.
+class DocumentStore {
+public:
+    // nullptr (after printing an error) when the file cannot be read or has no
+    // words. A streamed analysis is only returned when stream is enabled.
+    const DocumentStats* get(const string& filename, const StreamOptions& stream = StreamOptions());
+    // Records statistics that are already up to date with the file on disk
+    void put(DocumentStats stats);
+
+private:
+    struct Entry {
+        uint64_t size;
+        int64_t modified;
+        DocumentStats stats;
+        bool streamed;
+        unsigned normalization;                  // WordNormalization::flags()
+    };
+    unordered_map<string, Entry> documents;
+};
+
+// Settings for the non-interactive N x N comparison (--batch)
+struct BatchOptions {
+    string source;                               // directory or manifest file
+    string outputPath;                           // empty: similarity_matrix.<tsv|csv|json>
+    ReportFormat format = REPORT_TEXT;
+    size_t topK = 0;                             // 0 writes the dense matrix
+    size_t threads = 0;                          // 0 uses every hardware thread
+    size_t tileSize = 64;
+    double lshThreshold = 0;                     // > 0 reports LSH near-duplicates instead
+    bool exactCheck = false;                     // re-check LSH candidates with jaccardSimilarity
+    SimilarityMetric metric = METRIC_JACCARD;
+    StreamOptions stream;
+    string cacheDirectory = ".text_comparator_cache";
+    bool useCache = true;
+};
+
+// Settings for the resident query server (serve)
+struct ServeOptions {
+    string source;                               // directory or manifest file
+    string socketPath;                           // empty: requests on stdin, replies on stdout
+    size_t topK = 10;
+    size_t threads = 0;                          // for the initial analysis; 0 uses every hardware thread
+    SimilarityMetric metric = METRIC_TFIDF_COSINE;
+    string cacheDirectory = ".text_comparator_cache";
+    bool useCache = true;
+};
+
+enum SentenceLengths {
+    LENGTHS_FIXED,
+    LENGTHS_UNIFORM,
+    LENGTHS_GEOMETRIC
+};
+
+// Synthetic corpus for benchmarks (bench, generate)
+struct CorpusOptions {
+    size_t sizeBytes = size_t(16) << 20;
+    size_t vocabulary = 50000;
+    double zipfExponent = 1.0;                   // word rank r is drawn with weight 1 / r^s
+    size_t sentenceWords = 15;                   // mean sentence length
+    SentenceLengths lengths = LENGTHS_GEOMETRIC;
+    uint64_t seed = 1;
+};
+
+// Settings for the microbenchmark suite (bench)
+struct BenchOptions {
+    CorpusOptions corpus;
+    size_t repeat = 5;                           // timed runs per stage, after one warm-up run
+    string baselinePath;                         // compare against this baseline file
+    string savePath;                             // write the results as a new baseline
+    double tolerance = 10;                       // percent slower than the baseline that fails
+};
+
+// Timings of one benchmark stage; bytes and tokens are processed per call
+struct BenchResult {
+    string stage;
+    vector<double> seconds;                      // per call, one per run, sorted
+    uint64_t bytes;
+    uint64_t tokens;
+    uint64_t allocations;                        // per call, when counted
+    uint64_t allocatedBytes;
+};
+
+WordInterner& sharedVocabulary();
+DocumentCache& sharedDocumentCache();
+WordNormalization& sharedNormalization();
+string normalizedWord(string_view word);
+
+// Function declarations
+bool loadFile(const string& filename, FileBuffer& buffer);
+vector<string> tokenize(string_view text);
+double calculateAvgSentenceLength(int64_t wordCount, int64_t sentenceCount);
+vector<pair<string, int>> getTopFrequentWords(const DocumentStats& doc, int n = 5);
+ThreadPool& sharedScanPool();
+void scanDocument(string_view text, DocumentStats& stats);
+void scanDocumentSharded(string_view text, DocumentStats& stats, ThreadPool& pool, size_t shardSize);
+size_t analysisArenaSize(size_t textSize);
+void setVocabulary(DocumentStats& stats, const WordTable& localWords, const pmr::vector<int>& counts);
+int getWordFrequency(const DocumentStats& doc, string_view word);
+int getWordFrequencyById(const DocumentStats& doc, uint32_t id);
+vector<string_view> alphabeticalWords(const vector<CommonWordCount>& words, size_t limit);
+pair<string, int> findLongestSentence(const vector<SentenceSpan>& sentences, string_view text);
+double sentenceLengthPercentile(const DocumentStats& doc, double percentile);
+size_t intersectionSize(const vector<uint32_t>& words1, const vector<uint32_t>& words2);
+VocabularyOverlap compareVocabularies(const vector<uint32_t>& words1, const vector<uint32_t>& words2);
+double jaccardSimilarity(const vector<uint32_t>& set1, const vector<uint32_t>& set2);
+const SimilarityMetricInfo& similarityMetricInfo(SimilarityMetric metric);
+bool parseSimilarityMetrics(const string& names, vector<SimilarityMetric>& metrics);
+vector<SimilarityScore> scoreDocuments(const DocumentStats& doc1, const DocumentStats& doc2, const vector<SimilarityMetric>& metrics);
+ShingledDocument winnowDocument(string_view text, size_t shingleWords, size_t window);
+vector<PassageMatch> findMatchingPassages(const ShingledDocument& doc1, const ShingledDocument& doc2, size_t shingleWords);
+void printMatchingPassages(const vector<PassageMatch>& passages, string_view text1, size_t limit);
+DiffSequence wordSequence(string_view text, WordTable& words);
+DiffSequence sentenceSequence(string_view text, unordered_map<uint64_t, uint32_t>& sentences);
+vector<DiffRun> diffSequences(const vector<uint32_t>& a, const vector<uint32_t>& b);
+void writeDiff(ostream& out, const vector<DiffRun>& runs, const DiffSequence& seq1, const DiffSequence& seq2,
+               string_view text1, string_view text2, const string& name1, const string& name2, bool sideBySide, size_t context);
+vector<CommonWordCount> getCommonWordsWithCounts(const DocumentStats& doc1, const DocumentStats& doc2);
+void printCommonWordsAnalysis(const DocumentStats& doc1, const DocumentStats& doc2, const vector<CommonWordCount>& commonWords, size_t limit = 15);
+void printHeader();
+void printSeparator(char ch = '=', int length = 80);
+string padColumn(string_view text, size_t width);
+void printComparisonTable(const DocumentStats& doc1, const DocumentStats& doc2, const VocabularyOverlap& overlap,
+                          const vector<SimilarityScore>& scores = {});
+bool parseReportFormat(const string& name, ReportFormat& format);
+template <typename Count>
+bool parseCount(const string& option, const string& value, Count& count);
+bool parseNumber(const string& option, const string& value, double& number);
+bool parseMegabytes(const string& option, const string& value, size_t& bytes);
+string defaultReportPath(const string& stem, ReportFormat format);
+void writeReportToFile(const DocumentStats& doc1, const DocumentStats& doc2, const VocabularyOverlap& overlap, const vector<CommonWordCount>& commonWords,
+                       const string& reportFilename = "result.txt", const vector<SimilarityScore>& scores = {},
+                       ReportFormat format = REPORT_TEXT);
+void renderReport(ReportBuffer& out, const ReportContent& content, ReportFormat format);
+void renderDocuments(ReportBuffer& out, const vector<const DocumentStats*>& docs, ReportFormat format);
+void writeDocumentSection(ReportBuffer& out, const string& label, const DocumentStats& doc);
+void performWordReplacement(const DocumentStats& original1, const DocumentStats& original2,
+                            const vector<CommonWordCount>& originalCommon, bool verifyUpdates);
+vector<DocumentStats> replaceInDocuments(const DocumentStats& original1, const DocumentStats& original2,
+                                         const vector<CommonWordCount>& originalCommon,
+                                         const vector<pair<string, string>>& replacements, int option,
+                                         bool verifyUpdates, const string& reportPath = "result_updated.txt",
+                                         ReportFormat reportFormat = REPORT_TEXT);
+bool applyReplacementDelta(DocumentStats& stats, string_view original, const ReplacementEngine& engine,
+                           const vector<ReplacementEngine::Match>& matches, vector<uint32_t>& changedIds);
+void updateCommonWords(vector<CommonWordCount>& common, const DocumentStats& doc1, const DocumentStats& doc2,
+                       vector<uint32_t> changedIds);
+bool sameAnalysis(const DocumentStats& a, const DocumentStats& b);
+vector<pair<string, string>> parseReplacements(const string& oldWords, const string& newWords);
+DocumentStats analyzeDocument(const string& filename);
+DocumentStats analyzeText(const string& filename, string_view content);
+DocumentStats analyzeCached(const string& filename, string_view content);
+DocumentStats analyzeStream(const string& filename, const StreamOptions& options);
+void generateUpdatedReport(const DocumentStats& doc1, const DocumentStats& doc2, const vector<CommonWordCount>& commonWords,
+                           const vector<pair<string, string>>& replacements, const string& reportFilename = "result_updated.txt",
+                           ReportFormat format = REPORT_TEXT);
+vector<string> collectBatchInputs(const string& source);
+vector<DocumentStats> analyzeDocumentsParallel(const vector<string>& files, ThreadPool& pool, const StreamOptions& stream);
+bool runBatchComparison(const BatchOptions& options);
+bool writeNearDuplicates(const vector<DocumentStats>& docs, const BatchOptions& options, ThreadPool& pool);
+int runBatchMode(const vector<string>& args);
+DocumentStats queryTerms(string_view text);
+void serveConnection(FILE* in, FILE* out, const InvertedIndex& index, const ServeOptions& options);
+int runServeMode(const vector<string>& args);
+string corpusWord(size_t rank);
+string generateCorpus(const CorpusOptions& options);
+vector<BenchResult> runBenchmarks(const BenchOptions& options);
+bool writeBenchBaseline(const vector<BenchResult>& results, const BenchOptions& options);
+bool compareBenchBaseline(const vector<BenchResult>& results, const BenchOptions& options);
+int runBenchMode(const vector<string>& args);
+int runGenerateMode(const vector<string>& args);
+int runCommand(const vector<string>& args, DocumentStore& store);
+int runJobFile(const string& path, DocumentStore& store);
+void printUsage();
+
+int main(int argc, char* argv[]) {
+    // --verify-updates re-analyzes replaced documents in full to check the
+    // incremental update
+    vector<string> args(argv + 1, argv + argc);
+#ifdef TEXTCMP_TRACE
+    TraceSession trace(args);
+#endif
+    bool verifyUpdates = args.size() == 1 && args[0] == "--verify-updates";
+    if (!args.empty() && !verifyUpdates) {
+        DocumentStore store;
+        return runCommand(args, store);
+    }
+    
+    printHeader();
+    
+    string file1, file2;
+    
+    cout << "\n Enter path to first document: ";
+    getline(cin, file1);
+    
+    cout << " Enter path to second document: ";
+    getline(cin, file2);
+    
+    cout << "\n Processing documents: \n";
+    printSeparator('-', 50);
+    
+    // Analyze both documents
+    DocumentStats doc1 = analyzeDocument(file1);
+    DocumentStats doc2 = analyzeDocument(file2);
+    
+    if (doc1.wordCount == 0 || doc2.wordCount == 0) {
+        cout << " Error: Could not process one or both documents.\n";
+        return 1;
+    }
+    
+    // One merge of the vocabularies gives the common words, the similarity
+    // and every count shown below
+    vector<CommonWordCount> commonWords = getCommonWordsWithCounts(doc1, doc2);
+    VocabularyOverlap overlap(doc1.uniqueWords.size(), doc2.uniqueWords.size(), commonWords.size());
+    
+    // Display results
+    printComparisonTable(doc1, doc2, overlap);
+    
+    // Common words analysis
+    printCommonWordsAnalysis(doc1, doc2, commonWords);
+    
+    // Write detailed report
+    writeReportToFile(doc1, doc2, overlap, commonWords);
+    
+    cout << "\n Completed Successfully!\n Detailed report saved to 'result.txt'\n";
+    printSeparator();
+    
+    // Ask for word replacement
+    performWordReplacement(doc1, doc2, commonWords, verifyUpdates);
+    
+    return 0;
+}
+
+
+FileBuffer::~FileBuffer() {
+    release();
+}
+
+FileBuffer::FileBuffer(FileBuffer&& other) noexcept
+    : mapped(other.mapped), mappedSize(other.mappedSize), owned(move(other.owned)) {
+    other.mapped = nullptr;
+    other.mappedSize = 0;
+}
+
+FileBuffer& FileBuffer::operator=(FileBuffer&& other) noexcept {
+    if (this != &other) {
+        release();
+        mapped = other.mapped;
+        mappedSize = other.mappedSize;
+        owned = move(other.owned);
+        other.mapped = nullptr;
+        other.mappedSize = 0;
+    }
+    return *this;
+}
+
+void FileBuffer::release() {
+#ifndef _WIN32
+    if (mapped) {
+        munmap(const_cast<char*>(mapped), mappedSize);
+    }
+#endif
+    mapped = nullptr;
+    mappedSize = 0;
+    owned.clear();
+}
+
+// Reads the whole stream in large blocks; used for stdin, pipes and as the
+// fallback when a file cannot be mapped.
+bool FileBuffer::readStream(FILE* stream) {
+    char block[1 << 16];
+    size_t got;
+    while ((got = fread(block, 1, sizeof(block), stream)) > 0) {
+        owned.append(block, got);
+    }
+    return !ferror(stream);
+}
+
+// A mapped file is only read when it is scanned, so its page faults show up
+// in the scan stages of a trace
+bool FileBuffer::open(const string& filename) {
+    TRACE_SCOPE("load");
+    release();
+    if (filename == "-") {
+        return readStream(stdin);
+    }
+#ifndef _WIN32
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, info.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            mapped = static_cast<const char*>(data);
+            mappedSize = info.st_size;
+            return true;
+        }
+    }
+    FILE* stream = fdopen(fd, "rb");
+    if (!stream) {
+        close(fd);
+        return false;
+    }
+#else
+    FILE* stream = fopen(filename.c_str(), "rb");
+    if (!stream) {
+        return false;
+    }
+#endif
+    bool ok = readStream(stream);
+    fclose(stream);
+    if (!ok) {
+        release();
+    }
+    TRACE_COUNT(text().size(), 0);
+    return ok;
+}
+
+// maps (or reads) the whole file into buffer and reports success or failure.
+// Line breaks stay in place; the tokenizer already treats them as whitespace.
+bool loadFile(const string& filename, FileBuffer& buffer) {
+    if (!buffer.open(filename)) {
+        cout << " Error: Cannot open file '" << filename << "'\n";
+        return false;
+    }
+    
+    cout << " Successfully loaded into the " << filename << "\n";
+    return true;
+}
+
+// takes a string of text and splits it into words (tokens), returning them in a vector<string>.
+vector<string> tokenize(string_view text) {
+    vector<string> tokens;
+    TokenScanner scanner;
+    auto collect = [&](string_view word) {
+        tokens.emplace_back(word);
+    };
+    scanner.feed(text, collect);
+    scanner.finish(collect);
+    return tokens;
+}
+
+size_t classifyBlockScalar(const char* text, BlockMasks& masks, char* lowered) {
+    masks = BlockMasks{0, 0, 0};
+    for (size_t i = 0; i < 16; i++) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        switch (kCharTable.cls[c]) {
+        case CHAR_TERMINATOR: masks.terminator |= 1u << i; break;
+        case CHAR_SEPARATOR: masks.separator |= 1u << i; break;
+        case CHAR_DROP: masks.drop |= 1u << i; break;
+        default: break;
+        }
+        lowered[i] = static_cast<char>(c | 0x20);
+    }
+    return 16;
+}
+
+#ifdef TEXTCMP_X86
+// Signed byte compares are enough for the ASCII ranges below: bytes >= 0x80
+// are negative and fall outside every range.
+size_t classifyBlockSse2(const char* text, BlockMasks& masks, char* lowered) {
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text));
+    __m128i folded = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_sub_epi8(folded, _mm_set1_epi8('a'));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(alpha, _mm_set1_epi8(-1)),
+                                   _mm_cmplt_epi8(alpha, _mm_set1_epi8(26)));
+    __m128i terminator = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('.')),
+                                                   _mm_cmpeq_epi8(c, _mm_set1_epi8('!'))),
+                                      _mm_cmpeq_epi8(c, _mm_set1_epi8('?')));
+    __m128i space = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+                                 _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(8)),
+                                               _mm_cmplt_epi8(c, _mm_set1_epi8(14))));
+    __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(0x20)),
+                                      _mm_cmplt_epi8(c, _mm_set1_epi8(0x7f)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i punct = _mm_andnot_si128(_mm_or_si128(_mm_or_si128(letter, digit), terminator), printable);
+    __m128i separator = _mm_or_si128(space, punct);
+    __m128i kept = _mm_or_si128(_mm_or_si128(letter, terminator), separator);
+    masks.terminator = _mm_movemask_epi8(terminator);
+    masks.separator = _mm_movemask_epi8(separator);
+    masks.drop = ~_mm_movemask_epi8(kept) & 0xFFFF;
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lowered), folded);
+    return 16;
+}
+
+__attribute__((target("avx2")))
+size_t classifyBlockAvx2(const char* text, BlockMasks& masks, char* lowered) {
+    __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text));
+    __m256i folded = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i alpha = _mm256_sub_epi8(folded, _mm256_set1_epi8('a'));
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(alpha, _mm256_set1_epi8(-1)),
+                                      _mm256_cmpgt_epi8(_mm256_set1_epi8(26), alpha));
+    __m256i terminator = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('.')),
+                                                         _mm256_cmpeq_epi8(c, _mm256_set1_epi8('!'))),
+                                         _mm256_cmpeq_epi8(c, _mm256_set1_epi8('?')));
+    __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+                                    _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(8)),
+                                                     _mm256_cmpgt_epi8(_mm256_set1_epi8(14), c)));
+    __m256i printable = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(0x20)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), c));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    __m256i punct = _mm256_andnot_si256(_mm256_or_si256(_mm256_or_si256(letter, digit), terminator), printable);
+    __m256i separator = _mm256_or_si256(space, punct);
+    __m256i kept = _mm256_or_si256(_mm256_or_si256(letter, terminator), separator);
+    masks.terminator = _mm256_movemask_epi8(terminator);
+    masks.separator = _mm256_movemask_epi8(separator);
+    masks.drop = ~static_cast<uint32_t>(_mm256_movemask_epi8(kept));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lowered), folded);
+    return 32;
+}
+#endif
+
+static BlockClassifier selectBlockClassifier() {
+#ifdef TEXTCMP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return classifyBlockAvx2;
+    }
+    return classifyBlockSse2;
+#else
+    return classifyBlockScalar;
+#endif
+}
+
+BlockClassifier classifyBlock = selectBlockClassifier();
+
+int decodeUtf8(const unsigned char* text, size_t available, uint32_t& cp) {
+    unsigned char lead = text[0];
+    size_t length;
+    uint32_t value;
+    // Allowed range of the second byte; the lead alone cannot rule out
+    // overlong forms, surrogates or code points past U+10FFFF
+    unsigned char low = 0x80;
+    unsigned char high = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+        value = lead & 0x1F;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        value = lead & 0x0F;
+        low = lead == 0xE0 ? 0xA0 : 0x80;
+        high = lead == 0xED ? 0x9F : 0xBF;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        value = lead & 0x07;
+        low = lead == 0xF0 ? 0x90 : 0x80;
+        high = lead == 0xF4 ? 0x8F : 0xBF;
+    } else {
+        return -1;
+    }
+    for (size_t k = 1; k < length; k++) {
+        if (k >= available) {
+            return 0;
+        }
+        unsigned char c = text[k];
+        if (c < low || c > high) {
+            return -1;
+        }
+        value = (value << 6) | (c & 0x3F);
+        low = 0x80;
+        high = 0xBF;
+    }
+    cp = value;
+    return static_cast<int>(length);
+}
+
+size_t encodeUtf8(uint32_t cp, char* out) {
+    if (cp < 0x80) {
+        out[0] = static_cast<char>(cp);
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = static_cast<char>(0xC0 | (cp >> 6));
+        out[1] = static_cast<char>(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = static_cast<char>(0xE0 | (cp >> 12));
+        out[1] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = static_cast<char>(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = static_cast<char>(0xF0 | (cp >> 18));
+    out[1] = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = static_cast<char>(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+bool wordCharacterAt(string_view text, size_t pos) {
+    if (pos >= text.size()) {
+        return false;
+    }
+    unsigned char c = static_cast<unsigned char>(text[pos]);
+    if (c < 0x80) {
+        return isalnum(c);
+    }
+    uint32_t cp;
+    if (decodeUtf8(reinterpret_cast<const unsigned char*>(text.data() + pos), text.size() - pos, cp) <= 0) {
+        return false;
+    }
+    unsigned cls = unicodeEntry(cp) & 7;
+    return cls == CHAR_LETTER || cls == CHAR_IDEOGRAPH;
+}
+
+bool wordCharacterBefore(string_view text, size_t pos) {
+    // Back up over at most three continuation bytes to the character's start
+    size_t start = pos;
+    while (start > 0 && pos - start < 4) {
+        start--;
+        if ((static_cast<unsigned char>(text[start]) & 0xC0) != 0x80) {
+            break;
+        }
+    }
+    if (start == pos) {
+        return false;
+    }
+    uint32_t cp;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(text.data() + start);
+    if (static_cast<unsigned char>(text[start]) >= 0x80 && decodeUtf8(bytes, pos - start, cp) != static_cast<int>(pos - start)) {
+        return false;
+    }
+    return wordCharacterAt(text, start);
+}
+
+// WORD NORMALIZATION
+
+// English stop words as the tokenizer emits them; contractions are split at
+// the apostrophe, so "don't" arrives as "don" and "t"
+constexpr string_view kStopWords[] = {
+    "a", "about", "above", "after", "again", "against", "ain", "all", "am", "an", "and", "any", "are", "aren",
+    "as", "at", "be", "because", "been", "before", "being", "below", "between", "both", "but", "by", "can",
+    "couldn", "d", "did", "didn", "do", "does", "doesn", "doing", "don", "down", "during", "each", "few", "for",
+    "from", "further", "had", "hadn", "has", "hasn", "have", "haven", "having", "he", "her", "here", "hers",
+    "herself", "him", "himself", "his", "how", "i", "if", "in", "into", "is", "isn", "it", "its", "itself",
+    "just", "ll", "m", "ma", "me", "mightn", "more", "most", "mustn", "my", "myself", "needn", "no", "nor",
+    "not", "now", "o", "of", "off", "on", "once", "only", "or", "other", "our", "ours", "ourselves", "out",
+    "over", "own", "re", "s", "same", "shan", "she", "should", "shouldn", "so", "some", "such", "t", "than",
+    "that", "the", "their", "theirs", "them", "themselves", "then", "there", "these", "they", "this", "those",
+    "through", "to", "too", "under", "until", "up", "ve", "very", "was", "wasn", "we", "were", "weren", "what",
+    "when", "where", "which", "while", "who", "whom", "why", "will", "with", "won", "wouldn", "y", "you",
+    "your", "yours", "yourself", "yourselves"
+};
+
+// Perfect hash set of the stop words: a word's top bits pick its bucket, and
+// the bucket's displacement picks its slot, so a lookup is two table reads and
+// one comparison
+constexpr size_t kStopWordBucketBits = 6;
+constexpr size_t kStopWordBuckets = size_t(1) << kStopWordBucketBits;
+constexpr size_t kStopWordSlots = 256;
+constexpr size_t kStopWordCount = sizeof(kStopWords) / sizeof(kStopWords[0]);
+
+// FNV-1a, which unlike hashWord can run at compile time, with a final mix so
+// the bucket, slot and step bits all depend on every byte of short words
+constexpr uint64_t stopWordHash(string_view word) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (char c : word) {
+        h = (h ^ static_cast<unsigned char>(c)) * 0x100000001B3ull;
+    }
+    h = (h ^ (h >> 33)) * 0xFF51AFD7ED558CCDull;
+    return h ^ (h >> 33);
+}
+
+// The step is odd, so the displacements of a bucket reach every slot
+constexpr size_t stopWordSlot(uint64_t h, unsigned displacement) {
+    return (h + displacement * ((h >> 32) | 1)) & (kStopWordSlots - 1);
+}
+
+struct StopWordTable {
+    uint8_t displacement[kStopWordBuckets];
+    string_view slots[kStopWordSlots];
+    bool complete;
+};
+
+// Hash and displace: buckets are placed largest first, each with the first
+// displacement that puts all of its words into free slots
+constexpr StopWordTable buildStopWordTable() {
+    StopWordTable table{};
+    size_t bucketOf[kStopWordCount] = {};
+    size_t bucketSize[kStopWordBuckets] = {};
+    bool placed[kStopWordBuckets] = {};
+    for (size_t w = 0; w < kStopWordCount; w++) {
+        bucketOf[w] = stopWordHash(kStopWords[w]) >> (64 - kStopWordBucketBits);
+        bucketSize[bucketOf[w]]++;
+    }
+    for (size_t round = 0; round < kStopWordBuckets; round++) {
+        size_t bucket = kStopWordBuckets;
+        for (size_t b = 0; b < kStopWordBuckets; b++) {
+            if (!placed[b] && (bucket == kStopWordBuckets || bucketSize[b] > bucketSize[bucket])) {
+                bucket = b;
+            }
+        }
+        placed[bucket] = true;
+        size_t members[kStopWordCount] = {};
+        size_t count = 0;
+        for (size_t w = 0; w < kStopWordCount; w++) {
+            if (bucketOf[w] == bucket) {
+                members[count++] = w;
+            }
+        }
+        bool fits = count == 0;
+        for (unsigned d = 0; d < 256 && !fits; d++) {
+            size_t taken[kStopWordCount] = {};
+            fits = true;
+            for (size_t i = 0; i < count && fits; i++) {
+                taken[i] = stopWordSlot(stopWordHash(kStopWords[members[i]]), d);
+                fits = table.slots[taken[i]].empty();
+                for (size_t j = 0; j < i && fits; j++) {
+                    fits = taken[j] != taken[i];
+                }
+            }
+            if (fits) {
+                table.displacement[bucket] = static_cast<uint8_t>(d);
+                for (size_t i = 0; i < count; i++) {
+                    table.slots[taken[i]] = kStopWords[members[i]];
+                }
+            }
+        }
+        if (!fits) {
+            return table;
+        }
+    }
+    table.complete = true;
+    return table;
+}
+
+constexpr StopWordTable kStopWordTable = buildStopWordTable();
+static_assert(kStopWordTable.complete, "no displacement places every stop word; grow kStopWordSlots");
+
+bool isStopWord(string_view word) {
+    uint64_t h = stopWordHash(word);
+    return kStopWordTable.slots[stopWordSlot(h, kStopWordTable.displacement[h >> (64 - kStopWordBucketBits)])] == word;
+}
+
+// The Porter (1980) suffix-stripping algorithm on b[0..k]. Every rule replaces
+// a suffix with a shorter one, so the stem is written over the word itself.
+class PorterStemmer {
+public:
+    PorterStemmer(char* word, size_t length) : b(word), k(static_cast<int>(length) - 1) {}
+
+    size_t stem() {
+        if (k <= 1) {
+            return k + 1;
+        }
+        step1ab();
+        if (k > 0) {
+            step1c();
+            step2();
+            step3();
+            step4();
+            step5();
+        }
+        return k + 1;
+    }
+
+private:
+    bool consonant(int i) const {
+        switch (b[i]) {
+        case 'a': case 'e': case 'i': case 'o': case 'u':
+            return false;
+        case 'y':
+            return i == 0 || !consonant(i - 1);
+        default:
+            return true;
+        }
+    }
+
+    // Number of vowel-consonant sequences in b[0..j]
+    int measure() const {
+        int n = 0;
+        int i = 0;
+        while (i <= j && consonant(i)) {
+            i++;
+        }
+        while (i <= j) {
+            while (i <= j && !consonant(i)) {
+                i++;
+            }
+            if (i > j) {
+                break;
+            }
+            n++;
+            while (i <= j && consonant(i)) {
+                i++;
+            }
+        }
+        return n;
+    }
+
+    bool vowelInStem() const {
+        for (int i = 0; i <= j; i++) {
+            if (!consonant(i)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool doubleConsonant(int i) const {
+        return i >= 1 && b[i] == b[i - 1] && consonant(i);
+    }
+
+    // Consonant-vowel-consonant ending at i, the last not w, x or y
+    bool cvc(int i) const {
+        if (i < 2 || !consonant(i) || consonant(i - 1) || !consonant(i - 2)) {
+            return false;
+        }
+        return b[i] != 'w' && b[i] != 'x' && b[i] != 'y';
+    }
+
+    // Whether b[0..k] ends with suffix; j is then the end of the rest
+    bool ends(string_view suffix) {
+        int length = static_cast<int>(suffix.size());
+        // Most suffixes already differ in their last letter
+        if (length > k + 1 || (length > 0 && suffix.back() != b[k]) ||
+            memcmp(b + k - length + 1, suffix.data(), length) != 0) {
+            return false;
+        }
+        j = k - length;
+        return true;
+    }
+
+    void setTo(string_view suffix) {
+        memcpy(b + j + 1, suffix.data(), suffix.size());
+        k = j + static_cast<int>(suffix.size());
+    }
+
+    void replaceIfMeasured(string_view suffix) {
+        if (measure() > 0) {
+            setTo(suffix);
+        }
+    }
+
+    // Plurals and -ed or -ing
+    void step1ab() {
+        if (b[k] == 's') {
+            if (ends("sses")) {
+                k -= 2;
+            } else if (ends("ies")) {
+                setTo("i");
+            } else if (b[k - 1] != 's') {
+                k--;
+            }
+        }
+        if (ends("eed")) {
+            if (measure() > 0) {
+                k--;
+            }
+        } else if ((ends("ed") || ends("ing")) && vowelInStem()) {
+            k = j;
+            if (ends("at")) {
+                setTo("ate");
+            } else if (ends("bl")) {
+                setTo("ble");
+            } else if (ends("iz")) {
+                setTo("ize");
+            } else if (doubleConsonant(k)) {
+                k--;
+                if (b[k] == 'l' || b[k] == 's' || b[k] == 'z') {
+                    k++;
+                }
+            } else if (measure() == 1 && cvc(k)) {
+                setTo("e");
+            }
+        }
+    }
+
+    // Terminal y to i when there is another vowel in the stem
+    void step1c() {
+        if (ends("y") && vowelInStem()) {
+            b[k] = 'i';
+        }
+    }
+
+    // Double suffixes to single ones
+    void step2() {
+        static constexpr pair<string_view, string_view> kRules[] = {
+            {"ational", "ate"}, {"tional", "tion"}, {"enci", "ence"}, {"anci", "ance"}, {"izer", "ize"},
+            {"bli", "ble"}, {"alli", "al"}, {"entli", "ent"}, {"eli", "e"}, {"ousli", "ous"},
+            {"ization", "ize"}, {"ation", "ate"}, {"ator", "ate"}, {"alism", "al"}, {"iveness", "ive"},
+            {"fulness", "ful"}, {"ousness", "ous"}, {"aliti", "al"}, {"iviti", "ive"}, {"biliti", "ble"},
+            {"logi", "log"}
+        };
+        applyFirst(kRules);
+    }
+
+    // -ic-, -full, -ness and similar
+    void step3() {
+        static constexpr pair<string_view, string_view> kRules[] = {
+            {"icate", "ic"}, {"ative", ""}, {"alize", "al"}, {"iciti", "ic"}, {"ical", "ic"}, {"ful", ""},
+            {"ness", ""}
+        };
+        applyFirst(kRules);
+    }
+
+    // -ant, -ence and similar where the stem is long enough
+    void step4() {
+        static constexpr string_view kSuffixes[] = {
+            "al", "ance", "ence", "er", "ic", "able", "ible", "ant", "ement", "ment", "ent", "ion", "ou",
+            "ism", "ate", "iti", "ous", "ive", "ize"
+        };
+        for (string_view suffix : kSuffixes) {
+            if (ends(suffix)) {
+                if (suffix == "ion" && (j < 0 || (b[j] != 's' && b[j] != 't'))) {
+                    return;
+                }
+                if (measure() > 1) {
+                    k = j;
+                }
+                return;
+            }
+        }
+    }
+
+    // Final -e and -ll
+    void step5() {
+        j = k;
+        if (b[k] == 'e') {
+            int m = measure();
+            if (m > 1 || (m == 1 && !cvc(k - 1))) {
+                k--;
+            }
+        }
+        if (b[k] == 'l' && doubleConsonant(k) && measure() > 1) {
+            k--;
+        }
+    }
+
+    // Rewrites the first matching suffix; only that one is considered
+    template <size_t N>
+    void applyFirst(const pair<string_view, string_view> (&rules)[N]) {
+        for (const auto& rule : rules) {
+            if (ends(rule.first)) {
+                replaceIfMeasured(rule.second);
+                return;
+            }
+        }
+    }
+
+    char* b;
+    int k;       // index of the last character of the word
+    int j = 0;   // index of the last character before the matched suffix
+};
+
+size_t stemWord(char* word, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (word[i] < 'a' || word[i] > 'z') {
+            return length;
+        }
+    }
+    return PorterStemmer(word, length).stem();
+}
+
+bool normalizeWord(const WordNormalization& normalization, char* word, size_t& length) {
+    while (length > 0 && kCharTable.cls[static_cast<unsigned char>(word[length - 1])] == CHAR_TERMINATOR) {
+        length--;
+    }
+    if (normalization.stopWords && isStopWord(string_view(word, length))) {
+        return false;
+    }
+    if (normalization.stem) {
+        length = stemWord(word, length);
+    }
+    return true;
+}
+
+StringArena::~StringArena() {
+    for (const Block& block : blocks) {
+        blocks.get_allocator().resource()->deallocate(block.data, block.size, 1);
+    }
+}
+
+string_view StringArena::store(string_view text) {
+    if (text.size() > capacity - used) {
+        capacity = max(kBlockSize, text.size());
+        blocks.push_back(Block{static_cast<char*>(blocks.get_allocator().resource()->allocate(capacity, 1)), capacity});
+        used = 0;
+    }
+    char* dest = blocks.back().data + used;
+    memcpy(dest, text.data(), text.size());
+    used += text.size();
+    return string_view(dest, text.size());
+}
+
+// Word-at-a-time multiply/xorshift hash; words are short, so this beats a
+// byte-wise hash while still mixing every input bit.
+uint64_t hashWord(string_view word) {
+    const char* p = word.data();
+    size_t n = word.size();
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ n;
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        h = (h ^ v) * 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 31;
+        p += 8;
+        n -= 8;
+    }
+    if (n > 0) {
+        uint64_t v = 0;
+        memcpy(&v, p, n);
+        h = (h ^ v) * 0x94D049BB133111EBull;
+        h ^= h >> 29;
+    }
+    h ^= h >> 32;
+    h *= 0xD6E8FEB86659FD93ull;
+    h ^= h >> 32;
+    return h;
+}
+
+uint32_t WordTable::insert(string_view word) {
+    if ((words.size() + 1) * 4 > slots.size() * 3) {
+        grow();
+    }
+    uint64_t h = hashWord(word);
+    uint32_t tag = static_cast<uint32_t>(h >> 32);
+    size_t mask = slots.size() - 1;
+    for (size_t pos = h & mask;; pos = (pos + 1) & mask) {
+        Slot& slot = slots[pos];
+        if (slot.index == npos) {
+            slot.tag = tag;
+            slot.index = static_cast<uint32_t>(words.size());
+            words.push_back(arena.store(word));
+            hashes.push_back(h);
+            return slot.index;
+        }
+        if (slot.tag == tag && words[slot.index] == word) {
+            return slot.index;
+        }
+    }
+}
+
+uint32_t WordTable::find(string_view word) const {
+    if (slots.empty()) {
+        return npos;
+    }
+    uint64_t h = hashWord(word);
+    uint32_t tag = static_cast<uint32_t>(h >> 32);
+    size_t mask = slots.size() - 1;
+    for (size_t pos = h & mask;; pos = (pos + 1) & mask) {
+        const Slot& slot = slots[pos];
+        if (slot.index == npos) {
+            return npos;
+        }
+        if (slot.tag == tag && words[slot.index] == word) {
+            return slot.index;
+        }
+    }
+}
+
+// Doubles the slot array and reinserts by the cached hashes; words never move
+void WordTable::grow() {
+    size_t newSize = slots.empty() ? 64 : slots.size() * 2;
+    slots.assign(newSize, Slot{0, npos});
+    size_t mask = newSize - 1;
+    for (uint32_t i = 0; i < words.size(); i++) {
+        size_t pos = hashes[i] & mask;
+        while (slots[pos].index != npos) {
+            pos = (pos + 1) & mask;
+        }
+        slots[pos] = Slot{static_cast<uint32_t>(hashes[i] >> 32), i};
+    }
+}
+
+// Inserts under the caller's lock and publishes new words to the stable chunks
+uint32_t WordInterner::insertLocked(string_view word) {
+    size_t before = table.size();
+    uint32_t id = table.insert(word);
+    if (table.size() != before) {
+        unique_ptr<string_view[]>& chunk = chunks[id >> kChunkBits];
+        if (!chunk) {
+            chunk.reset(new string_view[kChunkSize]);
+        }
+        chunk[id & (kChunkSize - 1)] = table.word(id);
+    }
+    return id;
+}
+
+uint32_t WordInterner::intern(string_view word) {
+    lock_guard<mutex> guard(lock);
+    return insertLocked(word);
+}
+
+// Interns a whole document vocabulary under a single lock acquisition;
+// result[i] is the shared ID of local.word(i)
+vector<uint32_t> WordInterner::internAll(const WordTable& local) {
+    vector<uint32_t> ids(local.size());
+    lock_guard<mutex> guard(lock);
+    for (uint32_t i = 0; i < local.size(); i++) {
+        ids[i] = insertLocked(local.word(i));
+    }
+    return ids;
+}
+
+uint32_t WordInterner::find(string_view word) const {
+    lock_guard<mutex> guard(lock);
+    return table.find(word);
+}
+
+size_t WordInterner::size() const {
+    lock_guard<mutex> guard(lock);
+    return table.size();
+}
+
+WordInterner& sharedVocabulary() {
+    static WordInterner vocabulary;
+    return vocabulary;
+}
+
+// Normalization of every document analyzed by the current command
+WordNormalization& sharedNormalization() {
+    static WordNormalization normalization;
+    return normalization;
+}
+
+// A word typed by the user as it appears in the vocabulary (empty for a stop word)
+string normalizedWord(string_view word) {
+    string normalized;
+    normalized.reserve(word.size());
+    TokenScanner scanner;
+    scanner.normalizeWith(sharedNormalization());
+    auto keep = [&](string_view token) {
+        normalized.assign(token);
+    };
+    scanner.feed(word, keep);
+    scanner.finish(keep);
+    return normalized;
+}
+
+// Documents this large are scanned in shards of at least kMinScanShard bytes
+constexpr size_t kShardedScanThreshold = size_t(8) << 20;
+constexpr size_t kMinScanShard = size_t(1) << 20;
+
+// Workers for scanning the shards of large documents, created on first use
+ThreadPool& sharedScanPool() {
+    static ThreadPool pool;
+    return pool;
+}
+
+// Counts words, sentences and word frequencies in one pass over the text.
+// Words are counted in a document-local table and only the distinct words are
+// interned into the shared vocabulary afterwards.
+void scanDocument(string_view text, DocumentStats& stats) {
+    TRACE_SCOPE("scan");
+    if (text.size() >= kShardedScanThreshold && thread::hardware_concurrency() > 1) {
+        ThreadPool& pool = sharedScanPool();
+        // About four shards per worker so uneven shards balance out
+        scanDocumentSharded(text, stats, pool, max(kMinScanShard, text.size() / (4 * pool.size())));
+        TRACE_COUNT(text.size(), stats.wordCount);
+        return;
+    }
+    
+    stats.wordCount = 0;
+    stats.sentences.clear();
+    pmr::monotonic_buffer_resource arena(analysisArenaSize(text.size()));
+    WordTable localWords(&arena);
+    pmr::vector<int> counts(&arena);
+    TokenScanner scanner(&stats.sentences);
+    scanner.normalizeWith(sharedNormalization());
+    auto countWord = [&](string_view word) {
+        stats.wordCount++;
+        uint32_t index = localWords.insert(word);
+        if (index == counts.size()) {
+            counts.push_back(1);
+        } else {
+            counts[index]++;
+        }
+    };
+    scanner.feed(text, countWord);
+    scanner.finish(countWord);
+    stats.wordCount += scanner.stopWordCount();
+    
+    stats.sentenceCount = max<int64_t>(scanner.terminatorCount(), 1); // At least 1 sentence
+    
+    setVocabulary(stats, localWords, counts);
+    stats.minHash = computeMinHash(localWords);
+    TRACE_COUNT(text.size(), stats.wordCount);
+}
+
+// Adds the counts of another vocabulary sorted by shared ID into stats
+static void mergeWordCounts(DocumentStats& stats, const DocumentStats& other) {
+    vector<uint32_t> words;
+    vector<int> counts;
+    words.reserve(stats.uniqueWords.size() + other.uniqueWords.size());
+    counts.reserve(words.capacity());
+    size_t i = 0, j = 0;
+    while (i < stats.uniqueWords.size() || j < other.uniqueWords.size()) {
+        if (j == other.uniqueWords.size() || (i < stats.uniqueWords.size() && stats.uniqueWords[i] < other.uniqueWords[j])) {
+            words.push_back(stats.uniqueWords[i]);
+            counts.push_back(stats.wordFrequency[i++]);
+        } else if (i == stats.uniqueWords.size() || other.uniqueWords[j] < stats.uniqueWords[i]) {
+            words.push_back(other.uniqueWords[j]);
+            counts.push_back(other.wordFrequency[j++]);
+        } else {
+            words.push_back(stats.uniqueWords[i]);
+            counts.push_back(stats.wordFrequency[i++] + other.wordFrequency[j++]);
+        }
+    }
+    stats.uniqueWords = move(words);
+    stats.wordFrequency = move(counts);
+}
+
+// scanDocument on a thread pool. The text is split right after whitespace
+// into shards of about shardSize bytes; no word is open after whitespace, so
+// every shard is tokenized and counted on its own, in its own word table. The
+// vocabularies are merged pairwise in parallel. Only the sentence open at
+// each split has to be joined, so the sentences come out as in one pass.
+void scanDocumentSharded(string_view text, DocumentStats& stats, ThreadPool& pool, size_t shardSize) {
+    vector<size_t> bounds{0};
+    while (text.size() - bounds.back() > shardSize) {
+        size_t split = bounds.back() + shardSize;
+        while (split < text.size() && kCharTable.cls[static_cast<unsigned char>(text[split - 1])] != CHAR_SEPARATOR) {
+            split++;
+        }
+        if (split == text.size()) {
+            break;
+        }
+        bounds.push_back(split);
+    }
+    bounds.push_back(text.size());
+    
+    struct Shard {
+        DocumentStats part;
+        size_t terminators;
+        uint64_t firstEnd;
+        uint32_t firstWords;
+        SentenceSpan open;
+    };
+    size_t n = bounds.size() - 1;
+    vector<Shard> shards(n);
+    for (size_t i = 0; i < n; i++) {
+        pool.submit([&, i] {
+            TRACE_SCOPE("scan-shard");
+            Shard& shard = shards[i];
+            DocumentStats& part = shard.part;
+            part.wordCount = 0;
+            pmr::monotonic_buffer_resource arena(analysisArenaSize(bounds[i + 1] - bounds[i]));
+            WordTable localWords(&arena);
+            pmr::vector<int> counts(&arena);
+            TokenScanner scanner(&part.sentences, bounds[i]);
+            scanner.normalizeWith(sharedNormalization());
+            auto countWord = [&](string_view word) {
+                part.wordCount++;
+                uint32_t index = localWords.insert(word);
+                if (index == counts.size()) {
+                    counts.push_back(1);
+                } else {
+                    counts[index]++;
+                }
+            };
+            scanner.feed(text.substr(bounds[i], bounds[i + 1] - bounds[i]), countWord);
+            scanner.flush(countWord);
+            part.wordCount += scanner.stopWordCount();
+            shard.terminators = scanner.terminatorCount();
+            shard.firstEnd = scanner.firstSentenceEnd();
+            shard.firstWords = scanner.firstSentenceWords();
+            shard.open = scanner.openSentence();
+            setVocabulary(part, localWords, counts);
+            part.minHash = computeMinHash(localWords);
+            TRACE_COUNT(bounds[i + 1] - bounds[i], part.wordCount);
+        });
+    }
+    pool.wait();
+    for (size_t step = 1; step < n; step *= 2) {
+        for (size_t i = 0; i + step < n; i += 2 * step) {
+            pool.submit([&, i, step] {
+                TRACE_SCOPE("merge-shards");
+                mergeWordCounts(shards[i].part, shards[i + step].part);
+            });
+        }
+        pool.wait();
+    }
+    
+    stats.wordCount = 0;
+    size_t terminators = 0;
+    stats.minHash = shards[0].part.minHash;
+    stats.sentences = move(shards[0].part.sentences);
+    SentenceSpan open = shards[0].open;
+    for (size_t i = 0; i < n; i++) {
+        Shard& shard = shards[i];
+        stats.wordCount += shard.part.wordCount;
+        terminators += shard.terminators;
+        for (size_t h = 0; h < kMinHashSize; h++) {
+            stats.minHash[h] = min(stats.minHash[h], shard.part.minHash[h]);
+        }
+        if (i == 0) {
+            continue;
+        }
+        // The shard's first sentence continues the one open at the split
+        if (shard.firstEnd == UINT64_MAX) {
+            open.words += shard.open.words;
+            continue;
+        }
+        auto rest = shard.part.sentences.begin();
+        if (rest != shard.part.sentences.end() && rest->offset == bounds[i]) {
+            ++rest;
+        }
+        uint32_t words = open.words + shard.firstWords;
+        if (words > 0) {
+            stats.sentences.push_back(SentenceSpan{open.offset, shard.firstEnd - open.offset, words});
+        }
+        stats.sentences.insert(stats.sentences.end(), rest, shard.part.sentences.end());
+        open = shard.open;
+    }
+    if (open.words > 0) {
+        stats.sentences.push_back(SentenceSpan{open.offset, text.size() - open.offset, open.words});
+    }
+    
+    stats.sentenceCount = max<int64_t>(terminators, 1); // At least 1 sentence
+    stats.uniqueWords = move(shards[0].part.uniqueWords);
+    stats.wordFrequency = move(shards[0].part.wordFrequency);
+}
+
+// Initial block of a document's analysis arena. The local word table, its
+// word bytes and the counts are carved out of a few large blocks, which are
+// released at once when the analysis ends instead of one allocation at a
+// time; in long batch and job runs this keeps the heap from fragmenting. The
+// vocabulary grows far slower than the text, so an eighth of the text covers
+// most documents in one block; arrays that outgrow theirs leave the old copy
+// behind until the end (at most as much again).
+size_t analysisArenaSize(size_t textSize) {
+    return min(max(textSize / 8, size_t(1) << 16), size_t(1) << 24);
+}
+
+// Interns a document-local vocabulary (counts[i] counts localWords.word(i))
+// and stores it sorted by shared ID, so documents can be merged like sets
+void setVocabulary(DocumentStats& stats, const WordTable& localWords, const pmr::vector<int>& counts) {
+    TRACE_SCOPE("unique-words");
+    TRACE_COUNT(0, counts.size());
+    vector<uint32_t> ids = sharedVocabulary().internAll(localWords);
+    pmr::vector<uint32_t> order(ids.size(), counts.get_allocator().resource());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return ids[a] < ids[b];
+    });
+    stats.uniqueWords.resize(order.size());
+    stats.wordFrequency.resize(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        stats.uniqueWords[i] = ids[order[i]];
+        stats.wordFrequency[i] = counts[order[i]];
+    }
+}
+
+// splitmix64, used to derive the MinHash permutations at compile time
+constexpr uint64_t mixSeed(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+struct MinHashCoefficients {
+    uint64_t multiply[kMinHashSize];
+    uint64_t add[kMinHashSize];
+};
+
+constexpr MinHashCoefficients buildMinHashCoefficients() {
+    MinHashCoefficients coefficients{};
+    for (size_t i = 0; i < kMinHashSize; i++) {
+        coefficients.multiply[i] = mixSeed(2 * i) | 1;
+        coefficients.add[i] = mixSeed(2 * i + 1);
+    }
+    return coefficients;
+}
+
+constexpr MinHashCoefficients kMinHashCoefficients = buildMinHashCoefficients();
+
+// Adds one word (by its hashWord value) to a signature
+static void foldMinHash(vector<uint32_t>& signature, uint64_t h) {
+    for (size_t i = 0; i < kMinHashSize; i++) {
+        uint32_t value = static_cast<uint32_t>((kMinHashCoefficients.multiply[i] * h + kMinHashCoefficients.add[i]) >> 32);
+        signature[i] = min(signature[i], value);
+    }
+}
+
+// Uses the hashes the word table already cached, so no word is hashed twice
+vector<uint32_t> computeMinHash(const WordTable& words) {
+    vector<uint32_t> signature(kMinHashSize, UINT32_MAX);
+    for (uint32_t w = 0; w < words.size(); w++) {
+        foldMinHash(signature, words.hash(w));
+    }
+    return signature;
+}
+
+// Same signature from shared word IDs, for stats that were updated in place
+vector<uint32_t> computeMinHash(const vector<uint32_t>& wordIds) {
+    const WordInterner& vocabulary = sharedVocabulary();
+    vector<uint32_t> signature(kMinHashSize, UINT32_MAX);
+    for (uint32_t id : wordIds) {
+        foldMinHash(signature, hashWord(vocabulary.word(id)));
+    }
+    return signature;
+}
+
+CountMinSketch::CountMinSketch(size_t widthBits) : widthBits(widthBits), counters(kDepth << widthBits, 0) {}
+
+size_t CountMinSketch::index(uint64_t hash, size_t row) const {
+    return (row << widthBits) + ((hash * kMinHashCoefficients.multiply[row]) >> (64 - widthBits));
+}
+
+void CountMinSketch::add(uint64_t hash) {
+    for (size_t row = 0; row < kDepth; row++) {
+        uint32_t& counter = counters[index(hash, row)];
+        counter += counter != UINT32_MAX;
+    }
+}
+
+uint32_t CountMinSketch::estimate(uint64_t hash) const {
+    uint32_t count = UINT32_MAX;
+    for (size_t row = 0; row < kDepth; row++) {
+        count = min(count, counters[index(hash, row)]);
+    }
+    return count;
+}
+
+// Estimated Jaccard similarity in percent, like jaccardSimilarity
+double estimateJaccard(const vector<uint32_t>& signature1, const vector<uint32_t>& signature2) {
+    size_t size = min(signature1.size(), signature2.size());
+    if (size == 0) return 0.0;
+    size_t matches = 0;
+    for (size_t i = 0; i < size; i++) {
+        matches += signature1[i] == signature2[i];
+    }
+    return static_cast<double>(matches) / size * 100.0;
+}
+
+LshIndex::LshIndex(double thresholdPercent) {
+    double threshold = thresholdPercent / 100.0;
+    double best = -1.0;
+    for (size_t r = 1; r <= kMinHashSize; r++) {
+        size_t b = kMinHashSize / r;
+        double curve = pow(1.0 / b, 1.0 / r);
+        if (curve <= threshold && curve > best) {
+            best = curve;
+            bands = b;
+            rows = r;
+        }
+    }
+    buckets.resize(bands);
+}
+
+void LshIndex::add(uint32_t doc, const vector<uint32_t>& signature) {
+    for (size_t band = 0; band < bands; band++) {
+        uint64_t key = band;
+        for (size_t r = 0; r < rows; r++) {
+            key = mixSeed(key ^ signature[band * rows + r]);
+        }
+        buckets[band][key].push_back(doc);
+    }
+}
+
+// Every pair sharing at least one bucket, each reported once as (lower, higher)
+vector<pair<uint32_t, uint32_t>> LshIndex::candidatePairs() const {
+    vector<pair<uint32_t, uint32_t>> pairs;
+    for (const auto& band : buckets) {
+        for (const auto& bucket : band) {
+            const vector<uint32_t>& docs = bucket.second;
+            for (size_t i = 0; i < docs.size(); i++) {
+                for (size_t j = i + 1; j < docs.size(); j++) {
+                    pairs.emplace_back(min(docs[i], docs[j]), max(docs[i], docs[j]));
+                }
+            }
+        }
+    }
+    sort(pairs.begin(), pairs.end());
+    pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+    return pairs;
+}
+
+// Frequency of a word in the document, 0 when absent
+// Words past a streaming vocabulary cap get their count-min estimate
+int getWordFrequency(const DocumentStats& doc, string_view word) {
+    int count = getWordFrequencyById(doc, sharedVocabulary().find(word));
+    if (count == 0 && doc.overflowCounts) {
+        count = doc.overflowCounts->estimate(hashWord(word));
+    }
+    return count;
+}
+
+int getWordFrequencyById(const DocumentStats& doc, uint32_t id) {
+    auto it = lower_bound(doc.uniqueWords.begin(), doc.uniqueWords.end(), id);
+    if (id == WordTable::npos || it == doc.uniqueWords.end() || *it != id) {
+        return 0;
+    }
+    return doc.wordFrequency[it - doc.uniqueWords.begin()];
+}
+
+double calculateAvgSentenceLength(int64_t wordCount, int64_t sentenceCount) {
+    return sentenceCount > 0 ? static_cast<double>(wordCount) / sentenceCount : 0.0;
+}
+
+// Most frequent words first, alphabetical among equal counts
+struct MoreFrequent {
+    bool operator()(const pair<string_view, int>& a, const pair<string_view, int>& b) const {
+        return a.second > b.second || (a.second == b.second && a.first < b.first);
+    }
+};
+
+vector<pair<string, int>> getTopFrequentWords(const DocumentStats& doc, int n) {
+    TRACE_SCOPE("top-k");
+    const WordInterner& vocabulary = sharedVocabulary();
+    TopK<pair<string_view, int>, MoreFrequent> top(max(n, 0));
+    for (size_t i = 0; i < doc.uniqueWords.size(); i++) {
+        top.offer(make_pair(vocabulary.word(doc.uniqueWords[i]), doc.wordFrequency[i]));
+    }
+    
+    vector<pair<string, int>> words;
+    for (const auto& entry : top.take()) {
+        words.emplace_back(string(entry.first), entry.second);
+    }
+    return words;
+}
+
+// Up to limit of the given words in alphabetical order, for listing in reports
+vector<string_view> alphabeticalWords(const vector<CommonWordCount>& common, size_t limit) {
+    const WordInterner& vocabulary = sharedVocabulary();
+    vector<string_view> words;
+    words.reserve(common.size());
+    for (const CommonWordCount& entry : common) {
+        words.push_back(vocabulary.word(entry.id));
+    }
+    limit = min(limit, words.size());
+    partial_sort(words.begin(), words.begin() + limit, words.end());
+    words.resize(limit);
+    return words;
+}
+
+// First sentence with the most words; the spans were recorded by the scanner,
+// so this is a single max over the array
+pair<string, int> findLongestSentence(const vector<SentenceSpan>& sentences, string_view text) {
+    TRACE_SCOPE("longest-sentence");
+    const SentenceSpan* longest = nullptr;
+    for (const SentenceSpan& sentence : sentences) {
+        if (!longest || sentence.words > longest->words) {
+            longest = &sentence;
+        }
+    }
+    if (!longest) {
+        return make_pair(string(), 0);
+    }
+    
+    // Line breaks are kept in the mapped text; report the sentence on one line
+    string result(text.substr(longest->offset, longest->length));
+    replace(result.begin(), result.end(), '\n', ' ');
+    return make_pair(result, static_cast<int>(longest->words));
+}
+
+// Sentence length (in words) at the given percentile, nearest-rank method.
+// Streamed documents only have the length histogram.
+double sentenceLengthPercentile(const DocumentStats& doc, double percentile) {
+    const vector<SentenceSpan>& sentences = doc.sentences;
+    if (sentences.empty()) {
+        uint64_t total = 0;
+        for (const auto& entry : doc.sentenceLengths) {
+            total += entry.second;
+        }
+        uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(percentile / 100.0 * total)));
+        for (const auto& entry : doc.sentenceLengths) {
+            if (rank <= entry.second) {
+                return entry.first;
+            }
+            rank -= entry.second;
+        }
+        return doc.sentenceLengths.empty() ? 0.0 : doc.sentenceLengths.rbegin()->first;
+    }
+    vector<uint32_t> lengths(sentences.size());
+    for (size_t i = 0; i < sentences.size(); i++) {
+        lengths[i] = sentences[i].words;
+    }
+    size_t rank = static_cast<size_t>(ceil(percentile / 100.0 * lengths.size()));
+    size_t index = min(lengths.size() - 1, rank > 0 ? rank - 1 : 0);
+    nth_element(lengths.begin(), lengths.begin() + index, lengths.end());
+    return lengths[index];
+}
+
+// Above this size ratio the small list is galloped through the large one
+// instead of merging both
+constexpr size_t kGallopRatio = 32;
+
+// First index >= from in data[0, size) whose value is >= value: exponential
+// probe from the current position, then binary search in the last step
+static size_t gallop(const uint32_t* data, size_t from, size_t size, uint32_t value) {
+    size_t step = 1;
+    size_t low = from;
+    size_t high = from;
+    while (high < size && data[high] < value) {
+        low = high + 1;
+        high = from + step;
+        step *= 2;
+    }
+    return lower_bound(data + low, data + min(high, size), value) - data;
+}
+
+// Calls onMatch(i, j) for every a[i] == b[j] of two sorted ID lists
+template <typename OnMatch>
+void forEachCommonId(const vector<uint32_t>& a, const vector<uint32_t>& b, OnMatch&& onMatch) {
+    if (a.size() * kGallopRatio < b.size() || b.size() * kGallopRatio < a.size()) {
+        bool swapped = a.size() > b.size();
+        const vector<uint32_t>& small = swapped ? b : a;
+        const vector<uint32_t>& large = swapped ? a : b;
+        size_t j = 0;
+        for (size_t i = 0; i < small.size() && j < large.size(); i++) {
+            j = gallop(large.data(), j, large.size(), small[i]);
+            if (j < large.size() && large[j] == small[i]) {
+                swapped ? onMatch(j, i) : onMatch(i, j);
+                j++;
+            }
+        }
+        return;
+    }
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        uint32_t x = a[i], y = b[j];
+        if (x == y) {
+            onMatch(i, j);
+        }
+        i += x <= y;
+        j += y <= x;
+    }
+}
+
+// Counting-only intersection: nothing is materialized. The balanced case is a
+// branchless merge (both cursors advance by comparison results).
+size_t intersectionSize(const vector<uint32_t>& words1, const vector<uint32_t>& words2) {
+    if (words1.size() * kGallopRatio < words2.size() || words2.size() * kGallopRatio < words1.size()) {
+        size_t count = 0;
+        forEachCommonId(words1, words2, [&](size_t, size_t) { count++; });
+        return count;
+    }
+    const uint32_t* a = words1.data();
+    const uint32_t* b = words2.data();
+    const uint32_t* aEnd = a + words1.size();
+    const uint32_t* bEnd = b + words2.size();
+    size_t count = 0;
+    while (a < aEnd && b < bEnd) {
+        uint32_t x = *a, y = *b;
+        count += x == y;
+        a += x <= y;
+        b += y <= x;
+    }
+    return count;
+}
+
+VocabularyOverlap compareVocabularies(const vector<uint32_t>& words1, const vector<uint32_t>& words2) {
+    return VocabularyOverlap(words1.size(), words2.size(), intersectionSize(words1, words2));
+}
+
+double jaccardSimilarity(const vector<uint32_t>& set1, const vector<uint32_t>& set2) {
+    return compareVocabularies(set1, set2).jaccard();
+}
+
+// Dot product and sum of element-wise minimums of two weight arrays, the two
+// sums every weighted metric is built from
+using WeightSums = void (*)(const float* a, const float* b, size_t n, double& dot, double& minSum);
+
+void weightSumsScalar(const float* a, const float* b, size_t n, double& dot, double& minSum) {
+    dot = 0;
+    minSum = 0;
+    for (size_t i = 0; i < n; i++) {
+        dot += static_cast<double>(a[i]) * b[i];
+        minSum += min(a[i], b[i]);
+    }
+}
+
+#ifdef TEXTCMP_X86
+// Four floats per step, widened to doubles so long documents keep precision
+__attribute__((target("avx2,fma")))
+void weightSumsAvx2(const float* a, const float* b, size_t n, double& dot, double& minSum) {
+    __m256d dots = _mm256_setzero_pd();
+    __m256d mins = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_cvtps_pd(_mm_loadu_ps(a + i));
+        __m256d y = _mm256_cvtps_pd(_mm_loadu_ps(b + i));
+        dots = _mm256_fmadd_pd(x, y, dots);
+        mins = _mm256_add_pd(mins, _mm256_min_pd(x, y));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, dots);
+    dot = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_pd(lanes, mins);
+    minSum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < n; i++) {
+        dot += static_cast<double>(a[i]) * b[i];
+        minSum += min(a[i], b[i]);
+    }
+}
+#endif
+
+static WeightSums selectWeightSums() {
+#ifdef TEXTCMP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return weightSumsAvx2;
+    }
+#endif
+    return weightSumsScalar;
+}
+
+static const WeightSums weightSums = selectWeightSums();
+
+const SimilarityMetricInfo& similarityMetricInfo(SimilarityMetric metric) {
+    for (const SimilarityMetricInfo& info : kSimilarityMetrics) {
+        if (info.metric == metric) {
+            return info;
+        }
+    }
+    return kSimilarityMetrics[0];
+}
+
+// Comma-separated metric names, or "all"
+bool parseSimilarityMetrics(const string& names, vector<SimilarityMetric>& metrics) {
+    stringstream list(names);
+    string name;
+    while (getline(list, name, ',')) {
+        bool known = false;
+        for (const SimilarityMetricInfo& info : kSimilarityMetrics) {
+            if (name == info.key || name == "all") {
+                metrics.push_back(info.metric);
+                known = true;
+            }
+        }
+        if (!known) {
+            cout << " Error: Unknown metric '" << name << "'\n";
+            return false;
+        }
+    }
+    return !metrics.empty();
+}
+
+// Smoothed IDF: log((1 + N) / (1 + df)) + 1, so no word gets a zero weight
+void SimilarityEngine::fit(const vector<const DocumentStats*>& corpus) {
+    if (metric != METRIC_TFIDF_COSINE) {
+        return;
+    }
+    vector<uint32_t> documentFrequency(sharedVocabulary().size(), 0);
+    for (const DocumentStats* doc : corpus) {
+        for (uint32_t id : doc->uniqueWords) {
+            documentFrequency[id]++;
+        }
+    }
+    double n = static_cast<double>(corpus.size());
+    idf.resize(documentFrequency.size());
+    for (size_t id = 0; id < idf.size(); id++) {
+        idf[id] = static_cast<float>(log((1.0 + n) / (1.0 + documentFrequency[id])) + 1.0);
+    }
+    unseenIdf = static_cast<float>(log(1.0 + n) + 1.0);
+}
+
+TermVector SimilarityEngine::vectorize(const DocumentStats& doc) const {
+    TermVector vec;
+    vec.ids = &doc.uniqueWords;
+    if (metric == METRIC_JACCARD) {
+        vec.total = doc.uniqueWords.size();
+        return vec;
+    }
+    vec.weights.resize(doc.uniqueWords.size());
+    double squares = 0;
+    for (size_t i = 0; i < vec.weights.size(); i++) {
+        float weight = static_cast<float>(doc.wordFrequency[i]);
+        if (metric == METRIC_TFIDF_COSINE) {
+            weight *= termWeight(doc.uniqueWords[i]);
+        }
+        vec.weights[i] = weight;
+        squares += static_cast<double>(weight) * weight;
+        vec.total += weight;
+    }
+    vec.norm = sqrt(squares);
+    return vec;
+}
+
+float SimilarityEngine::termWeight(uint32_t id) const {
+    if (metric != METRIC_TFIDF_COSINE) {
+        return 1.0f;
+    }
+    return id < idf.size() ? idf[id] : unseenIdf;
+}
+
+double SimilarityEngine::score(const TermVector& a, const TermVector& b) const {
+    if (metric == METRIC_JACCARD) {
+        return jaccardSimilarity(*a.ids, *b.ids);
+    }
+    // Weights of the common words side by side, then one SIMD pass
+    thread_local vector<float> commonA, commonB;
+    commonA.clear();
+    commonB.clear();
+    forEachCommonId(*a.ids, *b.ids, [&](size_t i, size_t j) {
+        commonA.push_back(a.weights[i]);
+        commonB.push_back(b.weights[j]);
+    });
+    double dot = 0, minSum = 0;
+    weightSums(commonA.data(), commonB.data(), commonA.size(), dot, minSum);
+    
+    double denominator = 0;
+    double numerator = minSum;
+    switch (metric) {
+    case METRIC_COSINE:
+    case METRIC_TFIDF_COSINE:
+        numerator = dot;
+        denominator = a.norm * b.norm;
+        break;
+    case METRIC_WEIGHTED_JACCARD:
+        denominator = a.total + b.total - minSum;
+        break;
+    case METRIC_CONTAINMENT:
+        denominator = a.total;
+        break;
+    case METRIC_OVERLAP:
+        denominator = min(a.total, b.total);
+        break;
+    default:
+        break;
+    }
+    return denominator > 0 ? numerator / denominator * 100.0 : 0.0;
+}
+
+// Fingerprints of a document by winnowing (Schleimer et al.): every k-word
+// shingle is hashed by a rolling hash over the word hashes, and of each w
+// consecutive shingles the one with the smallest hash (the rightmost on ties)
+// is kept. Every passage of at least w + k - 1 shared words then shares a
+// fingerprint. Words come straight from the tokenizer with their byte ranges,
+// and a monotonic queue makes the selection O(1) per shingle.
+ShingledDocument winnowDocument(string_view text, size_t shingleWords, size_t window) {
+    TRACE_SCOPE("winnow");
+    TRACE_COUNT(text.size(), 0);
+    const uint64_t kBase = 0x100000001B3ull;
+    uint64_t dropFactor = 1;    // kBase^(k-1), removes the word leaving the shingle
+    for (size_t i = 1; i < shingleWords; i++) {
+        dropFactor *= kBase;
+    }
+    vector<uint64_t> recentHashes(shingleWords);
+    vector<uint64_t> recentBegins(shingleWords);
+    uint64_t rolling = 0;
+    uint32_t words = 0;
+    
+    ShingledDocument doc;
+    deque<uint32_t> candidates;     // increasing hashes, positions within the window
+    TokenScanner scanner;
+    auto onWord = [&](string_view word) {
+        size_t slot = words % shingleWords;
+        uint64_t h = hashWord(word);
+        if (words >= shingleWords) {
+            rolling -= recentHashes[slot] * dropFactor;
+        }
+        rolling = rolling * kBase + h;
+        recentHashes[slot] = h;
+        recentBegins[slot] = scanner.wordBegin();
+        words++;
+        if (words < shingleWords) {
+            return;
+        }
+        
+        uint32_t position = words - static_cast<uint32_t>(shingleWords);
+        doc.shingles.push_back(Shingle{rolling, position, recentBegins[words % shingleWords], scanner.wordEnd()});
+        while (!candidates.empty() && doc.shingles[candidates.back()].hash >= rolling) {
+            candidates.pop_back();
+        }
+        candidates.push_back(position);
+        if (candidates.front() + window <= position) {
+            candidates.pop_front();
+        }
+        if (position + 1 >= window && (doc.fingerprints.empty() || doc.fingerprints.back() != candidates.front())) {
+            doc.fingerprints.push_back(candidates.front());
+        }
+    };
+    scanner.feed(text, onWord);
+    scanner.flush(onWord);
+    // A document shorter than one window still gets its smallest shingle
+    if (!doc.shingles.empty() && doc.shingles.size() < window) {
+        doc.fingerprints.push_back(candidates.front());
+    }
+    return doc;
+}
+
+// Looks up every fingerprint of the first document in a hash-to-position
+// index of the second. Each hit seeds a passage that is extended shingle by
+// shingle in both directions while the two documents keep matching; later
+// hits inside an extended passage are skipped, so every shingle is compared
+// about once. Fingerprints occurring very often in the second document
+// (boilerplate) are skipped too, which keeps the work linear.
+vector<PassageMatch> findMatchingPassages(const ShingledDocument& doc1, const ShingledDocument& doc2, size_t shingleWords) {
+    TRACE_SCOPE("match-passages");
+    const size_t kMaxPostings = 64;
+    unordered_map<uint64_t, vector<uint32_t>> index;
+    index.reserve(doc2.fingerprints.size());
+    for (uint32_t position : doc2.fingerprints) {
+        index[doc2.shingles[position].hash].push_back(position);
+    }
+    
+    struct Hit {
+        int64_t diagonal;       // position in the second document minus position in the first
+        uint32_t first;
+    };
+    vector<Hit> hits;
+    for (uint32_t position : doc1.fingerprints) {
+        auto it = index.find(doc1.shingles[position].hash);
+        if (it == index.end() || it->second.size() > kMaxPostings) {
+            continue;
+        }
+        for (uint32_t other : it->second) {
+            hits.push_back(Hit{int64_t(other) - position, position});
+        }
+    }
+    sort(hits.begin(), hits.end(), [](const Hit& a, const Hit& b) {
+        return a.diagonal < b.diagonal || (a.diagonal == b.diagonal && a.first < b.first);
+    });
+    
+    auto matches = [&](int64_t position, int64_t diagonal) {
+        return position >= 0 && position < int64_t(doc1.shingles.size()) && position + diagonal >= 0 &&
+               position + diagonal < int64_t(doc2.shingles.size()) &&
+               doc1.shingles[position].hash == doc2.shingles[position + diagonal].hash;
+    };
+    vector<PassageMatch> passages;
+    int64_t coveredDiagonal = 0, coveredUntil = -1;
+    for (const Hit& hit : hits) {
+        if (hit.diagonal == coveredDiagonal && int64_t(hit.first) <= coveredUntil) {
+            continue;
+        }
+        int64_t first = hit.first, last = hit.first;
+        while (matches(first - 1, hit.diagonal)) {
+            first--;
+        }
+        while (matches(last + 1, hit.diagonal)) {
+            last++;
+        }
+        coveredDiagonal = hit.diagonal;
+        coveredUntil = last;
+        passages.push_back(PassageMatch{doc1.shingles[first].begin, doc1.shingles[last].end,
+                                        doc2.shingles[first + hit.diagonal].begin, doc2.shingles[last + hit.diagonal].end,
+                                        static_cast<uint32_t>(last - first + shingleWords)});
+    }
+    sort(passages.begin(), passages.end(), [](const PassageMatch& a, const PassageMatch& b) {
+        return a.words > b.words || (a.words == b.words && a.begin1 < b.begin1);
+    });
+    return passages;
+}
+
+void printMatchingPassages(const vector<PassageMatch>& passages, string_view text1, size_t limit) {
+    const size_t kExcerptLength = 100;
+    for (size_t i = 0; i < min(limit, passages.size()); i++) {
+        const PassageMatch& passage = passages[i];
+        string excerpt(text1.substr(passage.begin1, min<uint64_t>(passage.end1 - passage.begin1, kExcerptLength)));
+        replace(excerpt.begin(), excerpt.end(), '\n', ' ');
+        if (passage.end1 - passage.begin1 > kExcerptLength) {
+            excerpt += "...";
+        }
+        cout << " #" << i + 1 << "  " << passage.words << " words   A bytes " << passage.begin1 << "-" << passage.end1
+             << "   B bytes " << passage.begin2 << "-" << passage.end2 << "\n";
+        cout << "     \"" << excerpt << "\"\n";
+    }
+    if (passages.size() > limit) {
+        cout << " ... (and " << passages.size() - limit << " more)\n";
+    }
+}
+
+// DIFF
+
+// Words of a document as IDs in a table shared by both sides of the diff
+DiffSequence wordSequence(string_view text, WordTable& words) {
+    TRACE_SCOPE("diff-tokenize");
+    TRACE_COUNT(text.size(), 0);
+    DiffSequence seq;
+    TokenScanner scanner;
+    auto onWord = [&](string_view word) {
+        seq.ids.push_back(words.insert(word));
+        seq.begins.push_back(scanner.wordBegin());
+        seq.ends.push_back(scanner.wordEnd());
+    };
+    scanner.feed(text, onWord);
+    scanner.flush(onWord);
+    return seq;
+}
+
+// Sentences of a document, two sentences getting the same ID when they have
+// the same words (case and punctuation aside)
+DiffSequence sentenceSequence(string_view text, unordered_map<uint64_t, uint32_t>& sentences) {
+    TRACE_SCOPE("diff-tokenize");
+    TRACE_COUNT(text.size(), 0);
+    DiffSequence seq;
+    vector<SentenceSpan> spans;
+    TokenScanner scanner(&spans);
+    auto ignore = [](string_view) {};
+    scanner.feed(text, ignore);
+    scanner.finish(ignore);
+    for (const SentenceSpan& span : spans) {
+        uint64_t key = 0;
+        TokenScanner words;
+        auto onWord = [&](string_view word) {
+            key = key * 0x100000001B3ull + hashWord(word);
+        };
+        words.feed(text.substr(span.offset, span.length), onWord);
+        words.finish(onWord);
+        seq.ids.push_back(sentences.emplace(key, static_cast<uint32_t>(sentences.size())).first->second);
+        seq.begins.push_back(span.offset);
+        seq.ends.push_back(span.offset + span.length);
+    }
+    return seq;
+}
+
+// Past a cost limit of edits in one search the middle snake search gives up
+// and splits at its furthest point, which bounds the time on very different
+// inputs at the price of a longer (still correct) edit script. Each forced
+// split costs about limit^2 steps and moves about limit tokens on, so the
+// limit shrinks with the input to keep the total near kDiffWork steps.
+constexpr int64_t kDiffCostLimit = 4096;
+constexpr int64_t kDiffMinCostLimit = 256;
+constexpr int64_t kDiffWork = int64_t(1) << 28;
+
+struct MiddleSnake {
+    size_t x, y;    // start in a and b
+    size_t u, v;    // end
+};
+
+// Middle snake of a[0, n) against b[0, m) (Myers 1986, section 4b): the
+// forward and backward searches for the shortest edit script meet on it.
+// vf and vb are reused between calls; backward coordinates count from the end.
+static MiddleSnake findMiddleSnake(const uint32_t* a, int64_t n, const uint32_t* b, int64_t m, int64_t costLimit,
+                                   vector<int64_t>& vf, vector<int64_t>& vb) {
+    int64_t delta = n - m;
+    bool odd = delta & 1;
+    int64_t maxD = min((n + m + 1) / 2, costLimit);
+    int64_t off = maxD + 2;
+    vf.assign(2 * off + 1, 0);
+    vb.assign(2 * off + 1, 0);
+    for (int64_t d = 0; d <= maxD; d++) {
+        for (int64_t k = -d; k <= d; k += 2) {
+            int64_t x = (k == -d || (k != d && vf[off + k - 1] < vf[off + k + 1])) ? vf[off + k + 1] : vf[off + k - 1] + 1;
+            int64_t y = x - k;
+            int64_t x0 = x, y0 = y;
+            while (x < n && y < m && a[x] == b[y]) {
+                x++;
+                y++;
+            }
+            vf[off + k] = x;
+            int64_t c = delta - k;
+            if (odd && c >= -(d - 1) && c <= d - 1 && x + vb[off + c] >= n) {
+                return MiddleSnake{size_t(x0), size_t(y0), size_t(x), size_t(y)};
+            }
+        }
+        for (int64_t k = -d; k <= d; k += 2) {
+            int64_t x = (k == -d || (k != d && vb[off + k - 1] < vb[off + k + 1])) ? vb[off + k + 1] : vb[off + k - 1] + 1;
+            int64_t y = x - k;
+            int64_t x0 = x, y0 = y;
+            while (x < n && y < m && a[n - 1 - x] == b[m - 1 - y]) {
+                x++;
+                y++;
+            }
+            vb[off + k] = x;
+            int64_t c = delta - k;
+            if (!odd && c >= -d && c <= d && vf[off + c] + x >= n) {
+                return MiddleSnake{size_t(n - x), size_t(m - y), size_t(n - x0), size_t(m - y0)};
+            }
+        }
+    }
+    // Too expensive: split at the forward point that got furthest
+    int64_t best = -maxD;
+    for (int64_t k = -maxD; k <= maxD; k += 2) {
+        int64_t x = min(vf[off + k], n), bestX = min(vf[off + best], n);
+        if (x - k <= m && x + (x - k) > bestX + (bestX - best)) {
+            best = k;
+        }
+    }
+    int64_t x = min(vf[off + best], n);
+    int64_t y = min(x - best, m);
+    return MiddleSnake{size_t(x), size_t(y), size_t(x), size_t(y)};
+}
+
+// Shortest edit script by Myers' O(ND) algorithm in linear space: common
+// prefix and suffix are trimmed, the middle snake splits the rest in two,
+// and both halves are solved the same way. An explicit stack instead of
+// recursion keeps the work in order without deep call chains; memory stays
+// O(n + m). Marks the tokens of a and b that are not part of the script's
+// common subsequence.
+static void markChanges(const vector<uint32_t>& a, const vector<uint32_t>& b, int64_t costLimit,
+                        vector<uint8_t>& changedA, vector<uint8_t>& changedB) {
+    struct Task {
+        size_t aLo, aHi, bLo, bHi;
+    };
+    vector<Task> tasks{Task{0, a.size(), 0, b.size()}};
+    vector<int64_t> vf, vb;
+    while (!tasks.empty()) {
+        Task task = tasks.back();
+        tasks.pop_back();
+        while (task.aLo < task.aHi && task.bLo < task.bHi && a[task.aLo] == b[task.bLo]) {
+            task.aLo++;
+            task.bLo++;
+        }
+        while (task.aHi > task.aLo && task.bHi > task.bLo && a[task.aHi - 1] == b[task.bHi - 1]) {
+            task.aHi--;
+            task.bHi--;
+        }
+        if (task.aLo == task.aHi || task.bLo == task.bHi) {
+            fill(changedA.begin() + task.aLo, changedA.begin() + task.aHi, 1);
+            fill(changedB.begin() + task.bLo, changedB.begin() + task.bHi, 1);
+            continue;
+        }
+        MiddleSnake snake = findMiddleSnake(a.data() + task.aLo, task.aHi - task.aLo, b.data() + task.bLo, task.bHi - task.bLo,
+                                            costLimit, vf, vb);
+        tasks.push_back(Task{task.aLo + snake.u, task.aHi, task.bLo + snake.v, task.bHi});
+        tasks.push_back(Task{task.aLo, task.aLo + snake.x, task.bLo, task.bLo + snake.y});
+    }
+}
+
+// Edit script of a against b. As in GNU diff, tokens that never occur on the
+// other side are changed in any script, so they are discarded before the
+// search; on unrelated documents this leaves it far less to do. The changes
+// become runs with deletions before the insertions they meet, as in diff(1).
+vector<DiffRun> diffSequences(const vector<uint32_t>& a, const vector<uint32_t>& b) {
+    TRACE_SCOPE("diff");
+    TRACE_COUNT(0, a.size() + b.size());
+    uint32_t ids = 0;
+    for (uint32_t id : a) {
+        ids = max(ids, id + 1);
+    }
+    for (uint32_t id : b) {
+        ids = max(ids, id + 1);
+    }
+    vector<uint8_t> inA(ids, 0), inB(ids, 0);
+    for (uint32_t id : a) {
+        inA[id] = 1;
+    }
+    for (uint32_t id : b) {
+        inB[id] = 1;
+    }
+    vector<uint8_t> changedA(a.size(), 1), changedB(b.size(), 1);
+    vector<uint32_t> keptA, keptB;
+    vector<size_t> indexA, indexB;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (inB[a[i]]) {
+            keptA.push_back(a[i]);
+            indexA.push_back(i);
+        }
+    }
+    for (size_t j = 0; j < b.size(); j++) {
+        if (inA[b[j]]) {
+            keptB.push_back(b[j]);
+            indexB.push_back(j);
+        }
+    }
+    int64_t total = max<int64_t>(keptA.size() + keptB.size(), 1);
+    int64_t costLimit = clamp(kDiffWork / total, kDiffMinCostLimit, kDiffCostLimit);
+    vector<uint8_t> keptChangedA(keptA.size(), 0), keptChangedB(keptB.size(), 0);
+    markChanges(keptA, keptB, costLimit, keptChangedA, keptChangedB);
+    for (size_t i = 0; i < keptA.size(); i++) {
+        changedA[indexA[i]] = keptChangedA[i];
+    }
+    for (size_t j = 0; j < keptB.size(); j++) {
+        changedB[indexB[j]] = keptChangedB[j];
+    }
+
+    vector<DiffRun> runs;
+    size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size()) {
+        DiffRun run{DIFF_EQUAL, i, j, 0};
+        if (i < a.size() && changedA[i]) {
+            run.kind = DIFF_DELETE;
+            while (i < a.size() && changedA[i]) {
+                i++;
+            }
+        } else if (j < b.size() && changedB[j]) {
+            run.kind = DIFF_INSERT;
+            while (j < b.size() && changedB[j]) {
+                j++;
+            }
+        } else {
+            while (i < a.size() && j < b.size() && !changedA[i] && !changedB[j]) {
+                i++;
+                j++;
+            }
+        }
+        run.length = max(i - run.a, j - run.b);
+        runs.push_back(run);
+    }
+    return runs;
+}
+
+// Original text of a token on one line
+static string diffTokenText(const DiffSequence& seq, size_t i, string_view text) {
+    string_view token = text.substr(seq.begins[i], seq.ends[i] - seq.begins[i]);
+    while (!token.empty() && isspace(static_cast<unsigned char>(token.front()))) {
+        token.remove_prefix(1);
+    }
+    while (!token.empty() && isspace(static_cast<unsigned char>(token.back()))) {
+        token.remove_suffix(1);
+    }
+    string line(token);
+    replace(line.begin(), line.end(), '\n', ' ');
+    replace(line.begin(), line.end(), '\r', ' ');
+    return line;
+}
+
+// Hunks of changes with up to context equal tokens around them, as a unified
+// diff (one token per line) or side by side
+void writeDiff(ostream& out, const vector<DiffRun>& runs, const DiffSequence& seq1, const DiffSequence& seq2,
+               string_view text1, string_view text2, const string& name1, const string& name2, bool sideBySide, size_t context) {
+    const size_t kColumn = 38;
+    out << "--- " << name1 << "\n+++ " << name2 << "\n";
+    size_t r = 0;
+    while (r < runs.size()) {
+        while (r < runs.size() && runs[r].kind == DIFF_EQUAL) {
+            r++;
+        }
+        if (r == runs.size()) {
+            break;
+        }
+        // A hunk ends at an equal run long enough to separate it from the next change
+        size_t first = r, last = r;
+        while (last + 1 < runs.size() && (runs[last + 1].kind != DIFF_EQUAL ||
+               (last + 2 < runs.size() && runs[last + 1].length <= 2 * context))) {
+            last++;
+        }
+        size_t lead = first > 0 ? min(context, runs[first - 1].length) : 0;
+        size_t trail = last + 1 < runs.size() ? min(context, runs[last + 1].length) : 0;
+        size_t aStart = runs[first].a - lead, bStart = runs[first].b - lead;
+        const DiffRun& end = runs[last];
+        size_t aEnd = end.a + (end.kind != DIFF_INSERT ? end.length : 0) + trail;
+        size_t bEnd = end.b + (end.kind != DIFF_DELETE ? end.length : 0) + trail;
+        out << "@@ -" << aStart + 1 << "," << aEnd - aStart << " +" << bStart + 1 << "," << bEnd - bStart << " @@\n";
+        
+        auto row = [&](char marker, const string& left, const string& right) {
+            if (!sideBySide) {
+                out << marker << (marker == '+' ? right : left) << "\n";
+                return;
+            }
+            char column = marker == ' ' ? ' ' : marker == '-' ? '<' : marker == '+' ? '>' : '|';
+            out << left.substr(0, kColumn) << string(kColumn - min(kColumn, left.size()), ' ') << " " << column << " "
+                << right.substr(0, kColumn) << "\n";
+        };
+        auto equalRows = [&](size_t i, size_t j, size_t count) {
+            for (size_t t = 0; t < count; t++) {
+                row(' ', diffTokenText(seq1, i + t, text1), diffTokenText(seq2, j + t, text2));
+            }
+        };
+        equalRows(aStart, bStart, lead);
+        for (size_t k = first; k <= last; k++) {
+            const DiffRun& run = runs[k];
+            if (run.kind == DIFF_EQUAL) {
+                equalRows(run.a, run.b, run.length);
+            } else if (sideBySide && run.kind == DIFF_DELETE && k < last && runs[k + 1].kind == DIFF_INSERT) {
+                // A deletion followed by an insertion is a change: pair them up
+                const DiffRun& inserted = runs[++k];
+                for (size_t t = 0; t < max(run.length, inserted.length); t++) {
+                    string left = t < run.length ? diffTokenText(seq1, run.a + t, text1) : "";
+                    string right = t < inserted.length ? diffTokenText(seq2, inserted.b + t, text2) : "";
+                    row(t >= run.length ? '+' : t >= inserted.length ? '-' : '|', left, right);
+                }
+            } else {
+                for (size_t t = 0; t < run.length; t++) {
+                    if (run.kind == DIFF_DELETE) {
+                        row('-', diffTokenText(seq1, run.a + t, text1), "");
+                    } else {
+                        row('+', "", diffTokenText(seq2, run.b + t, text2));
+                    }
+                }
+            }
+        }
+        if (trail > 0) {
+            equalRows(runs[last + 1].a, runs[last + 1].b, trail);
+        }
+        r = last + 1;
+    }
+}
+
+// Every metric other than Jaccard (which the reports always show) for one pair;
+// TF-IDF treats the two documents as the corpus
+vector<SimilarityScore> scoreDocuments(const DocumentStats& doc1, const DocumentStats& doc2, const vector<SimilarityMetric>& metrics) {
+    TRACE_SCOPE("similarity");
+    vector<SimilarityScore> scores;
+    for (SimilarityMetric metric : metrics) {
+        if (metric == METRIC_JACCARD) {
+            continue;
+        }
+        SimilarityEngine engine(metric);
+        engine.fit({&doc1, &doc2});
+        scores.push_back(SimilarityScore{metric, engine.score(engine.vectorize(doc1), engine.vectorize(doc2))});
+    }
+    return scores;
+}
+
+DocumentStats analyzeDocument(const string& filename) {
+    TRACE_SCOPE("analyze-document");
+    DocumentStats stats;
+    stats.filename = filename;
+    
+    FileBuffer buffer;
+    if (!loadFile(filename, buffer) || buffer.empty()) {
+        stats.wordCount = 0;
+        return stats;
+    }
+    
+    return analyzeCached(filename, buffer.text());
+}
+
+// analyzeText behind the document cache; also safe on worker threads
+DocumentStats analyzeCached(const string& filename, string_view content) {
+    DocumentCache& cache = sharedDocumentCache();
+    DocumentStats stats;
+    if (cache.load(filename, content, stats)) {
+        stats.filename = filename;
+        stats.avgSentenceLength = calculateAvgSentenceLength(stats.wordCount, stats.sentenceCount);
+        stats.topWords = getTopFrequentWords(stats);
+        return stats;
+    }
+    stats = analyzeText(filename, content);
+    cache.store(filename, content, stats);
+    return stats;
+}
+
+// Analysis of already loaded text; does no console output, so it is safe to
+// run on worker threads
+DocumentStats analyzeText(const string& filename, string_view content) {
+    TRACE_SCOPE("analyze");
+    DocumentStats stats;
+    stats.filename = filename;
+    
+    scanDocument(content, stats);
+    stats.avgSentenceLength = calculateAvgSentenceLength(stats.wordCount, stats.sentenceCount);
+    stats.topWords = getTopFrequentWords(stats);
+    
+    auto longestInfo = findLongestSentence(stats.sentences, content);
+    stats.longestSentence = longestInfo.first;
+    stats.longestSentenceWordCount = longestInfo.second;
+    
+    return stats;
+}
+
+// Longest sentence text kept by streaming analysis
+constexpr size_t kMaxStreamedSentence = size_t(1) << 20;
+
+// Analysis in bounded memory for documents larger than RAM. The file is read
+// in fixed-size chunks; the scanner joins words and sentences that cross a
+// chunk boundary. Only the vocabulary, a sentence length histogram and the
+// text of the sentence still open (up to kMaxStreamedSentence bytes) are
+// kept. With a vocabulary cap, words first seen after the cap is reached are
+// counted in a count-min sketch; they still enter the MinHash signature.
+DocumentStats analyzeStream(const string& filename, const StreamOptions& options) {
+    TRACE_SCOPE("analyze-stream");
+    DocumentStats stats;
+    stats.filename = filename;
+    stats.wordCount = 0;
+    FILE* input = filename == "-" ? stdin : fopen(filename.c_str(), "rb");
+    if (!input) {
+        return stats;
+    }
+    
+    pmr::monotonic_buffer_resource arena(analysisArenaSize(options.chunkSize));
+    WordTable localWords(&arena);
+    pmr::vector<int> counts(&arena);
+    vector<uint32_t> overflowSignature(kMinHashSize, UINT32_MAX);
+    shared_ptr<CountMinSketch> sketch;
+    auto countWord = [&](string_view word) {
+        stats.wordCount++;
+        bool room = options.maxVocabulary == 0 || localWords.size() < options.maxVocabulary;
+        uint32_t index = room ? localWords.insert(word) : localWords.find(word);
+        if (index == counts.size()) {
+            counts.push_back(1);
+        } else if (index != WordTable::npos) {
+            counts[index]++;
+        } else {
+            if (!sketch) {
+                sketch = make_shared<CountMinSketch>();
+            }
+            uint64_t h = hashWord(word);
+            // Only (probable) first occurrences can lower the signature
+            if (sketch->estimate(h) == 0) {
+                foldMinHash(overflowSignature, h);
+            }
+            sketch->add(h);
+            stats.overflowOccurrences++;
+        }
+    };
+    
+    vector<SentenceSpan> spans;
+    TokenScanner scanner(&spans);
+    scanner.normalizeWith(sharedNormalization());
+    SentenceSpan longest{0, 0, 0};
+    string openSentence;          // bytes from openStart on, capped
+    uint64_t openStart = 0;
+    uint64_t chunkStart = 0;
+    
+    // Records the sentences closed in the chunk just scanned and carries the
+    // bytes of the sentence still open over to the next chunk
+    auto takeSentences = [&](const char* chunk, size_t size) {
+        for (const SentenceSpan& span : spans) {
+            stats.sentenceLengths[span.words]++;
+            uint64_t end = span.offset + span.length;
+            if (span.words > longest.words) {
+                longest = span;
+                // The text up to the first byte that was not kept
+                string text;
+                if (span.offset < chunkStart) {
+                    text = openSentence.substr(min<uint64_t>(span.offset - openStart, openSentence.size()));
+                }
+                uint64_t from = max(span.offset, chunkStart);
+                if (text.size() == min<uint64_t>(from - span.offset, kMaxStreamedSentence)) {
+                    text.append(chunk + (from - chunkStart), min<uint64_t>(end - from, kMaxStreamedSentence - min(text.size(), kMaxStreamedSentence)));
+                }
+                stats.longestSentence = move(text);
+            }
+            openStart = end;
+            openSentence.clear();
+        }
+        spans.clear();
+        uint64_t from = max(openStart, chunkStart);
+        if (from < chunkStart + size && openSentence.size() < kMaxStreamedSentence) {
+            openSentence.append(chunk + (from - chunkStart), min<uint64_t>(chunkStart + size - from, kMaxStreamedSentence - openSentence.size()));
+        }
+        chunkStart += size;
+    };
+    
+    vector<char> chunk(max<size_t>(options.chunkSize, 4096));
+    auto readChunk = [&] {
+        TRACE_SCOPE("read-chunk");
+        size_t got = fread(chunk.data(), 1, chunk.size(), input);
+        TRACE_COUNT(got, 0);
+        return got;
+    };
+    size_t got;
+    while ((got = readChunk()) > 0) {
+        TRACE_SCOPE("scan-chunk");
+        int64_t wordsBefore = stats.wordCount;
+        scanner.feed(string_view(chunk.data(), got), countWord);
+        takeSentences(chunk.data(), got);
+        TRACE_COUNT(got, stats.wordCount - wordsBefore);
+    }
+    bool failed = ferror(input);
+    if (input != stdin) {
+        fclose(input);
+    }
+    if (failed) {
+        stats.wordCount = 0;
+        return stats;
+    }
+    scanner.finish(countWord);
+    stats.wordCount += scanner.stopWordCount();
+    takeSentences(chunk.data(), 0);
+    
+    stats.sentenceCount = max<int64_t>(scanner.terminatorCount(), 1); // At least 1 sentence
+    stats.avgSentenceLength = calculateAvgSentenceLength(stats.wordCount, stats.sentenceCount);
+    setVocabulary(stats, localWords, counts);
+    stats.minHash = computeMinHash(localWords);
+    for (size_t i = 0; i < kMinHashSize; i++) {
+        stats.minHash[i] = min(stats.minHash[i], overflowSignature[i]);
+    }
+    stats.vocabularyTruncated = sketch != nullptr;
+    stats.overflowCounts = sketch;
+    stats.topWords = getTopFrequentWords(stats);
+    replace(stats.longestSentence.begin(), stats.longestSentence.end(), '\n', ' ');
+    stats.longestSentenceWordCount = longest.words;
+    return stats;
+}
+
+void printHeader() {
+    printSeparator();
+    cout << setw(40) << " TEXT COMPARATOR \n";
+    cout << setw(42) << "Document Analysis & Comparison Tool\n";
+    printSeparator();
+}
+
+void printSeparator(char ch, int length) {
+    cout << string(length, ch) << "\n";
+}
+
+// Pads text to width terminal columns (setw counts bytes); ideographs are
+// two columns wide
+string padColumn(string_view text, size_t width) {
+    size_t columns = 0;
+    for (size_t i = 0; i < text.size();) {
+        uint32_t cp = static_cast<unsigned char>(text[i]);
+        int length = 1;
+        if (cp >= 0x80) {
+            length = max(decodeUtf8(reinterpret_cast<const unsigned char*>(text.data() + i), text.size() - i, cp), 1);
+            if ((unicodeEntry(cp) & 7) == CHAR_IDEOGRAPH) {
+                columns++;
+            }
+        }
+        columns++;
+        i += length;
+    }
+    string padded(text);
+    if (columns < width) {
+        padded.append(width - columns, ' ');
+    }
+    return padded;
+}
+
+void printComparisonTable(const DocumentStats& doc1, const DocumentStats& doc2, const VocabularyOverlap& overlap,
+                          const vector<SimilarityScore>& scores) {
+    cout << "\n COMPARISON RESULTS\n";
+    printSeparator('-', 80);
+    
+    cout << left << setw(25) << "Metric" 
+         << setw(25) << "Document A" 
+         << setw(25) << "Document B" << "\n";
+    printSeparator('-', 75);
+    
+    cout << left << setw(25) << " Filename:" 
+         << setw(25) << doc1.filename.substr(0, 22) 
+         << setw(25) << doc2.filename.substr(0, 22) << "\n";
+    
+    cout << left << setw(25) << " Word Count:" 
+         << setw(25) << doc1.wordCount 
+         << setw(25) << doc2.wordCount << "\n";
+    
+    cout << left << setw(25) << " Sentence Count:" 
+         << setw(25) << doc1.sentenceCount 
+         << setw(25) << doc2.sentenceCount << "\n";
+    
+    cout << left << setw(25) << "Unique Words:" 
+         << setw(25) << doc1.uniqueWords.size() 
+         << setw(25) << doc2.uniqueWords.size() << "\n";
+    
+    cout << left << setw(25) << " Avg Sentence Length:" 
+         << setw(25) << fixed << setprecision(2) << doc1.avgSentenceLength 
+         << setw(25) << doc2.avgSentenceLength << "\n";
+    
+    cout << left << setw(25) << " Longest Sentence:" 
+         << setw(25) << doc1.longestSentenceWordCount 
+         << setw(25) << doc2.longestSentenceWordCount << "\n";
+    
+    printSeparator('-', 75);
+    
+    cout << "\n SIMILARITY ANALYSIS\n";
+    printSeparator('-', 30);
+    cout << " Jaccard Similarity: " << fixed << setprecision(2) << overlap.jaccard() << "%\n";
+    for (const SimilarityScore& score : scores) {
+        cout << " " << similarityMetricInfo(score.metric).label << ": " << score.percent << "%\n";
+    }
+    cout << " Common Words: " << overlap.common << "\n";
+    
+    cout << "\n TOP 5 FREQUENT WORDS\n";
+    printSeparator('-', 50);
+    
+    cout << left << setw(15) << "Document A" << setw(15) << "Document B" << "\n";
+    printSeparator('-', 30);
+    
+    for (int i = 0; i < 5; i++) {
+        string word1 = (i < doc1.topWords.size()) ? 
+                       doc1.topWords[i].first + "(" + to_string(doc1.topWords[i].second) + ")" : "-";
+        string word2 = (i < doc2.topWords.size()) ? 
+                       doc2.topWords[i].first + "(" + to_string(doc2.topWords[i].second) + ")" : "-";
+        
+        cout << padColumn(word1, 15) << padColumn(word2, 15) << "\n";
+    }
+}
+
+// REPORTS
+
+bool ReportBuffer::open(const string& path) {
+    close();
+    failed = false;
+    sink = path == "-" ? stdout : fopen(path.c_str(), "wb");
+    return sink != nullptr;
+}
+
+bool ReportBuffer::close() {
+    if (!sink) {
+        return !failed;
+    }
+    flush();
+    if (sink == stdout) {
+        failed = fflush(stdout) != 0 || failed;
+    } else {
+        failed = fclose(sink) != 0 || failed;
+    }
+    sink = nullptr;
+    return !failed;
+}
+
+void ReportBuffer::flush() {
+    TRACE_SCOPE("report-write");
+    TRACE_COUNT(data.size(), 0);
+    if (!data.empty() && fwrite(data.data(), 1, data.size(), sink) != data.size()) {
+        failed = true;
+    }
+    data.clear();
+}
+
+ReportBuffer& ReportBuffer::operator<<(double value) {
+    char digits[350];   // room for any double in fixed notation
+    data.append(digits, to_chars(digits, digits + sizeof(digits), value, chars_format::fixed, 2).ptr);
+    return spill();
+}
+
+void ReportBuffer::jsonString(string_view text) {
+    data.push_back('"');
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            data.push_back('\\');
+            data.push_back(c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            const char* hex = "0123456789abcdef";
+            data.append("\\u00");
+            data.push_back(hex[c >> 4]);
+            data.push_back(hex[c & 15]);
+        } else {
+            data.push_back(c);
+        }
+    }
+    data.push_back('"');
+    spill();
+}
+
+void ReportBuffer::csvField(string_view text) {
+    if (text.find_first_of(",\"\r\n") == string_view::npos) {
+        data.append(text);
+    } else {
+        data.push_back('"');
+        for (char c : text) {
+            if (c == '"') {
+                data.push_back('"');
+            }
+            data.push_back(c);
+        }
+        data.push_back('"');
+    }
+    spill();
+}
+
+TableWriter::TableWriter(ReportBuffer& out, ReportFormat format, vector<string> columns)
+    : out(out), format(format), columns(move(columns)) {
+    if (format == REPORT_JSON) {
+        out << "[";
+        return;
+    }
+    for (size_t c = 0; c < this->columns.size(); c++) {
+        if (c > 0) {
+            out << (format == REPORT_CSV ? ',' : '\t');
+        }
+        if (format == REPORT_CSV) {
+            out.csvField(this->columns[c]);
+        } else {
+            out << this->columns[c];
+        }
+    }
+    out << "\n";
+}
+
+void TableWriter::beginCell() {
+    if (format == REPORT_JSON) {
+        out << (column == 0 ? (rows == 0 ? "\n  {" : ",\n  {") : ", ");
+        out.jsonString(columns[column]);
+        out << ": ";
+    } else if (column > 0) {
+        out << (format == REPORT_CSV ? ',' : '\t');
+    }
+    column++;
+}
+
+TableWriter& TableWriter::text(string_view value) {
+    beginCell();
+    if (format == REPORT_JSON) {
+        out.jsonString(value);
+    } else if (format == REPORT_CSV) {
+        out.csvField(value);
+    } else {
+        out << value;
+    }
+    return *this;
+}
+
+TableWriter& TableWriter::number(double value) {
+    beginCell();
+    out << value;
+    return *this;
+}
+
+TableWriter& TableWriter::integer(uint64_t value) {
+    beginCell();
+    out << value;
+    return *this;
+}
+
+void TableWriter::endRow() {
+    out << (format == REPORT_JSON ? "}" : "\n");
+    column = 0;
+    rows++;
+}
+
+void TableWriter::finish() {
+    if (format == REPORT_JSON) {
+        out << (rows > 0 ? "\n]\n" : "]\n");
+    }
+}
+
+bool parseReportFormat(const string& name, ReportFormat& format) {
+    if (name == "text") {
+        format = REPORT_TEXT;
+    } else if (name == "json") {
+        format = REPORT_JSON;
+    } else if (name == "csv") {
+        format = REPORT_CSV;
+    } else {
+        cout << " Error: Unknown format '" << name << "' (text, json or csv)\n";
+        return false;
+    }
+    return true;
+}
+
+// Option values must be whole; a bad one is reported and leaves count alone
+template <typename Count>
+bool parseCount(const string& option, const string& value, Count& count) {
+    Count parsed = 0;
+    auto result = from_chars(value.data(), value.data() + value.size(), parsed);
+    if (value.empty() || result.ec != errc() || result.ptr != value.data() + value.size()) {
+        cout << " Error: " << option << " takes a whole number, not '" << value << "'\n";
+        return false;
+    }
+    count = parsed;
+    return true;
+}
+
+bool parseNumber(const string& option, const string& value, double& number) {
+    double parsed = 0;
+    auto result = from_chars(value.data(), value.data() + value.size(), parsed);
+    if (value.empty() || result.ec != errc() || result.ptr != value.data() + value.size() || !isfinite(parsed)) {
+        cout << " Error: " << option << " takes a number, not '" << value << "'\n";
+        return false;
+    }
+    number = parsed;
+    return true;
+}
+
+bool parseMegabytes(const string& option, const string& value, size_t& bytes) {
+    size_t megabytes = 0;
+    if (!parseCount(option, value, megabytes)) {
+        return false;
+    }
+    if (megabytes > (numeric_limits<size_t>::max() >> 20)) {
+        cout << " Error: " << option << " is too large: " << value << "\n";
+        return false;
+    }
+    bytes = megabytes << 20;
+    return true;
+}
+
+string defaultReportPath(const string& stem, ReportFormat format) {
+    return stem + (format == REPORT_JSON ? ".json" : format == REPORT_CSV ? ".csv" : ".txt");
+}
+
+// Common words sorted alphabetically, with their counts
+static vector<const CommonWordCount*> sortedCommonWords(const vector<CommonWordCount>& commonWords) {
+    const WordInterner& vocabulary = sharedVocabulary();
+    vector<const CommonWordCount*> sorted;
+    for (const CommonWordCount& common : commonWords) {
+        sorted.push_back(&common);
+    }
+    sort(sorted.begin(), sorted.end(), [&](const CommonWordCount* a, const CommonWordCount* b) {
+        return vocabulary.word(a->id) < vocabulary.word(b->id);
+    });
+    return sorted;
+}
+
+static void renderTextReport(ReportBuffer& out, const ReportContent& content) {
+    const DocumentStats& doc1 = *content.doc1;
+    const DocumentStats& doc2 = *content.doc2;
+    bool updated = content.replacements != nullptr;
+    if (updated) {
+        out << "TEXT COMPARATOR - UPDATED ANALYSIS REPORT\n";
+        out << "==========================================\n\n";
+        
+        out << "WORD REPLACEMENT SUMMARY\n";
+        out << "------------------------\n";
+        for (const auto& replacement : *content.replacements) {
+            out << "Replaced word: '" << replacement.first << "' -> '" << replacement.second << "'\n";
+        }
+        out << "Documents analyzed: " << doc1.filename << " and " << doc2.filename << "\n\n";
+        
+        out << "DOCUMENT ANALYSIS (AFTER REPLACEMENT)\n";
+        out << "------------------------------------\n\n";
+    } else {
+        out << "TEXT COMPARATOR - DETAILED ANALYSIS REPORT\n";
+        out << "==========================================\n\n";
+        
+        out << "DOCUMENT ANALYSIS\n";
+        out << "-----------------\n\n";
+    }
+    
+    writeDocumentSection(out, "Document A", doc1);
+    writeDocumentSection(out, "Document B", doc2);
+    
+    out << (updated ? "COMPARISON ANALYSIS (AFTER REPLACEMENT)\n---------------------------------------\n\n"
+                    : "COMPARISON ANALYSIS\n-------------------\n\n");
+    out << "Jaccard Similarity: " << content.overlap.jaccard() << "%\n";
+    for (const SimilarityScore& score : content.scores) {
+        out << similarityMetricInfo(score.metric).label << ": " << score.percent << "%\n";
+    }
+    out << "Common Words Count: " << content.overlap.common << "\n\n";
+    
+    out << "Common Words: ";
+    int count = 0;
+    for (string_view word : alphabeticalWords(*content.commonWords, 20)) {
+        if (count > 0) out << ", ";
+        out << word;
+        count++;
+        if (count >= 20) {
+            out << "... (and " << (content.commonWords->size() - 20) << " more)";
+            break;
+        }
+    }
+    out << "\n\n";
+    
+    out << (updated ? "LONGEST SENTENCES (AFTER REPLACEMENT)\n------------------------------------\n\n"
+                    : "LONGEST SENTENCES\n-----------------\n\n");
+    out << "Document A longest sentence (" << doc1.longestSentenceWordCount << " words):\n";
+    out << doc1.longestSentence << "\n\n";
+    out << "Document B longest sentence (" << doc2.longestSentenceWordCount << " words):\n";
+    out << doc2.longestSentence << "\n\n";
+    
+    if (updated) {
+        // Check if the replacement words appear in analysis
+        bool anyNewWordFound = false;
+        for (const auto& replacement : *content.replacements) {
+            string word = normalizedWord(replacement.second);
+            anyNewWordFound = anyNewWordFound || getWordFrequency(doc1, word) > 0 || getWordFrequency(doc2, word) > 0;
+        }
+        if (anyNewWordFound) {
+            out << "REPLACEMENT WORD ANALYSIS\n";
+            out << "------------------------\n";
+            for (const auto& replacement : *content.replacements) {
+                string word = normalizedWord(replacement.second);
+                int count1 = getWordFrequency(doc1, word);
+                int count2 = getWordFrequency(doc2, word);
+                if (count1 > 0) {
+                    out << "'" << replacement.second << "' appears " << count1 << " times in Document A\n";
+                }
+                if (count2 > 0) {
+                    out << "'" << replacement.second << "' appears " << count2 << " times in Document B\n";
+                }
+            }
+            out << "\n";
+        }
+    }
+    
+    out << (updated ? "End of Updated Report\n" : "End of Report\n");
+}
+
+static void renderJsonDocument(ReportBuffer& out, const DocumentStats& doc, const char* indent) {
+    out << indent << "{\n" << indent << "  \"filename\": ";
+    out.jsonString(doc.filename);
+    out << ",\n" << indent << "  \"wordCount\": " << doc.wordCount;
+    out << ",\n" << indent << "  \"sentenceCount\": " << doc.sentenceCount;
+    out << ",\n" << indent << "  \"uniqueWords\": " << doc.uniqueWords.size();
+    if (doc.vocabularyTruncated) {
+        out << ",\n" << indent << "  \"wordsPastVocabularyCap\": " << doc.overflowOccurrences;
+    }
+    out << ",\n" << indent << "  \"averageSentenceLength\": " << doc.avgSentenceLength;
+    out << ",\n" << indent << "  \"sentenceLengthPercentiles\": {\"p50\": " << sentenceLengthPercentile(doc, 50)
+        << ", \"p90\": " << sentenceLengthPercentile(doc, 90) << ", \"p99\": " << sentenceLengthPercentile(doc, 99) << "}";
+    out << ",\n" << indent << "  \"topWords\": [";
+    for (size_t i = 0; i < doc.topWords.size(); i++) {
+        out << (i > 0 ? ", " : "") << "{\"word\": ";
+        out.jsonString(doc.topWords[i].first);
+        out << ", \"count\": " << doc.topWords[i].second << "}";
+    }
+    out << "],\n" << indent << "  \"longestSentenceWords\": " << doc.longestSentenceWordCount;
+    out << ",\n" << indent << "  \"longestSentence\": ";
+    out.jsonString(doc.longestSentence);
+    out << "\n" << indent << "}";
+}
+
+static void renderJsonReport(ReportBuffer& out, const ReportContent& content) {
+    out << "{\n  \"report\": " << (content.replacements ? "\"updated\"" : "\"comparison\"");
+    if (content.replacements) {
+        out << ",\n  \"replacements\": [";
+        for (size_t i = 0; i < content.replacements->size(); i++) {
+            out << (i > 0 ? ", " : "") << "{\"old\": ";
+            out.jsonString((*content.replacements)[i].first);
+            out << ", \"new\": ";
+            out.jsonString((*content.replacements)[i].second);
+            out << "}";
+        }
+        out << "]";
+    }
+    out << ",\n  \"documents\": [\n";
+    renderJsonDocument(out, *content.doc1, "    ");
+    out << ",\n";
+    renderJsonDocument(out, *content.doc2, "    ");
+    out << "\n  ],\n  \"similarity\": {\"jaccard\": " << content.overlap.jaccard();
+    for (const SimilarityScore& score : content.scores) {
+        out << ", ";
+        out.jsonString(similarityMetricInfo(score.metric).key);
+        out << ": " << score.percent;
+    }
+    out << "},\n  \"commonWordCount\": " << content.overlap.common << ",\n  \"commonWords\": [";
+    const WordInterner& vocabulary = sharedVocabulary();
+    vector<const CommonWordCount*> common = sortedCommonWords(*content.commonWords);
+    for (size_t i = 0; i < common.size(); i++) {
+        out << (i > 0 ? ",\n    {\"word\": " : "\n    {\"word\": ");
+        out.jsonString(vocabulary.word(common[i]->id));
+        out << ", \"countA\": " << common[i]->count1 << ", \"countB\": " << common[i]->count2 << "}";
+    }
+    out << (common.empty() ? "]\n}\n" : "\n  ]\n}\n");
+}
+
+// CSV: one record per line as record,name,document_a,document_b
+static void renderCsvReport(ReportBuffer& out, const ReportContent& content) {
+    const DocumentStats& doc1 = *content.doc1;
+    const DocumentStats& doc2 = *content.doc2;
+    TableWriter table(out, REPORT_CSV, {"record", "name", "document_a", "document_b"});
+    if (content.replacements) {
+        for (const auto& replacement : *content.replacements) {
+            table.text("replacement").text(replacement.first).text(replacement.second).text("");
+            table.endRow();
+        }
+    }
+    table.text("document").text("filename").text(doc1.filename).text(doc2.filename);
+    table.endRow();
+    table.text("document").text("word_count").integer(doc1.wordCount).integer(doc2.wordCount);
+    table.endRow();
+    table.text("document").text("sentence_count").integer(doc1.sentenceCount).integer(doc2.sentenceCount);
+    table.endRow();
+    table.text("document").text("unique_words").integer(doc1.uniqueWords.size()).integer(doc2.uniqueWords.size());
+    table.endRow();
+    table.text("document").text("average_sentence_length").number(doc1.avgSentenceLength).number(doc2.avgSentenceLength);
+    table.endRow();
+    table.text("document").text("longest_sentence_words").integer(doc1.longestSentenceWordCount).integer(doc2.longestSentenceWordCount);
+    table.endRow();
+    for (int percentile : {50, 90, 99}) {
+        table.text("document").text("sentence_length_p" + to_string(percentile))
+            .number(sentenceLengthPercentile(doc1, percentile)).number(sentenceLengthPercentile(doc2, percentile));
+        table.endRow();
+    }
+    table.text("similarity").text("jaccard").number(content.overlap.jaccard()).text("");
+    table.endRow();
+    for (const SimilarityScore& score : content.scores) {
+        table.text("similarity").text(similarityMetricInfo(score.metric).key).number(score.percent).text("");
+        table.endRow();
+    }
+    const WordInterner& vocabulary = sharedVocabulary();
+    for (const CommonWordCount* common : sortedCommonWords(*content.commonWords)) {
+        table.text("common_word").text(vocabulary.word(common->id)).integer(common->count1).integer(common->count2);
+        table.endRow();
+    }
+    table.finish();
+}
+
+void renderReport(ReportBuffer& out, const ReportContent& content, ReportFormat format) {
+    TRACE_SCOPE("report-render");
+    switch (format) {
+    case REPORT_JSON:
+        renderJsonReport(out, content);
+        break;
+    case REPORT_CSV:
+        renderCsvReport(out, content);
+        break;
+    default:
+        renderTextReport(out, content);
+        break;
+    }
+}
+
+// Statistics of single documents (the analyze command)
+void renderDocuments(ReportBuffer& out, const vector<const DocumentStats*>& docs, ReportFormat format) {
+    if (format == REPORT_TEXT) {
+        for (const DocumentStats* doc : docs) {
+            writeDocumentSection(out, "Document", *doc);
+        }
+    } else if (format == REPORT_JSON) {
+        out << "[";
+        for (size_t i = 0; i < docs.size(); i++) {
+            out << (i > 0 ? ",\n" : "\n");
+            renderJsonDocument(out, *docs[i], "  ");
+        }
+        out << (docs.empty() ? "]\n" : "\n]\n");
+    } else {
+        TableWriter table(out, REPORT_CSV, {"filename", "word_count", "sentence_count", "unique_words", "average_sentence_length",
+                                            "longest_sentence_words", "sentence_length_p50", "sentence_length_p90", "sentence_length_p99"});
+        for (const DocumentStats* doc : docs) {
+            table.text(doc->filename).integer(doc->wordCount).integer(doc->sentenceCount).integer(doc->uniqueWords.size())
+                .number(doc->avgSentenceLength).integer(doc->longestSentenceWordCount).number(sentenceLengthPercentile(*doc, 50))
+                .number(sentenceLengthPercentile(*doc, 90)).number(sentenceLengthPercentile(*doc, 99));
+            table.endRow();
+        }
+        table.finish();
+    }
+}
+
+void writeReportToFile(const DocumentStats& doc1, const DocumentStats& doc2, const VocabularyOverlap& overlap, const vector<CommonWordCount>& commonWords,
+                       const string& reportFilename, const vector<SimilarityScore>& scores, ReportFormat format) {
+    ReportBuffer report;
+    renderReport(report, ReportContent{&doc1, &doc2, overlap, &commonWords, scores}, format);
+    if (!report.save(reportFilename)) {
+        cout << " Error: Cannot create " << reportFilename << "\n";
+    }
+}
+
+// Statistics block of one document, as used by the reports and by the
+// analyze command
+void writeDocumentSection(ReportBuffer& out, const string& label, const DocumentStats& doc) {
+    out << label << ": " << doc.filename << "\n";
+    out << "- Word Count: " << doc.wordCount << "\n";
+    out << "- Sentence Count: " << doc.sentenceCount << "\n";
+    out << "- Unique Words: " << doc.uniqueWords.size() << "\n";
+    if (doc.vocabularyTruncated) {
+        out << "- Words Past Vocabulary Cap: " << doc.overflowOccurrences << " occurrences (counted approximately)\n";
+    }
+    out << "- Average Sentence Length: " << doc.avgSentenceLength << " words\n";
+    out << "- Longest Sentence: " << doc.longestSentenceWordCount << " words\n";
+    out << "- Sentence Length p50/p90/p99: " << sentenceLengthPercentile(doc, 50) << " / "
+        << sentenceLengthPercentile(doc, 90) << " / " << sentenceLengthPercentile(doc, 99) << " words\n";
+    out << "- Top 5 Words: ";
+    for (int i = 0; i < min(5, (int)doc.topWords.size()); i++) {
+        out << doc.topWords[i].first << "(" << doc.topWords[i].second << ")";
+        if (i < min(4, (int)doc.topWords.size() - 1)) out << ", ";
+    }
+    out << "\n\n";
+}
+
+// WORD REPLACEMENT FUNCTIONALITY
+
+void performWordReplacement(const DocumentStats& original1, const DocumentStats& original2,
+                            const vector<CommonWordCount>& originalCommon, bool verifyUpdates) {
+    char choice;
+    cout << "\n WORD REPLACEMENT FEATURE\n";
+    printSeparator('-', 40);
+    cout << "Would you like to replace any word in the documents? (y/n): ";
+    cin >> choice;
+    cin.ignore(); // Clear the input buffer
+    
+    if (choice != 'y' && choice != 'Y') {
+        cout << " No word replacement requested.\n";
+        return;
+    }
+    
+    while (choice == 'y' || choice == 'Y') {
+        cout << "\n REPLACEMENT OPTIONS:\n";
+        cout << "1. Replace word in both documents\n";
+        cout << "2. Replace word in first document only (" << original1.filename << ")\n";
+        cout << "3. Replace word in second document only (" << original2.filename << ")\n";
+        cout << "\n Select option (1/2/3): ";
+        
+        int option;
+        cin >> option;
+        cin.ignore();
+        
+        string oldWords, newWords;
+        cout << "\n Enter the word you want to replace (several: separate with commas): ";
+        getline(cin, oldWords);
+        cout << " Enter the replacement word (one per replaced word): ";
+        getline(cin, newWords);
+        
+        vector<pair<string, string>> replacements = parseReplacements(oldWords, newWords);
+        if (option < 1 || option > 3) {
+            cout << " Invalid option selected.\n";
+            return;
+        }
+        if (replacements.empty()) {
+            cout << " The replaced and replacement word lists do not match.\n";
+            return;
+        }
+        replaceInDocuments(original1, original2, originalCommon, replacements, option, verifyUpdates);
+        
+        // Ask if user wants to replace more words
+        cout << "\nWould you like to replace another word? (y/n): ";
+        cin >> choice;
+        cin.ignore();
+    }
+}
+
+// Runs one replacement round on the original documents: writes the *_updated
+// files, brings their statistics up to date and writes the updated report.
+// option 1 replaces in both documents, 2 in the first and 3 in the second
+// only. Returns the statistics of the documents that were rewritten.
+vector<DocumentStats> replaceInDocuments(const DocumentStats& original1, const DocumentStats& original2,
+                                         const vector<CommonWordCount>& originalCommon,
+                                         const vector<pair<string, string>>& replacements, int option,
+                                         bool verifyUpdates, const string& reportPath, ReportFormat reportFormat) {
+    ReplacementEngine engine(replacements);
+    
+    // Every round starts again from the original documents
+    vector<const DocumentStats*> filesToProcess;
+    if (option != 3) {
+        filesToProcess.push_back(&original1);
+    }
+    if (option != 2) {
+        filesToProcess.push_back(&original2);
+    }
+    string oldWords;
+    for (const auto& replacement : replacements) {
+        oldWords += (oldWords.empty() ? "" : ", ") + replacement.first;
+    }
+    
+    cout << "\n Processing files: \n";
+    printSeparator('-', 30);
+    
+    DocumentStats updated1 = original1;
+    DocumentStats updated2 = original2;
+    vector<uint32_t> changedIds;
+    bool filesUpdated = false;
+    bool allIncremental = true;
+    
+    // Process each selected file
+    for (const DocumentStats* original : filesToProcess) {
+        const string& filename = original->filename;
+        cout << "\n Processing: " << filename << "\n";
+        
+        // Load the file content
+        FileBuffer buffer;
+        if (!loadFile(filename, buffer) || buffer.empty()) {
+            cout << "Error: Could not load " << filename << " for replacement.\n";
+            continue;
+        }
+        
+        string_view content = buffer.text();
+        
+        // Create new filename
+        string newFilename;
+        size_t dotPos = filename.find_last_of('.');
+        if (dotPos != string::npos) {
+            newFilename = filename.substr(0, dotPos) + "_updated" + filename.substr(dotPos);
+        } else {
+            newFilename = filename + "_updated.txt";
+        }
+        
+        // One pass rewrites the text straight into a temporary file and
+        // counts the matches; it only replaces the updated file if
+        // anything was found
+        string temporaryFilename = newFilename + ".tmp";
+        ofstream outputFile(temporaryFilename, ios::binary);
+        if (!outputFile.is_open()) {
+            cout << " Error: Could not create output file " << newFilename << ".\n";
+            continue;
+        }
+        vector<size_t> counts;
+        vector<ReplacementEngine::Match> matches;
+        size_t occurrences = engine.rewrite(content, outputFile, counts, &matches);
+        outputFile.close();
+        
+        error_code error;
+        if (occurrences == 0) {
+            filesystem::remove(temporaryFilename, error);
+            cout << " Word '" << oldWords << "' not found in " << filename << ".\n";
+            continue;
+        }
+        if (!outputFile) {
+            filesystem::remove(temporaryFilename, error);
+            cout << " Error: Could not write output file " << newFilename << ".\n";
+            continue;
+        }
+        filesystem::rename(temporaryFilename, newFilename, error);
+        if (error) {
+            filesystem::remove(temporaryFilename, error);
+            cout << " Error: Could not create output file " << newFilename << ".\n";
+            continue;
+        }
+        
+        for (size_t i = 0; i < replacements.size(); i++) {
+            if (counts[i] > 0) {
+                cout << " Found " << counts[i] << " occurrence(s) of '" << replacements[i].first << "'\n";
+            }
+        }
+        
+        cout << " SUCCESS!\n";
+        cout << " Original file: " << filename << "\n";
+        cout << " Updated file: " << newFilename << "\n";
+        for (size_t i = 0; i < replacements.size(); i++) {
+            if (counts[i] > 0) {
+                cout << " Replaced " << counts[i] << " occurrence(s) of '" << replacements[i].first << "' with '"
+                     << replacements[i].second << "'\n";
+            }
+        }
+        
+        // Update the statistics from the matches; words with other
+        // characters than letters need a full analysis of the new file
+        DocumentStats& updated = original == &original1 ? updated1 : updated2;
+        bool incremental = applyReplacementDelta(updated, content, engine, matches, changedIds);
+        if (!incremental || verifyUpdates) {
+            DocumentStats analyzed = analyzeDocument(newFilename);
+            if (incremental && !sameAnalysis(updated, analyzed)) {
+                cout << " Warning: the incremental update of " << newFilename << " differs from a full analysis\n";
+            } else if (incremental) {
+                cout << " Incremental update of " << newFilename << " verified against a full analysis\n";
+            }
+            updated = move(analyzed);
+            allIncremental = allIncremental && incremental;
+        }
+        updated.filename = newFilename;
+        filesUpdated = true;
+    }
+    
+    // Generate new report if files were updated
+    if (filesUpdated) {
+        cout << "\n GENERATING UPDATED ANALYSIS REPORT...\n";
+        printSeparator('-', 40);
+        
+        if (updated1.wordCount == 0 || updated2.wordCount == 0) {
+            cout << " Error: Could not process one or both updated documents.\n";
+        } else {
+            vector<CommonWordCount> commonWords;
+            if (allIncremental) {
+                commonWords = originalCommon;
+                updateCommonWords(commonWords, updated1, updated2, move(changedIds));
+            } else {
+                commonWords = getCommonWordsWithCounts(updated1, updated2);
+            }
+            generateUpdatedReport(updated1, updated2, commonWords, replacements, reportPath, reportFormat);
+        }
+    }
+    
+    vector<DocumentStats> updatedDocuments;
+    for (const DocumentStats* original : filesToProcess) {
+        DocumentStats& updated = original == &original1 ? updated1 : updated2;
+        if (updated.filename != original->filename) {
+            updatedDocuments.push_back(move(updated));
+        }
+    }
+    return updatedDocuments;
+    
+}
+
+// Applies a replacement to stats from its match list instead of analyzing the
+// rewritten document again. Only letter-only words replaced by letter-only
+// words are handled: those cannot move a sentence boundary or change how many
+// words a sentence has, so only the tokens around each match, the sentence
+// offsets and the longest sentence text change. Returns false, leaving stats
+// untouched, when a full analysis is needed; changedIds receives the IDs whose
+// counts changed.
+bool applyReplacementDelta(DocumentStats& stats, string_view original, const ReplacementEngine& engine,
+                           const vector<ReplacementEngine::Match>& matches, vector<uint32_t>& changedIds) {
+    auto lettersOnly = [](const string& word) {
+        return !word.empty() && all_of(word.begin(), word.end(), [](char c) {
+            return kCharTable.cls[static_cast<unsigned char>(c)] == CHAR_LETTER;
+        });
+    };
+    for (const ReplacementEngine::Match& match : matches) {
+        if (!lettersOnly(engine.pattern(match.pattern)) || !lettersOnly(engine.substitute(match.pattern))) {
+            return false;
+        }
+    }
+    
+    // [begin, end) of the original with the matches in it replaced; first is
+    // the index of the first match at or after begin
+    auto rewriteRange = [&](size_t begin, size_t end, size_t first) {
+        string text;
+        size_t copied = begin;
+        for (size_t m = first; m < matches.size() && matches[m].start < end; m++) {
+            text.append(original.substr(copied, matches[m].start - copied));
+            text.append(engine.substitute(matches[m].pattern));
+            copied = matches[m].end;
+        }
+        text.append(original.substr(copied, end - copied));
+        return text;
+    };
+    auto lengthChange = [&](const ReplacementEngine::Match& match) {
+        return static_cast<int64_t>(engine.substitute(match.pattern).size()) - static_cast<int64_t>(match.end - match.start);
+    };
+    
+    // Re-tokenize only the run of non-separator bytes around each match, once
+    // with the old and once with the new text
+    unordered_map<string, int> deltas;
+    int64_t wordChange = 0;
+    const WordNormalization& normalization = sharedNormalization();
+    auto countTokens = [&](string_view text, int change) {
+        for (string& word : tokenize(text)) {
+            wordChange += change;
+            // Normalized exactly as TokenScanner::emitWord does it
+            size_t length = word.size();
+            if (normalization.enabled() && !normalizeWord(normalization, &word[0], length)) {
+                continue;
+            }
+            word.resize(length);
+            deltas[word] += change;
+        }
+    };
+    auto isSeparator = [&](size_t i) {
+        return kCharTable.cls[static_cast<unsigned char>(original[i])] == CHAR_SEPARATOR;
+    };
+    for (size_t m = 0; m < matches.size();) {
+        size_t begin = matches[m].start, end = matches[m].end;
+        while (begin > 0 && !isSeparator(begin - 1)) {
+            begin--;
+        }
+        while (end < original.size() && !isSeparator(end)) {
+            end++;
+        }
+        size_t last = m;
+        while (last + 1 < matches.size() && matches[last + 1].start < end) {
+            last++;
+        }
+        countTokens(original.substr(begin, end - begin), -1);
+        countTokens(rewriteRange(begin, end, m), 1);
+        m = last + 1;
+    }
+    
+    // Merge the count changes into the vocabulary in one pass. A word losing
+    // more occurrences than it had means the delta and the tokenizer disagree,
+    // so the document gets a full analysis instead.
+    WordInterner& vocabulary = sharedVocabulary();
+    vector<pair<uint32_t, int>> changes;
+    for (const auto& delta : deltas) {
+        if (delta.second != 0) {
+            changes.emplace_back(vocabulary.intern(delta.first), delta.second);
+        }
+    }
+    sort(changes.begin(), changes.end());
+    vector<uint32_t> words;
+    vector<int> frequencies;
+    words.reserve(stats.uniqueWords.size() + changes.size());
+    frequencies.reserve(stats.uniqueWords.size() + changes.size());
+    size_t i = 0;
+    for (const auto& change : changes) {
+        for (; i < stats.uniqueWords.size() && stats.uniqueWords[i] < change.first; i++) {
+            words.push_back(stats.uniqueWords[i]);
+            frequencies.push_back(stats.wordFrequency[i]);
+        }
+        int count = change.second;
+        if (i < stats.uniqueWords.size() && stats.uniqueWords[i] == change.first) {
+            count += stats.wordFrequency[i++];
+        }
+        if (count < 0) {
+            return false;
+        }
+        if (count > 0) {
+            words.push_back(change.first);
+            frequencies.push_back(count);
+        }
+    }
+    for (const auto& change : changes) {
+        changedIds.push_back(change.first);
+    }
+    stats.wordCount += wordChange;
+    words.insert(words.end(), stats.uniqueWords.begin() + i, stats.uniqueWords.end());
+    frequencies.insert(frequencies.end(), stats.wordFrequency.begin() + i, stats.wordFrequency.end());
+    stats.uniqueWords = move(words);
+    stats.wordFrequency = move(frequencies);
+    
+    // Sentences keep their word counts, so the longest one stays the same
+    // sentence; every span moves by the length changes before and inside it
+    const SentenceSpan* longest = nullptr;
+    for (const SentenceSpan& sentence : stats.sentences) {
+        if (!longest || sentence.words > longest->words) {
+            longest = &sentence;
+        }
+    }
+    if (longest) {
+        size_t first = lower_bound(matches.begin(), matches.end(), longest->offset,
+                                   [](const ReplacementEngine::Match& match, uint64_t offset) {
+                                       return match.start < offset;
+                                   }) - matches.begin();
+        stats.longestSentence = rewriteRange(longest->offset, longest->offset + longest->length, first);
+        replace(stats.longestSentence.begin(), stats.longestSentence.end(), '\n', ' ');
+    }
+    size_t m = 0;
+    int64_t shift = 0;
+    for (SentenceSpan& sentence : stats.sentences) {
+        uint64_t end = sentence.offset + sentence.length;
+        for (; m < matches.size() && matches[m].start < sentence.offset; m++) {
+            shift += lengthChange(matches[m]);
+        }
+        int64_t inside = 0;
+        for (; m < matches.size() && matches[m].start < end; m++) {
+            inside += lengthChange(matches[m]);
+        }
+        sentence.offset += shift;
+        sentence.length += inside;
+        shift += inside;
+    }
+    
+    stats.avgSentenceLength = calculateAvgSentenceLength(stats.wordCount, stats.sentenceCount);
+    stats.minHash = computeMinHash(stats.uniqueWords);
+    
+    // The top words only need a full selection when one of them lost
+    // occurrences; otherwise no word outside the old top and the changed words
+    // can have overtaken them
+    bool topShrank = false;
+    for (const auto& entry : stats.topWords) {
+        topShrank = topShrank || getWordFrequency(stats, entry.first) < entry.second;
+    }
+    if (topShrank) {
+        stats.topWords = getTopFrequentWords(stats);
+    } else {
+        TopK<pair<string_view, int>, MoreFrequent> top(5);
+        for (const auto& change : changes) {
+            int count = getWordFrequencyById(stats, change.first);
+            if (count > 0) {
+                top.offer(make_pair(vocabulary.word(change.first), count));
+            }
+        }
+        for (const auto& entry : stats.topWords) {
+            uint32_t id = vocabulary.find(entry.first);
+            auto changed = lower_bound(changes.begin(), changes.end(), id, [](const pair<uint32_t, int>& change, uint32_t value) {
+                return change.first < value;
+            });
+            if (changed == changes.end() || changed->first != id) {
+                top.offer(make_pair(vocabulary.word(id), entry.second));
+            }
+        }
+        stats.topWords.clear();
+        for (const auto& entry : top.take()) {
+            stats.topWords.emplace_back(string(entry.first), entry.second);
+        }
+    }
+    return true;
+}
+
+// Brings a common-word list (sorted by ID) up to date with the documents after
+// only the counts of changedIds changed
+void updateCommonWords(vector<CommonWordCount>& common, const DocumentStats& doc1, const DocumentStats& doc2,
+                       vector<uint32_t> changedIds) {
+    sort(changedIds.begin(), changedIds.end());
+    changedIds.erase(unique(changedIds.begin(), changedIds.end()), changedIds.end());
+    for (uint32_t id : changedIds) {
+        int count1 = getWordFrequencyById(doc1, id);
+        int count2 = getWordFrequencyById(doc2, id);
+        auto it = lower_bound(common.begin(), common.end(), id, [](const CommonWordCount& entry, uint32_t value) {
+            return entry.id < value;
+        });
+        bool listed = it != common.end() && it->id == id;
+        if (count1 > 0 && count2 > 0) {
+            if (listed) {
+                it->count1 = count1;
+                it->count2 = count2;
+            } else {
+                common.insert(it, CommonWordCount{id, count1, count2});
+            }
+        } else if (listed) {
+            common.erase(it);
+        }
+    }
+}
 
-// Function declarations
-string loadFile(const string& filename);
-vector<string> tokenize(const string& text);
-string normalizeText(const string& text);
-int countWords(const vector<string>& tokens);
-int countSentences(const string& text);
-double calculateAvgSentenceLength(int wordCount, int sentenceCount);
-vector<pair<string, int>> getTopFrequentWords(const map<string, int>& wordFreq, int n = 5);
-set<string> getUniqueWords(const vector<string>& tokens);
-map<string, int> getWordFrequency(const vector<string>& tokens);
-set<string> findCommonWords(const set<string>& words1, const set<string>& words2);
-pair<string, int> findLongestSentence(const string& text);
-double jaccardSimilarity(const set<string>& set1, const set<string>& set2);
-map<string, pair<int, int>> getCommonWordsWithCounts(const DocumentStats& doc1, const DocumentStats& doc2);
-void printCommonWordsAnalysis(const DocumentStats& doc1, const DocumentStats& doc2);
-void printHeader();
-void printSeparator(char ch = '=', int length = 80);
-void printComparisonTable(const DocumentStats& doc1, const DocumentStats& doc2, double similarity);
-void writeReportToFile(const DocumentStats& doc1, const DocumentStats& doc2, double similarity, const set<string>& commonWords);
-void performWordReplacement(const string& originalFile1, const string& originalFile2);
-string replaceWordInText(const string& text, const string& oldWord, const string& newWord);
-int countWordOccurrences(const string& text, const string& word);
-DocumentStats analyzeDocument(const string& filename);
-void generateUpdatedReport(const string& file1, const string& file2, const string& oldWord, const string& newWord);
+// Whether two analyses of the same text agree, for --verify-updates
+bool sameAnalysis(const DocumentStats& a, const DocumentStats& b) {
+    auto sameSpans = [](const vector<SentenceSpan>& x, const vector<SentenceSpan>& y) {
+        return equal(x.begin(), x.end(), y.begin(), y.end(), [](const SentenceSpan& p, const SentenceSpan& q) {
+            return p.offset == q.offset && p.length == q.length && p.words == q.words;
+        });
+    };
+    return a.wordCount == b.wordCount && a.sentenceCount == b.sentenceCount && a.uniqueWords == b.uniqueWords &&
+           a.wordFrequency == b.wordFrequency && a.topWords == b.topWords && a.minHash == b.minHash &&
+           a.longestSentence == b.longestSentence && a.longestSentenceWordCount == b.longestSentenceWordCount &&
+           sameSpans(a.sentences, b.sentences);
+}
 
-int main() {
-    printHeader();
+// Pairs up two comma-separated word lists; empty when their lengths differ or
+// a word to replace is blank
+vector<pair<string, string>> parseReplacements(const string& oldWords, const string& newWords) {
+    auto split = [](const string& list) {
+        vector<string> words;
+        stringstream stream(list);
+        string word;
+        while (getline(stream, word, ',')) {
+            size_t first = word.find_first_not_of(" \t");
+            size_t last = word.find_last_not_of(" \t");
+            words.push_back(first == string::npos ? string() : word.substr(first, last - first + 1));
+        }
+        if (list.empty() || list.back() == ',') {
+            words.emplace_back();
+        }
+        return words;
+    };
+    vector<string> olds = split(oldWords);
+    vector<string> news = split(newWords);
+    vector<pair<string, string>> replacements;
+    if (olds.size() != news.size()) {
+        return replacements;
+    }
+    for (size_t i = 0; i < olds.size(); i++) {
+        if (olds[i].empty()) {
+            return {};
+        }
+        replacements.emplace_back(olds[i], news[i]);
+    }
+    return replacements;
+}
+
+// Builds the trie over the lowercased patterns, then fills in the failure
+// transitions breadth-first so every state has a full row in the table.
+// A pattern listed twice (ignoring case) keeps its first replacement.
+ReplacementEngine::ReplacementEngine(const vector<pair<string, string>>& replacements) {
+    for (const auto& replacement : replacements) {
+        string pattern = replacement.first;
+        transform(pattern.begin(), pattern.end(), pattern.begin(), ::tolower);
+        if (pattern.empty() || find(patterns.begin(), patterns.end(), pattern) != patterns.end()) {
+            continue;
+        }
+        for (unsigned char c : pattern) {
+            if (byteClass[c] == 0) {
+                byteClass[c] = classCount++;
+            }
+        }
+        maxLength = max(maxLength, pattern.size());
+        patterns.push_back(pattern);
+        substitutes.push_back(replacement.second);
+    }
+    for (int c = 0; c < 256; c++) {
+        byteClass[c] = byteClass[static_cast<unsigned char>(tolower(c))];
+    }
+    while (windowMask < maxLength) {
+        windowMask = windowMask * 2 + 1;
+    }
     
-    string file1, file2;
+    // Trie; 0 in a row means "no edge" until failure links fill it in
+    transitions.assign(classCount, 0);
+    terminal.assign(1, -1);
+    for (size_t p = 0; p < patterns.size(); p++) {
+        uint32_t state = 0;
+        for (unsigned char c : patterns[p]) {
+            uint32_t& edge = transitions[state * classCount + byteClass[c]];
+            if (edge == 0) {
+                edge = terminal.size();
+                terminal.push_back(-1);
+                transitions.resize(transitions.size() + classCount, 0);
+            }
+            state = transitions[state * classCount + byteClass[c]];
+        }
+        terminal[state] = p;
+    }
     
-    cout << "\n Enter path to first document: ";
-    getline(cin, file1);
+    vector<uint32_t> failure(terminal.size(), 0);
+    outputLink.assign(terminal.size(), 0);
+    deque<uint32_t> queue;
+    for (size_t c = 0; c < classCount; c++) {
+        if (transitions[c] != 0) {
+            queue.push_back(transitions[c]);
+        }
+    }
+    while (!queue.empty()) {
+        uint32_t state = queue.front();
+        queue.pop_front();
+        uint32_t fail = failure[state];
+        outputLink[state] = terminal[fail] >= 0 ? fail : outputLink[fail];
+        for (size_t c = 0; c < classCount; c++) {
+            uint32_t& edge = transitions[state * classCount + c];
+            uint32_t fallback = transitions[fail * classCount + c];
+            if (edge == 0) {
+                edge = fallback;
+            } else {
+                failure[edge] = fallback;
+                queue.push_back(edge);
+            }
+        }
+    }
+}
+
+size_t ReplacementEngine::rewrite(string_view text, ostream& out, vector<size_t>& counts, vector<Match>* matches) const {
+    TRACE_SCOPE("replace");
+    TRACE_COUNT(text.size(), 0);
+    counts.assign(patterns.size(), 0);
+    if (matches) {
+        matches->clear();
+    }
+    size_t total = 0;
+    size_t copied = 0;
+    scan(text, [&](size_t start, size_t end, uint32_t pattern) {
+        out.write(text.data() + copied, start - copied);
+        out.write(substitutes[pattern].data(), substitutes[pattern].size());
+        copied = end;
+        counts[pattern]++;
+        total++;
+        if (matches) {
+            matches->push_back(Match{start, end, pattern});
+        }
+    });
+    out.write(text.data() + copied, text.size() - copied);
+    return total;
+}
+
+vector<CommonWordCount> getCommonWordsWithCounts(const DocumentStats& doc1, const DocumentStats& doc2) {
+    TRACE_SCOPE("common-words");
+    TRACE_COUNT(0, doc1.uniqueWords.size() + doc2.uniqueWords.size());
+    vector<CommonWordCount> commonWords;
     
-    cout << " Enter path to second document: ";
-    getline(cin, file2);
+    commonWords.reserve(min(doc1.uniqueWords.size(), doc2.uniqueWords.size()));
+    forEachCommonId(doc1.uniqueWords, doc2.uniqueWords, [&](size_t i, size_t j) {
+        commonWords.push_back({doc1.uniqueWords[i], doc1.wordFrequency[i], doc2.wordFrequency[j]});
+    });
     
-    cout << "\n Processing documents: \n";
-    printSeparator('-', 50);
+    return commonWords;
+}
+void printCommonWordsAnalysis(const DocumentStats& doc1, const DocumentStats& doc2, const vector<CommonWordCount>& commonWords, size_t limit) {
+    cout << "\n COMMON WORDS DETAILED ANALYSIS\n";
+    printSeparator('=', 70);
     
-    // Analyze both documents
-    DocumentStats doc1 = analyzeDocument(file1);
-    DocumentStats doc2 = analyzeDocument(file2);
+    if (commonWords.empty()) {
+        cout << " No common words found between the documents.\n";
+        return;
+    }
+    // Highest total frequency (sum of both documents) first, alphabetical among ties
+    const WordInterner& vocabulary = sharedVocabulary();
+    auto moreUses = [](const CommonWordCount& a, const CommonWordCount& b) {
+        int totalA = a.count1 + a.count2, totalB = b.count1 + b.count2;
+        return totalA > totalB || (totalA == totalB && sharedVocabulary().word(a.id) < sharedVocabulary().word(b.id));
+    };
+    TopK<CommonWordCount, decltype(moreUses)> top(limit, moreUses);
+    for (const CommonWordCount& common : commonWords) {
+        top.offer(common);
+    }
+    vector<CommonWordCount> mostUsed = top.take();
     
-    if (doc1.wordCount == 0 || doc2.wordCount == 0) {
-        cout << " Error: Could not process one or both documents.\n";
-        return 1;
+    cout << left << setw(15) << "Word" 
+         << setw(12) << "Doc A Count" 
+         << setw(12) << "Doc B Count"
+         << setw(15) << "Total Uses"
+         << setw(15) << "Frequency %" << "\n";
+    printSeparator('-', 70);
+    
+    int64_t totalWordsDoc1 = doc1.wordCount;
+    int64_t totalWordsDoc2 = doc2.wordCount;
+    
+    for (const CommonWordCount& common : mostUsed) {
+        string_view word = vocabulary.word(common.id);
+        int count1 = common.count1;
+        int count2 = common.count2;
+        int totalUses = count1 + count2;
+        
+        double freq1 = (static_cast<double>(count1) / totalWordsDoc1) * 100;
+        double freq2 = (static_cast<double>(count2) / totalWordsDoc2) * 100;
+        double avgFreq = (freq1 + freq2) / 2;
+        
+        cout << left << padColumn(word, 15)
+             << setw(12) << count1
+             << setw(12) << count2
+             << setw(15) << totalUses
+             << setw(15) << (to_string(avgFreq).substr(0, 4) + "%") << "\n";
     }
+}
+
+void generateUpdatedReport(const DocumentStats& doc1, const DocumentStats& doc2, const vector<CommonWordCount>& commonWords,
+                           const vector<pair<string, string>>& replacements, const string& reportFilename, ReportFormat format) {
+    const string& file1 = doc1.filename;
+    const string& file2 = doc2.filename;
+    VocabularyOverlap overlap(doc1.uniqueWords.size(), doc2.uniqueWords.size(), commonWords.size());
     
-    // Calculate similarity
-    double similarity = jaccardSimilarity(doc1.uniqueWords, doc2.uniqueWords);
+    ReportBuffer report;
+    ReportContent content{&doc1, &doc2, overlap, &commonWords, {}};
+    content.replacements = &replacements;
+    renderReport(report, content, format);
+    if (!report.save(reportFilename)) {
+        cout << " Error: Cannot create " << reportFilename << "\n";
+        return;
+    }
     
-    // Display results
-    printComparisonTable(doc1, doc2, similarity);
+    // Check if the replacement words appear in analysis
+    vector<pair<int, int>> newWordCounts;
+    bool anyNewWordFound = false;
+    for (const auto& replacement : replacements) {
+        string word = normalizedWord(replacement.second);
+        newWordCounts.emplace_back(getWordFrequency(doc1, word), getWordFrequency(doc2, word));
+        anyNewWordFound = anyNewWordFound || newWordCounts.back().first > 0 || newWordCounts.back().second > 0;
+    }
     
-    // Common words analysis
-    printCommonWordsAnalysis(doc1, doc2);
+    cout << "Updated analysis report generated: " << reportFilename << "\n";
     
-    // Find common words
-    set<string> commonWords = findCommonWords(doc1.uniqueWords, doc2.uniqueWords);
+    // Also display brief updated comparison on screen
+    cout << "\n UPDATED COMPARISON SUMMARY:\n";
+    printSeparator('-', 40);
+    cout << " Document A Word Count: " << doc1.wordCount << "\n";
+    cout << " Document B Word Count: " << doc2.wordCount << "\n";
+    cout << " Updated Similarity: " << fixed << setprecision(2) << overlap.jaccard() << "%\n";
+    cout << " Common Words: " << overlap.common << "\n";
     
-    // Write detailed report
-    writeReportToFile(doc1, doc2, similarity, commonWords);
+    if (anyNewWordFound) {
+        cout << "\n REPLACEMENT VERIFICATION:\n";
+        for (size_t i = 0; i < replacements.size(); i++) {
+            if (newWordCounts[i].first > 0) {
+                cout << " '" << replacements[i].second << "' found " << newWordCounts[i].first << " times in updated " << file1 << "\n";
+            }
+            if (newWordCounts[i].second > 0) {
+                cout << " '" << replacements[i].second << "' found " << newWordCounts[i].second << " times in updated " << file2 << "\n";
+            }
+        }
+    }
+}
+
+// BATCH COMPARISON MODE
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0) {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < threads; i++) {
+        queues.push_back(make_unique<TaskQueue>());
+    }
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back([this, i] { workerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    wait();
+    {
+        lock_guard<mutex> guard(stateLock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::submit(function<void()> task) {
+    size_t target;
+    {
+        lock_guard<mutex> guard(stateLock);
+        target = nextQueue++ % queues.size();
+        queued++;
+        pending++;
+    }
+    {
+        lock_guard<mutex> guard(queues[target]->lock);
+        queues[target]->tasks.push_back(move(task));
+    }
+    wake.notify_one();
+}
+
+void ThreadPool::wait() {
+    unique_lock<mutex> guard(stateLock);
+    idle.wait(guard, [this] { return pending == 0; });
+}
+
+// Runs one task from the worker's own deque, or steals one from another worker
+bool ThreadPool::runOne(size_t self) {
+    function<void()> task;
+    for (size_t k = 0; k < queues.size() && !task; k++) {
+        TaskQueue& queue = *queues[(self + k) % queues.size()];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        if (k == 0) {
+            task = move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+    }
+    if (!task) {
+        return false;
+    }
+    {
+        lock_guard<mutex> guard(stateLock);
+        queued--;
+    }
+    task();
+    lock_guard<mutex> guard(stateLock);
+    if (--pending == 0) {
+        idle.notify_all();
+    }
+    return true;
+}
+
+void ThreadPool::workerLoop(size_t self) {
+    while (true) {
+        if (runOne(self)) {
+            continue;
+        }
+        unique_lock<mutex> guard(stateLock);
+        wake.wait(guard, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0) {
+            return;
+        }
+    }
+}
+
+// A directory contributes its regular files (sorted by name); any other path
+// is read as a manifest with one document path per line. Blank lines and lines
+// starting with '#' are skipped, relative paths are relative to the manifest.
+vector<string> collectBatchInputs(const string& source) {
+    namespace fs = std::filesystem;
+    vector<string> files;
+    error_code error;
     
-    cout << "\n Completed Successfully!\n Detailed report saved to 'result.txt'\n";
-    printSeparator();
+    if (fs::is_directory(source, error)) {
+        for (const fs::directory_entry& entry : fs::directory_iterator(source, error)) {
+            if (entry.is_regular_file(error)) {
+                files.push_back(entry.path().string());
+            }
+        }
+        sort(files.begin(), files.end());
+        return files;
+    }
     
-    // Ask for word replacement
-    performWordReplacement(file1, file2);
+    ifstream manifest(source);
+    if (!manifest.is_open()) {
+        cout << " Error: Cannot open batch source '" << source << "'\n";
+        return files;
+    }
+    fs::path base = fs::path(source).parent_path();
+    string line;
+    while (getline(manifest, line)) {
+        while (!line.empty() && isspace(static_cast<unsigned char>(line.back()))) {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        fs::path path(line);
+        files.push_back(path.is_absolute() ? line : (base / path).string());
+    }
+    return files;
+}
+
+constexpr char kCacheMagic[8] = {'T', 'X', 'T', 'C', 'M', 'P', 'C', '\0'};
+constexpr uint32_t kCacheVersion = 3;
+
+// Fixed-size start of a cache entry. It is followed by the sentence spans, the
+// MinHash signature, the word counts, the word lengths, the word bytes and the
+// longest sentence, all in native byte order.
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t minHashSize;
+    uint64_t fileSize;
+    int64_t modified;
+    uint64_t contentHash;
+    int64_t wordCount;
+    int64_t sentenceCount;
+    uint64_t vocabularySize;
+    uint64_t spanCount;
+    uint64_t wordBytes;
+    uint64_t longestLength;
+    int64_t longestWordCount;
+};
+
+// Size and modification time of the file, or false when it cannot be stat'ed
+static bool fileIdentity(const string& filename, uint64_t& size, int64_t& modified) {
+    error_code error;
+    size = filesystem::file_size(filename, error);
+    if (error) {
+        return false;
+    }
+    auto time = filesystem::last_write_time(filename, error);
+    if (error) {
+        return false;
+    }
+    modified = time.time_since_epoch().count();
+    return true;
+}
+
+void DocumentCache::configure(const string& cacheDirectory, bool enable) {
+    directory = cacheDirectory;
+    active = enable;
+}
+
+// Entries are named after a hash of the absolute path of the document
+string DocumentCache::entryPath(const string& filename) const {
+    error_code error;
+    filesystem::path absolute = filesystem::absolute(filename, error);
+    string key = error ? filename : absolute.string();
+    // Each normalization has its own entry, so switching back and forth
+    // keeps both warm
+    if (unsigned flags = sharedNormalization().flags()) {
+        key += "#" + to_string(flags);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(hashWord(key)));
+    return (filesystem::path(directory) / name).string();
+}
+
+bool DocumentCache::load(const string& filename, string_view content, DocumentStats& stats) const {
+    TRACE_SCOPE("cache-load");
+    uint64_t fileSize;
+    int64_t modified;
+    if (!active || filename == "-" || !fileIdentity(filename, fileSize, modified)) {
+        return false;
+    }
+    FileBuffer entry;
+    if (!entry.open(entryPath(filename))) {
+        return false;
+    }
+    string_view data = entry.text();
+    CacheHeader header;
+    if (data.size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    // Size and time are checked first so a stale entry costs no hashing
+    if (memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 || header.version != kCacheVersion ||
+        header.minHashSize != kMinHashSize || header.fileSize != fileSize || header.modified != modified ||
+        content.size() != fileSize || header.contentHash != hashWord(content)) {
+        return false;
+    }
     
-    return 0;
+    uint64_t vocabularySize = header.vocabularySize;
+    uint64_t expected = sizeof(header) + header.spanCount * sizeof(SentenceSpan) + kMinHashSize * sizeof(uint32_t) +
+                        vocabularySize * 2 * sizeof(uint32_t) + header.wordBytes + header.longestLength;
+    if (vocabularySize > UINT32_MAX || header.spanCount > data.size() || header.wordBytes > data.size() ||
+        header.longestLength > data.size() || expected != data.size()) {
+        return false;
+    }
+    const char* p = data.data() + sizeof(header);
+    auto readArray = [&p](auto& values, size_t count) {
+        values.resize(count);
+        memcpy(values.data(), p, count * sizeof(values[0]));
+        p += count * sizeof(values[0]);
+    };
+    readArray(stats.sentences, header.spanCount);
+    readArray(stats.minHash, kMinHashSize);
+    pmr::monotonic_buffer_resource arena(analysisArenaSize(data.size()));
+    pmr::vector<int> counts(&arena);
+    pmr::vector<uint32_t> lengths(&arena);
+    readArray(counts, vocabularySize);
+    readArray(lengths, vocabularySize);
+    
+    WordTable localWords(&arena);
+    const char* words = p;
+    const char* wordsEnd = p + header.wordBytes;
+    for (uint32_t length : lengths) {
+        if (static_cast<size_t>(wordsEnd - words) < length) {
+            return false;
+        }
+        localWords.insert(string_view(words, length));
+        words += length;
+    }
+    if (words != wordsEnd || localWords.size() != vocabularySize) {
+        return false;
+    }
+    setVocabulary(stats, localWords, counts);
+    
+    stats.wordCount = header.wordCount;
+    stats.sentenceCount = header.sentenceCount;
+    stats.longestSentence.assign(wordsEnd, header.longestLength);
+    stats.longestSentenceWordCount = static_cast<int>(header.longestWordCount);
+    return true;
+}
+
+// Best effort: a cache that cannot be written only costs the next run time.
+// The entry is written under a temporary name and renamed into place, so a
+// concurrent reader never sees a partial entry.
+void DocumentCache::store(const string& filename, string_view content, const DocumentStats& stats) const {
+    TRACE_SCOPE("cache-store");
+    CacheHeader header{};
+    if (!active || filename == "-" || stats.wordCount == 0 || !fileIdentity(filename, header.fileSize, header.modified) ||
+        header.fileSize != content.size()) {
+        return;
+    }
+    const WordInterner& vocabulary = sharedVocabulary();
+    vector<uint32_t> lengths(stats.uniqueWords.size());
+    for (size_t i = 0; i < lengths.size(); i++) {
+        lengths[i] = vocabulary.word(stats.uniqueWords[i]).size();
+        header.wordBytes += lengths[i];
+    }
+    memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+    header.version = kCacheVersion;
+    header.minHashSize = kMinHashSize;
+    header.contentHash = hashWord(content);
+    header.wordCount = stats.wordCount;
+    header.sentenceCount = stats.sentenceCount;
+    header.vocabularySize = stats.uniqueWords.size();
+    header.spanCount = stats.sentences.size();
+    header.longestLength = stats.longestSentence.size();
+    header.longestWordCount = stats.longestSentenceWordCount;
+    
+    error_code error;
+    filesystem::create_directories(directory, error);
+    string path = entryPath(filename);
+    string temporary = path + ".tmp" + to_string(hash<thread::id>()(this_thread::get_id()));
+    {
+        ofstream out(temporary, ios::binary | ios::trunc);
+        if (!out.is_open()) {
+            return;
+        }
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(stats.sentences.data()), stats.sentences.size() * sizeof(SentenceSpan));
+        out.write(reinterpret_cast<const char*>(stats.minHash.data()), stats.minHash.size() * sizeof(uint32_t));
+        out.write(reinterpret_cast<const char*>(stats.wordFrequency.data()), stats.wordFrequency.size() * sizeof(int));
+        out.write(reinterpret_cast<const char*>(lengths.data()), lengths.size() * sizeof(uint32_t));
+        for (uint32_t id : stats.uniqueWords) {
+            string_view word = vocabulary.word(id);
+            out.write(word.data(), word.size());
+        }
+        out.write(stats.longestSentence.data(), stats.longestSentence.size());
+        if (!out) {
+            out.close();
+            filesystem::remove(temporary, error);
+            return;
+        }
+    }
+    filesystem::rename(temporary, path, error);
+    if (error) {
+        filesystem::remove(temporary, error);
+    }
+}
+
+DocumentCache& sharedDocumentCache() {
+    static DocumentCache cache;
+    return cache;
+}
+
+const DocumentStats* DocumentStore::get(const string& filename, const StreamOptions& stream) {
+    uint64_t size = 0;
+    int64_t modified = 0;
+    bool known = filename != "-" && fileIdentity(filename, size, modified);
+    auto it = documents.find(filename);
+    unsigned normalization = sharedNormalization().flags();
+    if (known && it != documents.end() && it->second.size == size && it->second.modified == modified &&
+        (stream.enabled || !it->second.streamed) && it->second.normalization == normalization) {
+        return &it->second.stats;
+    }
+    
+    DocumentStats stats;
+    if (stream.enabled) {
+        stats = analyzeStream(filename, stream);
+    } else {
+        FileBuffer buffer;
+        if (!buffer.open(filename)) {
+            cout << " Error: Cannot open file '" << filename << "'\n";
+            return nullptr;
+        }
+        stats = analyzeCached(filename, buffer.text());
+    }
+    if (stats.wordCount == 0) {
+        cout << " Error: Cannot read '" << filename << "' or it contains no words\n";
+        return nullptr;
+    }
+    Entry& entry = documents[filename];
+    entry = Entry{size, modified, move(stats), stream.enabled, normalization};
+    return &entry.stats;
+}
+
+void DocumentStore::put(DocumentStats stats) {
+    uint64_t size;
+    int64_t modified;
+    if (fileIdentity(stats.filename, size, modified)) {
+        string filename = stats.filename;
+        documents[filename] = Entry{size, modified, move(stats), false, sharedNormalization().flags()};
+    }
+}
+
+// Loads and analyzes every file once on the pool; documents that cannot be
+// read or contain no words come back with wordCount == 0
+vector<DocumentStats> analyzeDocumentsParallel(const vector<string>& files, ThreadPool& pool, const StreamOptions& stream) {
+    vector<DocumentStats> docs(files.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        pool.submit([&, i] {
+            if (stream.enabled) {
+                docs[i] = analyzeStream(files[i], stream);
+                return;
+            }
+            FileBuffer buffer;
+            if (buffer.open(files[i]) && !buffer.empty()) {
+                docs[i] = analyzeCached(files[i], buffer.text());
+            } else {
+                docs[i].filename = files[i];
+                docs[i].wordCount = 0;
+            }
+        });
+    }
+    pool.wait();
+    return docs;
+}
+
+// Best k similarities of one matrix row; ties go to the lower column index
+struct HigherScore {
+    bool operator()(const pair<double, size_t>& a, const pair<double, size_t>& b) const {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    }
+};
+using ScoreTopK = TopK<pair<double, size_t>, HigherScore>;
+
+struct RowTopK {
+    mutex lock;
+    ScoreTopK best;
+};
+
+// Progress lines go to stderr when the results themselves go to stdout
+static ostream& batchProgress(const BatchOptions& options) {
+    return options.outputPath == "-" ? cerr : cout;
 }
 
+// Computes the pairwise Jaccard matrix. The upper triangle is cut into
+// tileSize x tileSize tiles, one pool task each, so a worker keeps a small set
+// of vocabularies hot in cache while it compares them against each other.
+bool runBatchComparison(const BatchOptions& options) {
+    vector<string> files = collectBatchInputs(options.source);
+    if (files.empty()) {
+        cout << " Error: No documents found in '" << options.source << "'\n";
+        return false;
+    }
+    
+    ThreadPool pool(options.threads);
+    ostream& progress = batchProgress(options);
+    progress << " Analyzing " << files.size() << " documents on " << pool.size() << " threads...\n";
+    vector<DocumentStats> analyzed = analyzeDocumentsParallel(files, pool, options.stream);
+    
+    vector<DocumentStats> docs;
+    for (DocumentStats& doc : analyzed) {
+        if (doc.wordCount == 0) {
+            progress << " Skipping '" << doc.filename << "': could not read it or it has no words\n";
+        } else {
+            docs.push_back(move(doc));
+        }
+    }
+    analyzed.clear();
+    
+    if (options.lshThreshold > 0) {
+        return writeNearDuplicates(docs, options, pool);
+    }
+    
+    size_t n = docs.size();
+    // The IDF table and every vector with its norm are built once for the corpus
+    SimilarityEngine engine(options.metric);
+    vector<const DocumentStats*> corpus;
+    for (const DocumentStats& doc : docs) {
+        corpus.push_back(&doc);
+    }
+    engine.fit(corpus);
+    vector<TermVector> vectors(n);
+    for (size_t i = 0; i < n; i++) {
+        pool.submit([&, i] {
+            TRACE_SCOPE("vectorize");
+            vectors[i] = engine.vectorize(docs[i]);
+        });
+    }
+    pool.wait();
+    size_t tile = max<size_t>(1, options.tileSize);
+    size_t tiles = (n + tile - 1) / tile;
+    progress << " Comparing " << n * (n - 1) / 2 << " document pairs...\n";
+    
+    vector<float> matrix;
+    vector<RowTopK> rows;
+    if (options.topK == 0) {
+        matrix.assign(n * n, 0.0f);
+    } else {
+        rows = vector<RowTopK>(n);
+        for (RowTopK& row : rows) {
+            row.best = ScoreTopK(options.topK);
+        }
+    }
+    
+    for (size_t ti = 0; ti < tiles; ti++) {
+        for (size_t tj = ti; tj < tiles; tj++) {
+            pool.submit([&, ti, tj] {
+                TRACE_SCOPE("compare-tile");
+                size_t rowBegin = ti * tile, rowEnd = min(n, rowBegin + tile);
+                size_t colBegin = tj * tile, colEnd = min(n, colBegin + tile);
+                vector<double> scores((rowEnd - rowBegin) * (colEnd - colBegin), -1.0);
+                for (size_t i = rowBegin; i < rowEnd; i++) {
+                    for (size_t j = max(colBegin, i + 1); j < colEnd; j++) {
+                        scores[(i - rowBegin) * (colEnd - colBegin) + (j - colBegin)] = engine.score(vectors[i], vectors[j]);
+                    }
+                }
+                for (size_t i = rowBegin; i < rowEnd; i++) {
+                    for (size_t j = max(colBegin, i + 1); j < colEnd; j++) {
+                        double score = scores[(i - rowBegin) * (colEnd - colBegin) + (j - colBegin)];
+                        if (options.topK == 0) {
+                            matrix[i * n + j] = matrix[j * n + i] = static_cast<float>(score);
+                        }
+                    }
+                }
+                if (options.topK == 0) {
+                    return;
+                }
+                // Select within the tile first, then merge into both rows of
+                // every pair with one short lock per row
+                for (size_t i = rowBegin; i < rowEnd; i++) {
+                    ScoreTopK local(options.topK);
+                    for (size_t j = max(colBegin, i + 1); j < colEnd; j++) {
+                        local.offer(make_pair(scores[(i - rowBegin) * (colEnd - colBegin) + (j - colBegin)], j));
+                    }
+                    lock_guard<mutex> guard(rows[i].lock);
+                    rows[i].best.merge(local);
+                }
+                for (size_t j = colBegin; j < colEnd; j++) {
+                    ScoreTopK local(options.topK);
+                    for (size_t i = rowBegin; i < min(rowEnd, j); i++) {
+                        local.offer(make_pair(scores[(i - rowBegin) * (colEnd - colBegin) + (j - colBegin)], i));
+                    }
+                    lock_guard<mutex> guard(rows[j].lock);
+                    rows[j].best.merge(local);
+                }
+            });
+        }
+    }
+    pool.wait();
+    
+    ReportBuffer output;
+    if (!output.open(options.outputPath)) {
+        cout << " Error: Cannot create " << options.outputPath << "\n";
+        return false;
+    }
+    if (options.topK == 0) {
+        vector<string> columns = {"document"};
+        for (const DocumentStats& doc : docs) {
+            columns.push_back(doc.filename);
+        }
+        TableWriter table(output, options.format, move(columns));
+        for (size_t i = 0; i < n; i++) {
+            table.text(docs[i].filename);
+            for (size_t j = 0; j < n; j++) {
+                table.number(i == j ? 100.0f : matrix[i * n + j]);
+            }
+            table.endRow();
+        }
+        table.finish();
+    } else {
+        TableWriter table(output, options.format, {"document", "rank", "match", similarityMetricInfo(options.metric).key});
+        for (size_t i = 0; i < n; i++) {
+            vector<pair<double, size_t>> best = rows[i].best.take();
+            for (size_t r = 0; r < best.size(); r++) {
+                table.text(docs[i].filename).integer(r + 1).text(docs[best[r].second].filename).number(best[r].first);
+                table.endRow();
+            }
+        }
+        table.finish();
+    }
+    if (!output.close()) {
+        cout << " Error: Cannot write " << options.outputPath << "\n";
+        return false;
+    }
+    
+    if (options.outputPath != "-") {
+        cout << " Similarity matrix for " << n << " documents saved to '" << options.outputPath << "'\n";
+    }
+    return true;
+}
 
-// loads all text from a file into a single string (with spaces between lines), 
-//reports success or failure, and returns that string.
-string loadFile(const string& filename) {
-    ifstream file(filename);
-    if (!file.is_open()) {
-        cout << " Error: Cannot open file '" << filename << "'\n";
-        return "";
+// Near-duplicate search: only LSH candidate pairs are scored, by MinHash
+// estimate and optionally by the exact Jaccard similarity, and pairs at or
+// above the threshold are written out
+bool writeNearDuplicates(const vector<DocumentStats>& docs, const BatchOptions& options, ThreadPool& pool) {
+    LshIndex index(options.lshThreshold);
+    for (size_t i = 0; i < docs.size(); i++) {
+        index.add(i, docs[i].minHash);
     }
+    vector<pair<uint32_t, uint32_t>> candidates = index.candidatePairs();
+    batchProgress(options) << " LSH index (" << index.bandCount() << " bands x " << index.rowsPerBand()
+         << " rows) found " << candidates.size() << " candidate pairs\n";
     
-    string content, line;
-    while (getline(file, line)) {
-        content += line + " ";
+    vector<double> estimates(candidates.size());
+    vector<double> exact(candidates.size(), -1.0);
+    const size_t chunk = 4096;
+    for (size_t begin = 0; begin < candidates.size(); begin += chunk) {
+        pool.submit([&, begin] {
+            for (size_t c = begin; c < min(candidates.size(), begin + chunk); c++) {
+                const DocumentStats& a = docs[candidates[c].first];
+                const DocumentStats& b = docs[candidates[c].second];
+                estimates[c] = estimateJaccard(a.minHash, b.minHash);
+                if (options.exactCheck) {
+                    exact[c] = jaccardSimilarity(a.uniqueWords, b.uniqueWords);
+                }
+            }
+        });
     }
-    file.close();
+    pool.wait();
     
-    cout << " Successfully loaded into the " << filename << "\n";
-    return content;
+    ReportBuffer output;
+    if (!output.open(options.outputPath)) {
+        cout << " Error: Cannot create " << options.outputPath << "\n";
+        return false;
+    }
+    vector<string> columns = {"document", "match", "estimate"};
+    if (options.exactCheck) {
+        columns.push_back("jaccard");
+    }
+    TableWriter table(output, options.format, move(columns));
+    size_t reported = 0;
+    for (size_t c = 0; c < candidates.size(); c++) {
+        double score = options.exactCheck ? exact[c] : estimates[c];
+        if (score < options.lshThreshold) {
+            continue;
+        }
+        table.text(docs[candidates[c].first].filename).text(docs[candidates[c].second].filename).number(estimates[c]);
+        if (options.exactCheck) {
+            table.number(exact[c]);
+        }
+        table.endRow();
+        reported++;
+    }
+    table.finish();
+    if (!output.close()) {
+        cout << " Error: Cannot write " << options.outputPath << "\n";
+        return false;
+    }
+    
+    if (options.outputPath != "-") {
+        cout << " " << reported << " near-duplicate pairs saved to '" << options.outputPath << "'\n";
+    }
+    return true;
 }
 
-//Converting to lowercase, Preserving only alphabetic characters, spaces, and sentence-ending punctuation
-string normalizeText(const string& text) {
-    string normalized;
-    for (char c : text) {
-        if (isalpha(c) || isspace(c) || c == '.' || c == '!' || c == '?') {
-            normalized += tolower(c);
-        } else if (ispunct(c)) {
-            normalized += ' ';
+// SERVER MODE
+
+static uint8_t bitWidth(uint32_t value) {
+    return value ? static_cast<uint8_t>(32 - __builtin_clz(value)) : 0;
+}
+
+// Appends values as consecutive bits-wide little-endian fields
+static void packBits(vector<uint8_t>& out, const uint32_t* values, size_t n, unsigned bits) {
+    size_t start = out.size();
+    out.resize(start + (n * bits + 7) / 8, 0);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t bit = uint64_t(i) * bits;
+        uint64_t value = uint64_t(values[i]) << (bit % 8);
+        for (size_t b = start + bit / 8; value; b++, value >>= 8) {
+            out[b] |= static_cast<uint8_t>(value);
         }
     }
-    return normalized;
 }
 
-//Breaks normalized text into individual words
-// takes a string of text and splits it into words (tokens), returning them in a vector<string>.
-vector<string> tokenize(const string& text) {
-    vector<string> tokens;
-    istringstream iss(normalizeText(text));
-    string word;
+// Field index of a packBits run; reads 8 bytes, so the run needs padding after
+// it (InvertedIndex::data ends with kPadding zero bytes)
+static uint32_t unpackBits(const uint8_t* run, size_t index, unsigned bits) {
+    uint64_t bit = uint64_t(index) * bits;
+    uint64_t word;
+    memcpy(&word, run + bit / 8, 8);
+    return static_cast<uint32_t>((word >> (bit % 8)) & ((uint64_t(1) << bits) - 1));
+}
+
+// Postings are grouped by word with a counting sort, then every list is coded
+// in blocks of kBlockSize postings. A block packs its documents, less the
+// previous block's last one, and then its counts, each at the width its
+// largest value needs, so any posting is read in a few instructions.
+InvertedIndex::InvertedIndex(const vector<DocumentStats>& docs, SimilarityMetric metric) : engine(metric) {
+    TRACE_SCOPE("build-index");
+    vector<const DocumentStats*> corpus;
+    for (const DocumentStats& doc : docs) {
+        corpus.push_back(&doc);
+        names.push_back(doc.filename);
+    }
+    engine.fit(corpus);
     
-    while (iss >> word) {
-        if (!word.empty() && isalpha(word[0])) {
-            tokens.push_back(word);
+    size_t vocabulary = sharedVocabulary().size();
+    vector<uint32_t> starts(vocabulary + 1, 0);
+    scales.resize(docs.size());
+    for (size_t d = 0; d < docs.size(); d++) {
+        double norm = engine.vectorize(docs[d]).norm;
+        scales[d] = norm > 0 ? 1 / norm : 0;
+        for (uint32_t id : docs[d].uniqueWords) {
+            starts[id + 1]++;
         }
     }
-    return tokens;
+    for (size_t id = 0; id < vocabulary; id++) {
+        starts[id + 1] += starts[id];
+    }
+    postings = starts[vocabulary];
+    vector<uint32_t> docOf(postings), countOf(postings);
+    vector<uint32_t> fill(starts.begin(), starts.end() - 1);
+    for (uint32_t d = 0; d < docs.size(); d++) {
+        for (size_t i = 0; i < docs[d].uniqueWords.size(); i++) {
+            uint32_t slot = fill[docs[d].uniqueWords[i]]++;
+            docOf[slot] = d;
+            countOf[slot] = docs[d].wordFrequency[i];
+        }
+    }
+    
+    lists.resize(vocabulary);
+    data.reserve(postings * 2);
+    uint32_t offsets[kBlockSize];
+    for (uint32_t id = 0; id < vocabulary; id++) {
+        PostingList& list = lists[id];
+        list.firstBlock = static_cast<uint32_t>(blocks.size());
+        list.length = starts[id + 1] - starts[id];
+        uint32_t base = 0;
+        for (uint32_t begin = starts[id]; begin < starts[id + 1]; begin += kBlockSize) {
+            uint32_t n = min(kBlockSize, starts[id + 1] - begin);
+            Block block;
+            block.lastDoc = docOf[begin + n - 1];
+            block.offset = data.size();
+            block.docBits = bitWidth(block.lastDoc - base);
+            block.countBits = bitWidth(*max_element(&countOf[begin], &countOf[begin] + n));
+            for (uint32_t i = 0; i < n; i++) {
+                offsets[i] = docOf[begin + i] - base;
+                list.maxWeight = max(list.maxWeight, countOf[begin + i] * scales[docOf[begin + i]]);
+            }
+            packBits(data, offsets, n, block.docBits);
+            packBits(data, &countOf[begin], n, block.countBits);
+            blocks.push_back(block);
+            base = block.lastDoc;
+        }
+    }
+    data.resize(data.size() + kPadding, 0);
 }
 
-int countWords(const vector<string>& tokens) {
-    return tokens.size();
+size_t InvertedIndex::indexBytes() const {
+    return data.size() + blocks.size() * sizeof(Block) + lists.size() * sizeof(PostingList) + scales.size() * sizeof(double);
 }
 
-int countSentences(const string& text) {
-    int count = 0;
-    for (char c : text) {
-        if (c == '.' || c == '!' || c == '?') {
-            count++;
+// Position in the posting list of one query word
+class InvertedIndex::Cursor {
+public:
+    static constexpr uint32_t kEnd = UINT32_MAX;
+
+    // The bound is padded a little so rounding never prunes a document that
+    // scores exactly the k-th score
+    Cursor(const InvertedIndex& index, const PostingList& list, double factor)
+        : factor(factor), bound(factor * list.maxWeight * (1 + 1e-9)), index(&index), list(&list) {
+        enter(list.firstBlock);
+    }
+
+    void next() {
+        if (++position == list->length) {
+            doc = kEnd;
+        } else if (position % kBlockSize == 0) {
+            enter(block + 1);
+        } else {
+            read();
         }
     }
-    return count > 0 ? count : 1; // At least 1 sentence
-}
 
-double calculateAvgSentenceLength(int wordCount, int sentenceCount) {
-    return sentenceCount > 0 ? static_cast<double>(wordCount) / sentenceCount : 0.0;
-}
+    // Moves to the first document >= target, skipping whole blocks
+    void advance(uint32_t target) {
+        if (doc >= target) {
+            return;
+        }
+        if (index->blocks[block].lastDoc < target) {
+            uint32_t lastBlock = list->firstBlock + (list->length - 1) / kBlockSize;
+            uint32_t skip = block;
+            while (skip < lastBlock && index->blocks[skip].lastDoc < target) {
+                skip++;
+            }
+            if (index->blocks[skip].lastDoc < target) {
+                position = list->length;
+                doc = kEnd;
+                return;
+            }
+            enter(skip);
+        }
+        while (doc < target) {
+            next();
+        }
+    }
 
-map<string, int> getWordFrequency(const vector<string>& tokens) {
-    map<string, int> frequency;
-    for (const string& word : tokens) {
-        frequency[word]++;
+    // Calls visit(doc, count) for the rest of the list and returns how many
+    // postings it saw. Decoding into locals keeps the visitor's stores from
+    // forcing the cursor back to memory on every posting.
+    template <typename Visit>
+    uint32_t drain(Visit visit) {
+        if (doc == kEnd) {
+            return 0;
+        }
+        uint32_t seen = remaining();
+        while (true) {
+            const uint8_t* docs = docData;
+            const uint8_t* counts = countData;
+            unsigned docBits = index->blocks[block].docBits;
+            unsigned countBits = index->blocks[block].countBits;
+            uint32_t first = position % kBlockSize;
+            uint32_t end = blockLength(block);
+            for (uint32_t i = first; i < end; i++) {
+                visit(base + unpackBits(docs, i, docBits), unpackBits(counts, i, countBits));
+            }
+            position += end - first;
+            if (position == list->length) {
+                break;
+            }
+            enter(block + 1);
+        }
+        doc = kEnd;
+        return seen;
     }
-    return frequency;
-}
 
-vector<pair<string, int>> getTopFrequentWords(const map<string, int>& wordFreq, int n) {
-    vector<pair<string, int>> words(wordFreq.begin(), wordFreq.end());
+    uint32_t remaining() const { return list->length - position; }
+
+    uint32_t doc = 0;
+    uint32_t count = 0;
+    double factor;      // query weight times the word's weight factor
+    double bound;       // largest contribution to any document's score
+
+private:
+    uint32_t blockLength(uint32_t b) const {
+        return min(kBlockSize, list->length - (b - list->firstBlock) * kBlockSize);
+    }
+
+    void enter(uint32_t b) {
+        const Block& entry = index->blocks[b];
+        block = b;
+        position = (b - list->firstBlock) * kBlockSize;
+        base = b > list->firstBlock ? index->blocks[b - 1].lastDoc : 0;
+        docData = index->data.data() + entry.offset;
+        countData = docData + (blockLength(b) * entry.docBits + 7) / 8;
+        read();
+    }
+
+    void read() {
+        const Block& entry = index->blocks[block];
+        doc = base + unpackBits(docData, position % kBlockSize, entry.docBits);
+        count = unpackBits(countData, position % kBlockSize, entry.countBits);
+    }
+
+    const InvertedIndex* index;
+    const PostingList* list;
+    uint32_t block = 0;
+    uint32_t position = 0;
+    uint32_t base = 0;
+    const uint8_t* docData = nullptr;
+    const uint8_t* countData = nullptr;
+};
+
+// A document's score is the sum over the query words it holds of query weight
+// times count over its norm; the query norm is divided out at the end since
+// it is the same for every document.
+//
+// Lists are added up one at a time, largest bound first, while a document
+// found in none of them yet could still reach the k-th best score so far.
+// Past that point only the documents already found can make the top k, and
+// the remaining lists (the common words, and so the long lists) only add to
+// those, dropping each once even the lists left cannot lift it.
+vector<InvertedIndex::Hit> InvertedIndex::topK(const DocumentStats& query, size_t k) const {
+    TRACE_SCOPE("query");
+    TermVector queryVector = engine.vectorize(query);
+    vector<Cursor> cursors;
+    cursors.reserve(query.uniqueWords.size());
+    for (size_t i = 0; i < query.uniqueWords.size(); i++) {
+        uint32_t id = query.uniqueWords[i];
+        if (id < lists.size() && lists[id].length > 0) {
+            cursors.emplace_back(*this, lists[id], queryVector.weights[i] * static_cast<double>(engine.termWeight(id)));
+        }
+    }
+    sort(cursors.begin(), cursors.end(), [](const Cursor& a, const Cursor& b) { return a.bound > b.bound; });
+    // rest[i] is the most cursors[i..] can add to any document
+    vector<double> rest(cursors.size() + 1, 0.0);
+    for (size_t i = cursors.size(); i-- > 0;) {
+        rest[i] = rest[i + 1] + cursors[i].bound;
+    }
     
-    sort(words.begin(), words.end(), [](const pair<string, int>& a, const pair<string, int>& b) {
-        return a.second > b.second;
-    });
+    vector<double> scores(scales.size(), 0.0);
+    vector<uint8_t> found(scales.size(), 0);    // 1 while the document is a candidate
+    vector<uint32_t> candidates;
+    // The k-th best partial score; scores only grow, so it stays a lower
+    // bound of the final k-th best. Refreshing it costs a pass over the
+    // candidates, so that waits for kRefreshRatio postings per candidate.
+    double threshold = 0;
+    vector<double> partial;
+    size_t added = 0;
+    bool closed = false;    // no document outside the candidates can make the top k
+    auto prune = [&](double reach) {
+        size_t kept = 0;
+        for (uint32_t doc : candidates) {
+            if (scores[doc] + reach >= threshold) {
+                candidates[kept++] = doc;
+            } else {
+                found[doc] = 0;
+            }
+        }
+        candidates.resize(kept);
+    };
+    for (size_t word = 0; word < cursors.size(); word++) {
+        if (candidates.size() >= k && added >= candidates.size() * kRefreshRatio) {
+            partial.clear();
+            for (uint32_t doc : candidates) {
+                partial.push_back(scores[doc]);
+            }
+            nth_element(partial.begin(), partial.begin() + (k - 1), partial.end(), greater<double>());
+            threshold = max(threshold, partial[k - 1]);
+            added = 0;
+            if (closed) {
+                prune(rest[word]);
+            }
+        }
+        if (!closed && rest[word] < threshold) {
+            closed = true;
+            sort(candidates.begin(), candidates.end());
+            prune(rest[word]);
+        }
+        
+        Cursor& cursor = cursors[word];
+        double factor = cursor.factor;
+        if (!closed) {
+            added += cursor.drain([&](uint32_t doc, uint32_t count) {
+                if (!found[doc]) {
+                    found[doc] = 1;
+                    candidates.push_back(doc);
+                }
+                scores[doc] += factor * count * scales[doc];
+            });
+        } else if (cursor.remaining() < candidates.size() * kProbeRatio) {
+            added += cursor.drain([&](uint32_t doc, uint32_t count) {
+                if (found[doc]) {
+                    scores[doc] += factor * count * scales[doc];
+                }
+            });
+        } else {
+            // Few candidates against a long list: skip to each of them
+            for (uint32_t doc : candidates) {
+                cursor.advance(doc);
+                if (cursor.doc == doc) {
+                    scores[doc] += factor * cursor.count * scales[doc];
+                }
+            }
+            added += candidates.size();
+        }
+    }
     
-    if (words.size() > n) {
-        words.resize(n);
+    auto better = [](const Hit& a, const Hit& b) {
+        return a.percent != b.percent ? a.percent > b.percent : a.doc < b.doc;
+    };
+    TopK<Hit, decltype(better)> best(k, better);
+    for (uint32_t doc : candidates) {
+        best.offer(Hit{doc, scores[doc]});
     }
+    vector<Hit> hits = best.take();
+    for (Hit& hit : hits) {
+        hit.percent = queryVector.norm > 0 ? hit.percent / queryVector.norm * 100.0 : 0.0;
+    }
+    return hits;
+}
+
+// Words of a query as a document: shared word IDs in order with their counts,
+// normalized like the corpus. The shared vocabulary is only searched, never
+// grown, so queries on several connections can run at once. Words the corpus
+// lacks keep their counts under WordTable::npos and only add to the norm.
+DocumentStats queryTerms(string_view text) {
+    WordTable words;
+    vector<int> counts;
+    TokenScanner scanner;
+    scanner.normalizeWith(sharedNormalization());
+    auto countWord = [&](string_view word) {
+        uint32_t index = words.insert(word);
+        if (index == counts.size()) {
+            counts.push_back(1);
+        } else {
+            counts[index]++;
+        }
+    };
+    scanner.feed(text, countWord);
+    scanner.finish(countWord);
     
-    return words;
+    WordInterner& vocabulary = sharedVocabulary();
+    vector<pair<uint32_t, int>> terms;
+    for (uint32_t w = 0; w < words.size(); w++) {
+        terms.emplace_back(vocabulary.find(words.word(w)), counts[w]);
+    }
+    sort(terms.begin(), terms.end());
+    DocumentStats query;
+    query.wordCount = 0;
+    for (const auto& term : terms) {
+        query.uniqueWords.push_back(term.first);
+        query.wordFrequency.push_back(term.second);
+        query.wordCount += term.second;
+    }
+    return query;
 }
 
-set<string> getUniqueWords(const vector<string>& tokens) {
-    return set<string>(tokens.begin(), tokens.end());
+// One line without its line ending; false at the end of the input
+static bool readLine(FILE* in, string& line) {
+    line.clear();
+    char chunk[4096];
+    while (fgets(chunk, sizeof(chunk), in)) {
+        line += chunk;
+        if (line.back() == '\n') {
+            line.pop_back();
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            return true;
+        }
+    }
+    return !line.empty();
 }
 
-set<string> findCommonWords(const set<string>& words1, const set<string>& words2) {
-    set<string> common;
-    set_intersection(words1.begin(), words1.end(),
-                    words2.begin(), words2.end(),
-                    inserter(common, common.begin()));
-    return common;
+// Answers one client's requests, one per line, until it sends quit or the
+// input ends. Every reply starts with "ok <n>" followed by n lines, or with
+// "error <message>":
+//   query <text>   the top-k documents for the text: "<percent>\t<document>"
+//                  lines, with the time taken in microseconds after n
+//   file <path>    the same for a file the server can read
+//   top <k>        k for the following queries on this connection
+//   stats          documents, words, postings and index size
+//   quit           closes the connection
+void serveConnection(FILE* in, FILE* out, const InvertedIndex& index, const ServeOptions& options) {
+    size_t k = options.topK;
+    string line, reply;
+    auto send = [&] {
+        fwrite(reply.data(), 1, reply.size(), out);
+        fflush(out);
+        reply.clear();
+    };
+    reply = "ready " + to_string(index.documentCount()) + "\n";
+    send();
+    while (readLine(in, line)) {
+        size_t space = line.find(' ');
+        string command = line.substr(0, space);
+        string argument = space == string::npos ? string() : line.substr(space + 1);
+        if (command == "query" || command == "file") {
+            auto started = chrono::steady_clock::now();
+            FileBuffer buffer;
+            if (command == "file" && !buffer.open(argument)) {
+                reply = "error cannot open '" + argument + "'\n";
+                send();
+                continue;
+            }
+            DocumentStats query = queryTerms(command == "file" ? buffer.text() : string_view(argument));
+            vector<InvertedIndex::Hit> hits = index.topK(query, k);
+            auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started);
+            reply = "ok " + to_string(hits.size()) + " " + to_string(elapsed.count()) + "\n";
+            char percent[32];
+            for (const InvertedIndex::Hit& hit : hits) {
+                snprintf(percent, sizeof(percent), "%.2f\t", hit.percent);
+                reply += percent;
+                reply += index.documentName(hit.doc);
+                reply += '\n';
+            }
+        } else if (command == "top") {
+            size_t value = 0;
+            auto parsed = from_chars(argument.data(), argument.data() + argument.size(), value);
+            if (parsed.ec != errc() || parsed.ptr != argument.data() + argument.size() || value == 0) {
+                reply = "error top takes a positive number\n";
+            } else {
+                k = value;
+                reply = "ok 0\n";
+            }
+        } else if (command == "stats") {
+            reply = "ok 4\ndocuments\t" + to_string(index.documentCount()) + "\nwords\t" + to_string(sharedVocabulary().size()) +
+                    "\npostings\t" + to_string(index.postingCount()) + "\nindex_bytes\t" + to_string(index.indexBytes()) + "\n";
+        } else if (command == "quit") {
+            reply = "ok 0\n";
+            send();
+            return;
+        } else if (command.empty()) {
+            continue;
+        } else {
+            reply = "error unknown command '" + command + "'\n";
+        }
+        send();
+    }
 }
-pair<string, int> findLongestSentence(const string& text) {
-    string longestSentence;
-    int maxWords = 0;
+
+#ifndef _WIN32
+// Accepts clients on a Unix domain socket, each on its own thread. The index
+// is only read, so any number of queries can run at once. Returns only when
+// the socket fails, after every client thread has finished with the index.
+static bool serveSocket(const InvertedIndex& index, const ServeOptions& options) {
+    sockaddr_un address{};
+    if (options.socketPath.size() >= sizeof(address.sun_path)) {
+        cerr << " Error: Socket path '" << options.socketPath << "' is too long\n";
+        return false;
+    }
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, options.socketPath.c_str(), options.socketPath.size() + 1);
     
-    istringstream iss(text);
-    string sentence;
-    char c;
+    // Only a stale socket is replaced, never another kind of file
+    struct stat existing;
+    if (stat(options.socketPath.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+        unlink(options.socketPath.c_str());
+    }
+    // A client that disconnects mid-reply must not end the server
+    signal(SIGPIPE, SIG_IGN);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        cerr << " Error: Cannot listen on '" << options.socketPath << "': " << strerror(errno) << "\n";
+        if (listener >= 0) {
+            close(listener);
+        }
+        return false;
+    }
+    cerr << " Listening on " << options.socketPath << "\n";
+    // Client threads stay joinable; finished ones are joined as new clients come
+    struct Client {
+        unique_ptr<atomic<bool>> done;
+        thread worker;
+    };
+    vector<Client> clients;
+    auto joinClients = [&](bool all) {
+        for (size_t c = 0; c < clients.size();) {
+            if (all || clients[c].done->load()) {
+                clients[c].worker.join();
+                clients.erase(clients.begin() + c);
+            } else {
+                c++;
+            }
+        }
+    };
+    while (true) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            cerr << " Error: Cannot accept connections: " << strerror(errno) << "\n";
+            close(listener);
+            joinClients(true);
+            return false;
+        }
+        joinClients(false);
+        clients.push_back(Client{make_unique<atomic<bool>>(false), thread()});
+        atomic<bool>* done = clients.back().done.get();
+        clients.back().worker = thread([client, done, &index, &options] {
+            FILE* in = fdopen(client, "r");
+            int writer = in ? dup(client) : -1;
+            FILE* out = writer >= 0 ? fdopen(writer, "w") : nullptr;
+            if (in && out) {
+                serveConnection(in, out, index, options);
+            }
+            if (out) {
+                fclose(out);
+            } else if (writer >= 0) {
+                close(writer);
+            }
+            if (in) {
+                fclose(in);
+            } else {
+                close(client);
+            }
+            done->store(true);
+        });
+    }
+}
+#endif
+
+// args[0] is "serve" and args[1] the corpus (directory or manifest). Progress
+// goes to stderr, since stdout carries the replies without --socket.
+int runServeMode(const vector<string>& args) {
+    ServeOptions options;
+    if (args.size() < 2) {
+        printUsage();
+        return 1;
+    }
+    options.source = args[1];
     
-    while (iss.get(c)) {
-        sentence += c;
-        if (c == '.' || c == '!' || c == '?') {
-            vector<string> words = tokenize(sentence);
-            if (words.size() > maxWords) {
-                maxWords = words.size();
-                longestSentence = sentence;
+    for (size_t i = 2; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (arg == "--no-cache") {
+            options.useCache = false;
+            continue;
+        }
+        if (arg == "--stop-words") {
+            sharedNormalization().stopWords = true;
+            continue;
+        }
+        if (arg == "--stem") {
+            sharedNormalization().stem = true;
+            continue;
+        }
+        if (i + 1 >= args.size()) {
+            cerr << " Error: Missing value for " << arg << "\n";
+            return 1;
+        }
+        const string& value = args[++i];
+        if (arg == "--socket") {
+            options.socketPath = value;
+        } else if (arg == "--top-k") {
+            if (!parseCount(arg, value, options.topK)) {
+                return 1;
             }
-            sentence.clear();
+            options.topK = max<size_t>(1, options.topK);
+        } else if (arg == "--threads") {
+            if (!parseCount(arg, value, options.threads)) {
+                return 1;
+            }
+        } else if (arg == "--cache-dir") {
+            options.cacheDirectory = value;
+        } else if (arg == "--metric") {
+            if (value == "cosine") {
+                options.metric = METRIC_COSINE;
+            } else if (value == "tfidf") {
+                options.metric = METRIC_TFIDF_COSINE;
+            } else {
+                cerr << " Error: serve ranks by 'tfidf' (default) or 'cosine'\n";
+                return 1;
+            }
+        } else {
+            cerr << " Error: Unknown option " << arg << "\n";
+            printUsage();
+            return 1;
         }
     }
+#ifdef _WIN32
+    if (!options.socketPath.empty()) {
+        cerr << " Error: --socket needs Unix domain sockets\n";
+        return 1;
+    }
+#endif
     
-    // Handle case where text doesn't end with punctuation
-    if (!sentence.empty()) {
-        vector<string> words = tokenize(sentence);
-        if (words.size() > maxWords) {
-            maxWords = words.size();
-            longestSentence = sentence;
+    vector<string> files = collectBatchInputs(options.source);
+    if (files.empty()) {
+        cerr << " Error: No documents found in '" << options.source << "'\n";
+        return 1;
+    }
+    sharedDocumentCache().configure(options.cacheDirectory, options.useCache);
+    auto started = chrono::steady_clock::now();
+    vector<DocumentStats> docs;
+    {
+        ThreadPool pool(options.threads);
+        for (DocumentStats& doc : analyzeDocumentsParallel(files, pool, StreamOptions())) {
+            if (doc.wordCount == 0) {
+                cerr << " Skipping '" << doc.filename << "': could not read it or it has no words\n";
+            } else {
+                docs.push_back(move(doc));
+            }
         }
     }
+    InvertedIndex index(docs, options.metric);
+    docs.clear();
+    docs.shrink_to_fit();
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started);
+    cerr << " Indexed " << index.documentCount() << " documents, " << index.postingCount() << " postings in "
+         << index.indexBytes() / 1024 << " KiB, in " << elapsed.count() << " ms\n";
     
-    return make_pair(longestSentence, maxWords);
+#ifndef _WIN32
+    if (!options.socketPath.empty()) {
+        return serveSocket(index, options) ? 0 : 1;
+    }
+#endif
+    serveConnection(stdin, stdout, index, options);
+    return 0;
 }
 
-double jaccardSimilarity(const set<string>& set1, const set<string>& set2) {
-    set<string> intersection;
-    set<string> unionSet;
-    
-    set_intersection(set1.begin(), set1.end(),
-                    set2.begin(), set2.end(),
-                    inserter(intersection, intersection.begin()));
-    
-    set_union(set1.begin(), set1.end(),
-             set2.begin(), set2.end(),
-             inserter(unionSet, unionSet.begin()));
-    
-    if (unionSet.empty()) return 0.0;
-    
-    return static_cast<double>(intersection.size()) / unionSet.size() * 100.0;
+// BENCHMARKS
+
+#ifdef TEXTCMP_COUNT_ALLOCATIONS
+static atomic<uint64_t> allocationTotal{0};
+static atomic<uint64_t> allocationBytesTotal{0};
+static thread_local uint64_t threadAllocations = 0;      // for trace scopes
+static thread_local uint64_t threadAllocatedBytes = 0;
+
+void* operator new(size_t size) {
+    allocationTotal.fetch_add(1, memory_order_relaxed);
+    allocationBytesTotal.fetch_add(size, memory_order_relaxed);
+    threadAllocations++;
+    threadAllocatedBytes += size;
+    if (void* p = malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw bad_alloc();
 }
 
-DocumentStats analyzeDocument(const string& filename) {
-    DocumentStats stats;
-    stats.filename = filename;
-    
-    string content = loadFile(filename);
-    if (content.empty()) {
-        stats.wordCount = 0;
-        return stats;
+// Not inlined: GCC would otherwise see free() of a pointer from new and warn
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    operator delete(p);
+}
+
+constexpr bool kCountAllocations = true;
+#else
+constexpr bool kCountAllocations = false;
+#endif
+
+static uint64_t allocationsSoFar() {
+#ifdef TEXTCMP_COUNT_ALLOCATIONS
+    return allocationTotal.load(memory_order_relaxed);
+#else
+    return 0;
+#endif
+}
+
+static uint64_t allocatedBytesSoFar() {
+#ifdef TEXTCMP_COUNT_ALLOCATIONS
+    return allocationBytesTotal.load(memory_order_relaxed);
+#else
+    return 0;
+#endif
+}
+
+#ifdef TEXTCMP_TRACE
+// TRACING
+
+struct TraceEvent {
+    const char* name;
+    int64_t start;              // ns since the session started
+    int64_t duration;
+    int64_t cpu;
+    uint64_t majorFaults;
+    uint64_t bytes;
+    uint64_t tokens;
+    uint64_t allocations;
+    uint64_t allocatedBytes;
+};
+
+// Events of one thread; only that thread appends, the session reads them
+// after the work is done
+struct TraceThread {
+    uint32_t id;
+    vector<TraceEvent> events;
+};
+
+static const auto traceEpoch = chrono::steady_clock::now();
+static mutex traceThreadsLock;
+static vector<unique_ptr<TraceThread>> traceThreads;
+
+static TraceThread& currentTraceThread() {
+    thread_local TraceThread* current = nullptr;
+    if (!current) {
+        lock_guard<mutex> guard(traceThreadsLock);
+        traceThreads.push_back(make_unique<TraceThread>());
+        current = traceThreads.back().get();
+        current->id = static_cast<uint32_t>(traceThreads.size() - 1);
+        current->events.reserve(4096);
     }
-    
-    vector<string> tokens = tokenize(content);
-    
-    stats.wordCount = countWords(tokens);
-    stats.sentenceCount = countSentences(content);
-    stats.avgSentenceLength = calculateAvgSentenceLength(stats.wordCount, stats.sentenceCount);
-    stats.uniqueWords = getUniqueWords(tokens);
-    stats.wordFrequency = getWordFrequency(tokens);
-    stats.topWords = getTopFrequentWords(stats.wordFrequency);
-    
-    auto longestInfo = findLongestSentence(content);
-    stats.longestSentence = longestInfo.first;
-    stats.longestSentenceWordCount = longestInfo.second;
-    
-    return stats;
+    return *current;
 }
 
-void printHeader() {
-    printSeparator();
-    cout << setw(40) << " TEXT COMPARATOR \n";
-    cout << setw(42) << "Document Analysis & Comparison Tool\n";
-    printSeparator();
+static int64_t traceNow() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - traceEpoch).count();
 }
 
-void printSeparator(char ch, int length) {
-    cout << string(length, ch) << "\n";
+static int64_t threadCpuNow() {
+#ifndef _WIN32
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+#else
+    return 0;
+#endif
 }
 
-void printComparisonTable(const DocumentStats& doc1, const DocumentStats& doc2, double similarity) {
-    cout << "\n COMPARISON RESULTS\n";
-    printSeparator('-', 80);
-    
-    cout << left << setw(25) << "Metric" 
-         << setw(25) << "Document A" 
-         << setw(25) << "Document B" << "\n";
-    printSeparator('-', 75);
-    
-    cout << left << setw(25) << " Filename:" 
-         << setw(25) << doc1.filename.substr(0, 22) 
-         << setw(25) << doc2.filename.substr(0, 22) << "\n";
-    
-    cout << left << setw(25) << " Word Count:" 
-         << setw(25) << doc1.wordCount 
-         << setw(25) << doc2.wordCount << "\n";
+// Page faults that had to wait for the disk (or the network file system)
+static uint64_t threadMajorFaults() {
+#ifdef __linux__
+    rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_majflt;
+#else
+    return 0;
+#endif
+}
+
+TraceScope::TraceScope(const char* name)
+    : name(name), start(traceNow()), cpuStart(threadCpuNow()), faultsStart(threadMajorFaults()),
+      allocationsStart(threadAllocations), allocatedBytesStart(threadAllocatedBytes) {}
+
+TraceScope::~TraceScope() {
+    int64_t end = traceNow();
+    TraceEvent event{name, start, end - start, threadCpuNow() - cpuStart, threadMajorFaults() - faultsStart, bytes, tokens,
+                     threadAllocations - allocationsStart, threadAllocatedBytes - allocatedBytesStart};
+    currentTraceThread().events.push_back(event);
+}
+
+TraceSession::TraceSession(vector<string>& args) {
+    for (size_t i = 0; i + 1 < args.size(); i++) {
+        if (args[i] == "--trace") {
+            tracePath = args[i + 1];
+            args.erase(args.begin() + i, args.begin() + i + 2);
+            break;
+        }
+    }
+    currentTraceThread();   // the main thread is thread 0
+}
+
+// Totals per stage name, in order of first appearance, on stderr; stages
+// nest, so a stage's time includes the stages it calls. Then the Chrome
+// trace-event file (load it in chrome://tracing or Perfetto).
+TraceSession::~TraceSession() {
+    struct Totals {
+        const char* name;
+        uint64_t calls = 0;
+        int64_t wall = 0;
+        int64_t cpu = 0;
+        uint64_t majorFaults = 0, bytes = 0, tokens = 0, allocations = 0, allocatedBytes = 0;
+        int64_t first = 0;
+    };
+    vector<Totals> totals;
+    unordered_map<string_view, size_t> index;
+    for (const auto& thread : traceThreads) {
+        for (const TraceEvent& event : thread->events) {
+            auto found = index.emplace(event.name, totals.size());
+            if (found.second) {
+                totals.emplace_back();
+                totals.back().name = event.name;
+                totals.back().first = event.start;
+            }
+            Totals& total = totals[found.first->second];
+            total.calls++;
+            total.wall += event.duration;
+            total.cpu += event.cpu;
+            total.majorFaults += event.majorFaults;
+            total.bytes += event.bytes;
+            total.tokens += event.tokens;
+            total.allocations += event.allocations;
+            total.allocatedBytes += event.allocatedBytes;
+            total.first = min(total.first, event.start);
+        }
+    }
+    sort(totals.begin(), totals.end(), [](const Totals& a, const Totals& b) { return a.first < b.first; });
     
-    cout << left << setw(25) << " Sentence Count:" 
-         << setw(25) << doc1.sentenceCount 
-         << setw(25) << doc2.sentenceCount << "\n";
+    cerr << "\n TRACE SUMMARY (" << fixed << setprecision(2) << traceNow() / 1e6 << " ms, " << traceThreads.size()
+         << " threads)\n";
+    cerr << left << setw(18) << "Stage" << setw(8) << "Calls" << setw(11) << "Wall ms" << setw(11) << "CPU ms" << setw(7)
+         << "CPU%" << setw(10) << "MB/s" << setw(11) << "Mtokens/s" << setw(10) << "Allocs" << "Major faults\n";
+    for (const Totals& total : totals) {
+        double wall = max(total.wall, int64_t(1)) / 1e9;
+        cerr << left << setw(18) << total.name << setw(8) << total.calls << setw(11) << total.wall / 1e6 << setw(11)
+             << total.cpu / 1e6 << setw(7) << setprecision(0) << 100.0 * total.cpu / max(total.wall, int64_t(1))
+             << setprecision(2) << setw(10);
+        if (total.bytes > 0) {
+            cerr << total.bytes / wall / 1e6;
+        } else {
+            cerr << "-";
+        }
+        cerr << setw(11);
+        if (total.tokens > 0) {
+            cerr << total.tokens / wall / 1e6;
+        } else {
+            cerr << "-";
+        }
+        cerr << setw(10) << total.allocations << total.majorFaults << "\n";
+    }
     
-    cout << left << setw(25) << "Unique Words:" 
-         << setw(25) << doc1.uniqueWords.size() 
-         << setw(25) << doc2.uniqueWords.size() << "\n";
+    if (tracePath.empty()) {
+        return;
+    }
+    ReportBuffer out;
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    bool first = true;
+    for (const auto& thread : traceThreads) {
+        out << (first ? "\n" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread->id
+            << ", \"args\": {\"name\": \"" << (thread->id == 0 ? "main" : "worker ") ;
+        if (thread->id != 0) {
+            out << thread->id;
+        }
+        out << "\"}}";
+        first = false;
+        for (const TraceEvent& event : thread->events) {
+            out << ",\n{\"name\": \"" << event.name << "\", \"cat\": \"textcmp\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                << thread->id << ", \"ts\": " << event.start / 1e3 << ", \"dur\": " << event.duration / 1e3
+                << ", \"args\": {\"cpuMs\": " << event.cpu / 1e6 << ", \"majorFaults\": " << event.majorFaults
+                << ", \"bytes\": " << event.bytes << ", \"tokens\": " << event.tokens << ", \"allocations\": "
+                << event.allocations << ", \"allocatedBytes\": " << event.allocatedBytes << "}}";
+        }
+    }
+    out << "\n]}\n";
+    if (out.save(tracePath)) {
+        cerr << " Trace saved to '" << tracePath << "'\n";
+    } else {
+        cerr << " Error: Cannot create " << tracePath << "\n";
+    }
+}
+#endif
+
+// splitmix64: the same corpus for a seed on every platform, unlike the
+// standard distributions
+class CorpusRandom {
+public:
+    explicit CorpusRandom(uint64_t seed) : state(seed) {}
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+    double uniform() { return (next() >> 11) * 0x1.0p-53; }
+
+private:
+    uint64_t state;
+};
+
+// Word of a vocabulary rank, spelled in consonant-vowel syllables so that
+// frequent (low) ranks get short words and every rank a distinct word
+string corpusWord(size_t rank) {
+    static const char consonants[] = "bcdfghjklmnprstvz";
+    static const char vowels[] = "aeiou";
+    const size_t syllables = (sizeof(consonants) - 1) * (sizeof(vowels) - 1);
+    string word;
+    size_t n = rank + 1;
+    while (n > 0) {
+        size_t syllable = (n - 1) % syllables;
+        word.push_back(consonants[syllable / (sizeof(vowels) - 1)]);
+        word.push_back(vowels[syllable % (sizeof(vowels) - 1)]);
+        n = (n - 1) / syllables;
+    }
+    return word;
+}
+
+string generateCorpus(const CorpusOptions& options) {
+    vector<string> words(max<size_t>(options.vocabulary, 1));
+    vector<double> cumulative(words.size());
+    double total = 0;
+    for (size_t r = 0; r < words.size(); r++) {
+        words[r] = corpusWord(r);
+        total += 1.0 / pow(double(r + 1), options.zipfExponent);
+        cumulative[r] = total;
+    }
     
-    cout << left << setw(25) << " Avg Sentence Length:" 
-         << setw(25) << fixed << setprecision(2) << doc1.avgSentenceLength 
-         << setw(25) << doc2.avgSentenceLength << "\n";
+    CorpusRandom random(options.seed);
+    size_t mean = max<size_t>(options.sentenceWords, 1);
+    auto sentenceLength = [&]() -> size_t {
+        switch (options.lengths) {
+        case LENGTHS_FIXED:
+            return mean;
+        case LENGTHS_UNIFORM:
+            return 1 + random.next() % (2 * mean - 1);
+        default:
+            // Geometric with the given mean: many short sentences, a long tail
+            return mean == 1 ? 1 : 1 + size_t(log(1.0 - random.uniform()) / log1p(-1.0 / mean));
+        }
+    };
     
-    cout << left << setw(25) << " Longest Sentence:" 
-         << setw(25) << doc1.longestSentenceWordCount 
-         << setw(25) << doc2.longestSentenceWordCount << "\n";
+    string text;
+    text.reserve(options.sizeBytes + 64);
+    size_t sentences = 0;
+    while (text.size() < options.sizeBytes) {
+        size_t length = sentenceLength();
+        for (size_t w = 0; w < length; w++) {
+            size_t rank = upper_bound(cumulative.begin(), cumulative.end(), random.uniform() * total) - cumulative.begin();
+            const string& word = words[min(rank, words.size() - 1)];
+            if (w == 0) {
+                text.push_back(char(toupper(word[0])));
+                text.append(word, 1, string::npos);
+            } else {
+                text.push_back(' ');
+                text.append(word);
+            }
+            if (w + 1 < length && random.next() % 12 == 0) {
+                text.push_back(',');
+            }
+        }
+        uint64_t end = random.next() % 20;
+        text.push_back(end == 0 ? '?' : end == 1 ? '!' : '.');
+        text.push_back(++sentences % 6 == 0 ? '\n' : ' ');
+    }
+    return text;
+}
+
+// Writes output to nowhere, for timing the replacement without the file
+class DiscardBuffer : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char*, streamsize n) override { return n; }
+};
+
+static volatile size_t benchSink;
+
+// Shortest timed run; faster stages call body several times per run
+constexpr double kMinBenchRunSeconds = 0.05;
+
+// One warm-up call, then repeat timed runs of body. Times, bytes, tokens and
+// allocations are per call of body.
+template <typename Body>
+BenchResult runBenchStage(const string& stage, size_t repeat, uint64_t bytes, uint64_t tokens, Body&& body) {
+    auto warmUp = chrono::steady_clock::now();
+    benchSink = benchSink + body();
+    double once = chrono::duration<double>(chrono::steady_clock::now() - warmUp).count();
+    size_t calls = max<size_t>(1, size_t(kMinBenchRunSeconds / max(once, 1e-9)));
     
-    printSeparator('-', 75);
+    BenchResult result{stage, {}, bytes, tokens, 0, 0};
+    result.seconds.reserve(repeat);
+    uint64_t allocations = allocationsSoFar();
+    uint64_t allocatedBytes = allocatedBytesSoFar();
+    for (size_t run = 0; run < repeat; run++) {
+        auto start = chrono::steady_clock::now();
+        for (size_t call = 0; call < calls; call++) {
+            benchSink = benchSink + body();
+            asm volatile("" ::: "memory");  // keeps each call inside the loop
+        }
+        result.seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count() / calls);
+    }
+    result.allocations = (allocationsSoFar() - allocations) / (repeat * calls);
+    result.allocatedBytes = (allocatedBytesSoFar() - allocatedBytes) / (repeat * calls);
+    sort(result.seconds.begin(), result.seconds.end());
+    return result;
+}
+
+static double benchPercentile(const BenchResult& result, double percentile) {
+    size_t rank = size_t(ceil(percentile / 100.0 * result.seconds.size()));
+    return result.seconds[min(result.seconds.size(), max<size_t>(rank, 1)) - 1];
+}
+
+vector<BenchResult> runBenchmarks(const BenchOptions& options) {
+    string text = generateCorpus(options.corpus);
+    CorpusOptions otherOptions = options.corpus;
+    otherOptions.seed++;
+    string otherText = generateCorpus(otherOptions);
+    DocumentStats doc = analyzeText("corpus-a", text);
+    DocumentStats other = analyzeText("corpus-b", otherText);
+    uint64_t words = doc.wordCount;
+    size_t repeat = max<size_t>(options.repeat, 1);
+    vector<BenchResult> results;
     
-    cout << "\n SIMILARITY ANALYSIS\n";
-    printSeparator('-', 30);
-    cout << " Jaccard Similarity: " << fixed << setprecision(2) << similarity << "%\n";
+    results.push_back(runBenchStage("tokenize", repeat, text.size(), words, [&] {
+        return tokenize(text).size();
+    }));
+    results.push_back(runBenchStage("analyze", repeat, text.size(), words, [&] {
+        return size_t(analyzeText("corpus-a", text).wordCount);
+    }));
+    WordNormalization normalization = sharedNormalization();
+    sharedNormalization() = WordNormalization{true, true};
+    results.push_back(runBenchStage("analyze-stem", repeat, text.size(), words, [&] {
+        return size_t(analyzeText("corpus-a", text).wordCount);
+    }));
+    sharedNormalization() = normalization;
     
-    set<string> commonWords = findCommonWords(doc1.uniqueWords, doc2.uniqueWords);
-    cout << " Common Words: " << commonWords.size() << "\n";
+    // Looks up every vocabulary word and a third as many missing ones
+    vector<string> lookupWords;
+    for (size_t r = 0; r < options.corpus.vocabulary + options.corpus.vocabulary / 3 + 1; r++) {
+        lookupWords.push_back(corpusWord(r));
+    }
+    results.push_back(runBenchStage("word-frequency", repeat, 0, lookupWords.size(), [&] {
+        size_t found = 0;
+        for (const string& word : lookupWords) {
+            found += getWordFrequency(doc, word);
+        }
+        return found;
+    }));
     
-    cout << "\n TOP 5 FREQUENT WORDS\n";
-    printSeparator('-', 50);
+    results.push_back(runBenchStage("jaccard", repeat, 0, doc.uniqueWords.size() + other.uniqueWords.size(), [&] {
+        return size_t(jaccardSimilarity(doc.uniqueWords, other.uniqueWords));
+    }));
+    results.push_back(runBenchStage("longest-sentence", repeat, 0, words, [&] {
+        return size_t(findLongestSentence(doc.sentences, text).second);
+    }));
     
-    cout << left << setw(15) << "Document A" << setw(15) << "Document B" << "\n";
-    printSeparator('-', 30);
+    // Replaces a frequent, a middling and a rare word
+    vector<pair<string, string>> replacements;
+    for (size_t rank : {size_t(2), options.corpus.vocabulary / 100, options.corpus.vocabulary / 2}) {
+        replacements.emplace_back(corpusWord(rank), "replacement" + to_string(replacements.size()));
+    }
+    ReplacementEngine engine(replacements);
+    DiscardBuffer discard;
+    ostream nowhere(&discard);
+    vector<size_t> counts;
+    results.push_back(runBenchStage("replace", repeat, text.size(), words, [&] {
+        return engine.rewrite(text, nowhere, counts, nullptr);
+    }));
     
-    for (int i = 0; i < 5; i++) {
-        string word1 = (i < doc1.topWords.size()) ? 
-                       doc1.topWords[i].first + "(" + to_string(doc1.topWords[i].second) + ")" : "-";
-        string word2 = (i < doc2.topWords.size()) ? 
-                       doc2.topWords[i].first + "(" + to_string(doc2.topWords[i].second) + ")" : "-";
-        
-        cout << left << setw(15) << word1 << setw(15) << word2 << "\n";
+    // Top 10 of the first corpus cut into 16 KiB documents, for passages of
+    // the second one
+    vector<DocumentStats> pieces;
+    for (size_t begin = 0; begin < text.size();) {
+        size_t end = min(text.size(), begin + (16 << 10));
+        end = end < text.size() ? text.find(' ', end) : end;
+        end = end == string::npos ? text.size() : end;
+        pieces.push_back(analyzeText("piece-" + to_string(pieces.size()), string_view(text).substr(begin, end - begin)));
+        begin = end;
+    }
+    InvertedIndex index(pieces, METRIC_TFIDF_COSINE);
+    pieces.clear();
+    vector<DocumentStats> queries;
+    for (size_t q = 0; q < 64; q++) {
+        queries.push_back(queryTerms(string_view(otherText).substr(otherText.size() / 64 * q, 400)));
     }
+    results.push_back(runBenchStage("index-query", repeat, 0, queries.size(), [&] {
+        size_t hits = 0;
+        for (const DocumentStats& query : queries) {
+            hits += index.topK(query, 10).size();
+        }
+        return hits;
+    }));
+    return results;
 }
 
-void writeReportToFile(const DocumentStats& doc1, const DocumentStats& doc2, double similarity, const set<string>& commonWords) {
-    ofstream report("result.txt");
-    if (!report.is_open()) {
-        cout << " Error: Cannot create result.txt\n";
-        return;
+static const char* sentenceLengthsName(SentenceLengths lengths) {
+    return lengths == LENGTHS_FIXED ? "fixed" : lengths == LENGTHS_UNIFORM ? "uniform" : "geometric";
+}
+
+bool writeBenchBaseline(const vector<BenchResult>& results, const BenchOptions& options) {
+    const CorpusOptions& corpus = options.corpus;
+    ReportBuffer out;
+    out << "{\n  \"corpus\": {\"bytes\": " << corpus.sizeBytes << ", \"vocabulary\": " << corpus.vocabulary
+        << ", \"zipf\": " << corpus.zipfExponent << ", \"sentenceWords\": " << corpus.sentenceWords
+        << ", \"lengths\": \"" << sentenceLengthsName(corpus.lengths) << "\", \"seed\": " << corpus.seed << "},\n";
+    out << "  \"repeat\": " << options.repeat << ",\n  \"allocationsCounted\": " << (kCountAllocations ? "true" : "false")
+        << ",\n  \"stages\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& result = results[i];
+        double median = benchPercentile(result, 50);
+        out << (i > 0 ? ",\n" : "\n") << "    {\"stage\": \"" << result.stage << "\", \"medianUs\": " << median * 1e6
+            << ", \"p90Us\": " << benchPercentile(result, 90) * 1e6 << ", \"mbPerSecond\": " << result.bytes / median / 1e6
+            << ", \"tokensPerSecond\": " << result.tokens / median << ", \"allocations\": " << result.allocations
+            << ", \"allocatedBytes\": " << result.allocatedBytes << "}";
     }
-    
-    report << "TEXT COMPARATOR - DETAILED ANALYSIS REPORT\n";
-    report << "==========================================\n\n";
-    
-    report << "DOCUMENT ANALYSIS\n";
-    report << "-----------------\n\n";
-    
-    // Document A Analysis
-    report << "Document A: " << doc1.filename << "\n";
-    report << "- Word Count: " << doc1.wordCount << "\n";
-    report << "- Sentence Count: " << doc1.sentenceCount << "\n";
-    report << "- Unique Words: " << doc1.uniqueWords.size() << "\n";
-    report << "- Average Sentence Length: " << fixed << setprecision(2) << doc1.avgSentenceLength << " words\n";
-    report << "- Longest Sentence: " << doc1.longestSentenceWordCount << " words\n";
-    report << "- Top 5 Words: ";
-    for (int i = 0; i < min(5, (int)doc1.topWords.size()); i++) {
-        report << doc1.topWords[i].first << "(" << doc1.topWords[i].second << ")";
-        if (i < min(4, (int)doc1.topWords.size() - 1)) report << ", ";
-    }
-    report << "\n\n";
-    
-    // Document B Analysis
-    report << "Document B: " << doc2.filename << "\n";
-    report << "- Word Count: " << doc2.wordCount << "\n";
-    report << "- Sentence Count: " << doc2.sentenceCount << "\n";
-    report << "- Unique Words: " << doc2.uniqueWords.size() << "\n";
-    report << "- Average Sentence Length: " << fixed << setprecision(2) << doc2.avgSentenceLength << " words\n";
-    report << "- Longest Sentence: " << doc2.longestSentenceWordCount << " words\n";
-    report << "- Top 5 Words: ";
-    for (int i = 0; i < min(5, (int)doc2.topWords.size()); i++) {
-        report << doc2.topWords[i].first << "(" << doc2.topWords[i].second << ")";
-        if (i < min(4, (int)doc2.topWords.size() - 1)) report << ", ";
-    }
-    report << "\n\n";
-    
-    // Comparison Analysis
-    report << "COMPARISON ANALYSIS\n";
-    report << "-------------------\n\n";
-    report << "Jaccard Similarity: " << fixed << setprecision(2) << similarity << "%\n";
-    report << "Common Words Count: " << commonWords.size() << "\n\n";
-    
-    report << "Common Words: ";
-    int count = 0;
-    for (const string& word : commonWords) {
-        if (count > 0) report << ", ";
-        report << word;
-        count++;
-        if (count >= 20) {
-            report << "... (and " << (commonWords.size() - 20) << " more)";
-            break;
-        }
+    out << "\n  ]\n}\n";
+    if (!out.save(options.savePath)) {
+        cout << " Error: Cannot create " << options.savePath << "\n";
+        return false;
     }
-    report << "\n\n";
-     
-    report << "LONGEST SENTENCES\n";
-    report << "-----------------\n\n";
-    report << "Document A longest sentence (" << doc1.longestSentenceWordCount << " words):\n";
-    report << doc1.longestSentence << "\n\n";
-    report << "Document B longest sentence (" << doc2.longestSentenceWordCount << " words):\n";
-    report << doc2.longestSentence << "\n\n";
-    
-    report << "End of Report\n";
-    report.close();
+    cout << " Baseline saved to '" << options.savePath << "'\n";
+    return true;
 }
 
-// WORD REPLACEMENT FUNCTIONALITY
+// Number after "key": that follows from in a baseline file, or -1
+static double baselineValue(const string& baseline, size_t from, const string& key) {
+    size_t at = baseline.find("\"" + key + "\": ", from);
+    if (at == string::npos) {
+        return -1;
+    }
+    return strtod(baseline.c_str() + at + key.size() + 4, nullptr);
+}
 
-void performWordReplacement(const string& originalFile1, const string& originalFile2) {
-    char choice;
-    cout << "\n WORD REPLACEMENT FEATURE\n";
-    printSeparator('-', 40);
-    cout << "Would you like to replace any word in the documents? (y/n): ";
-    cin >> choice;
-    cin.ignore(); // Clear the input buffer
+// A stage fails when its median time, or its allocation count when both runs
+// counted them, grew by more than the tolerance
+bool compareBenchBaseline(const vector<BenchResult>& results, const BenchOptions& options) {
+    ifstream file(options.baselinePath);
+    if (!file.is_open()) {
+        cout << " Error: Cannot open baseline '" << options.baselinePath << "'\n";
+        return false;
+    }
+    string baseline((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    // The Zipf exponent is stored with two decimals, like every report number
+    const CorpusOptions& corpus = options.corpus;
+    if (baselineValue(baseline, 0, "bytes") != double(corpus.sizeBytes) ||
+        baselineValue(baseline, 0, "vocabulary") != double(corpus.vocabulary) ||
+        fabs(baselineValue(baseline, 0, "zipf") - corpus.zipfExponent) > 0.005 ||
+        baselineValue(baseline, 0, "sentenceWords") != double(corpus.sentenceWords) ||
+        baselineValue(baseline, 0, "seed") != double(corpus.seed) ||
+        baseline.find("\"lengths\": \"" + string(sentenceLengthsName(corpus.lengths)) + "\"") == string::npos) {
+        cout << " Error: Baseline '" << options.baselinePath << "' was measured on a different corpus\n";
+        return false;
+    }
+    bool countedBoth = kCountAllocations && baseline.find("\"allocationsCounted\": true") != string::npos;
+    double limit = 1 + options.tolerance / 100;
     
-    if (choice == 'y' || choice == 'Y') {
-        cout << "\n REPLACEMENT OPTIONS:\n";
-        cout << "1. Replace word in both documents\n";
-        cout << "2. Replace word in first document only (" << originalFile1 << ")\n";
-        cout << "3. Replace word in second document only (" << originalFile2 << ")\n";
-        cout << "\n Select option (1/2/3): ";
-        
-        int option;
-        cin >> option;
-        cin.ignore();
-        
-        string oldWord, newWord;
-        cout << "\n Enter the word you want to replace: ";
-        getline(cin, oldWord);
-        cout << " Enter the replacement word: ";
-        getline(cin, newWord);
-        
-        vector<string> filesToProcess;
-        vector<string> updatedFiles;
-        bool filesUpdated = false;
-        
-        // Determine which files to process
-        switch(option) {
-            case 1:
-                filesToProcess.push_back(originalFile1);
-                filesToProcess.push_back(originalFile2);
-                break;
-            case 2:
-                filesToProcess.push_back(originalFile1);
-                break;
-            case 3:
-                filesToProcess.push_back(originalFile2);
-                break;
-            default:
-                cout << " Invalid option selected.\n";
-                return;
+    cout << "\n BASELINE " << options.baselinePath << " (tolerance " << options.tolerance << "%)\n";
+    printSeparator('-', 80);
+    cout << left << setw(18) << "Stage" << setw(14) << "Baseline us" << setw(14) << "Now us" << setw(10) << "Change" << "Status\n";
+    bool passed = true;
+    for (const BenchResult& result : results) {
+        size_t at = baseline.find("\"stage\": \"" + result.stage + "\"");
+        if (at == string::npos) {
+            cout << left << setw(56) << result.stage << "new stage\n";
+            continue;
         }
-        
-        cout << "\n Processing files: \n";
-        printSeparator('-', 30);
-        
-        // Process each selected file
-        for (const string& filename : filesToProcess) {
-            cout << "\n Processing: " << filename << "\n";
-            
-            // Load the file content
-            string content = loadFile(filename);
-            if (content.empty()) {
-                cout << "Error: Could not load " << filename << " for replacement.\n";
-                continue;
-            }
-            
-            // Count occurrences before replacement
-            int occurrences = countWordOccurrences(content, oldWord);
-            if (occurrences == 0) {
-                cout << " Word '" << oldWord << "' not found in " << filename << ".\n";
-                continue;
-            }
-            
-            cout << " Found " << occurrences << " occurrence(s) of '" << oldWord << "'\n";
-            
-            // Perform replacement
-            string updatedContent = replaceWordInText(content, oldWord, newWord);
-            
-            // Create new filename
-            string newFilename;
-            size_t dotPos = filename.find_last_of('.');
-            if (dotPos != string::npos) {
-                newFilename = filename.substr(0, dotPos) + "_updated" + filename.substr(dotPos);
-            } else {
-                newFilename = filename + "_updated.txt";
-            }
-            
-            // Write updated content to new file
-            ofstream outputFile(newFilename);
-            if (!outputFile.is_open()) {
-                cout << " Error: Could not create output file " << newFilename << ".\n";
-                continue;
-            }
-            
-            outputFile << updatedContent;
-            outputFile.close();
-            
-            cout << " SUCCESS!\n";
-            cout << " Original file: " << filename << "\n";
-            cout << " Updated file: " << newFilename << "\n";
-            cout << " Replaced " << occurrences << " occurrence(s) of '" << oldWord << "' with '" << newWord << "'\n";
-            
-            updatedFiles.push_back(newFilename);
-            filesUpdated = true;
+        double before = baselineValue(baseline, at, "medianUs");
+        double now = benchPercentile(result, 50) * 1e6;
+        double allocationsBefore = baselineValue(baseline, at, "allocations");
+        bool slower = before > 0 && now > before * limit;
+        bool moreAllocations = countedBoth && result.allocations > allocationsBefore * limit;
+        passed = passed && !slower && !moreAllocations;
+        ostringstream change;
+        change << showpos << fixed << setprecision(1) << (before > 0 ? (now / before - 1) * 100 : 0.0) << "%";
+        cout << left << setw(18) << result.stage << setw(14) << fixed << setprecision(2) << before << setw(14) << now
+             << setw(10) << change.str()
+             << (slower ? "SLOWER" : moreAllocations ? "MORE ALLOCATIONS" : "ok") << "\n";
+    }
+    cout << (passed ? " No regressions\n" : " Error: Benchmarks regressed against the baseline\n");
+    return passed;
+}
+
+static bool parseCorpusOption(const string& arg, const string& value, CorpusOptions& corpus, bool& known) {
+    known = true;
+    if (arg == "--size-mb") {
+        double megabytes = 0;
+        if (!parseNumber(arg, value, megabytes)) {
+            return false;
         }
-        
-        // Generate new report if files were updated
-        if (filesUpdated && !updatedFiles.empty()) {
-            cout << "\n GENERATING UPDATED ANALYSIS REPORT...\n";
-            printSeparator('-', 40);
-            
-            string file1ForReport, file2ForReport;
-            
-            if (option == 1 && updatedFiles.size() == 2) {
-                // Both files updated
-                file1ForReport = updatedFiles[0];
-                file2ForReport = updatedFiles[1];
-            } else if (option == 2) {
-                // Only first file updated
-                file1ForReport = updatedFiles[0];
-                file2ForReport = originalFile2;
-            } else if (option == 3) {
-                // Only second file updated
-                file1ForReport = originalFile1;
-                file2ForReport = updatedFiles[0];
-            }
-            
-            generateUpdatedReport(file1ForReport, file2ForReport, oldWord, newWord);
+        if (megabytes < 0 || megabytes >= double(numeric_limits<size_t>::max() >> 20)) {
+            cout << " Error: " << arg << " is out of range: " << value << "\n";
+            return false;
         }
-        
-        // Ask if user wants to replace more words
-        cout << "\nWould you like to replace another word? (y/n): ";
-        cin >> choice;
-        cin.ignore();
-        
-        if (choice == 'y' || choice == 'Y') {
-            performWordReplacement(originalFile1, originalFile2);
+        corpus.sizeBytes = size_t(megabytes * (1 << 20));
+    } else if (arg == "--vocabulary") {
+        if (!parseCount(arg, value, corpus.vocabulary)) {
+            return false;
+        }
+        corpus.vocabulary = max<size_t>(corpus.vocabulary, 1);
+    } else if (arg == "--zipf") {
+        return parseNumber(arg, value, corpus.zipfExponent);
+    } else if (arg == "--sentence-words") {
+        if (!parseCount(arg, value, corpus.sentenceWords)) {
+            return false;
+        }
+        corpus.sentenceWords = max<size_t>(corpus.sentenceWords, 1);
+    } else if (arg == "--seed") {
+        return parseCount(arg, value, corpus.seed);
+    } else if (arg == "--lengths") {
+        if (value == "fixed") {
+            corpus.lengths = LENGTHS_FIXED;
+        } else if (value == "uniform") {
+            corpus.lengths = LENGTHS_UNIFORM;
+        } else if (value == "geometric") {
+            corpus.lengths = LENGTHS_GEOMETRIC;
+        } else {
+            cout << " Error: Unknown sentence lengths '" << value << "' (fixed, uniform or geometric)\n";
+            return false;
         }
     } else {
-        cout << " No word replacement requested.\n";
+        known = false;
     }
+    return true;
 }
 
-string replaceWordInText(const string& text, const string& oldWord, const string& newWord) {
-    string result = text;
-    string oldWordLower = oldWord;
-    transform(oldWordLower.begin(), oldWordLower.end(), oldWordLower.begin(), ::tolower);
-    
-    // Convert to lowercase for case-insensitive matching
-    string textLower = text;
-    transform(textLower.begin(), textLower.end(), textLower.begin(), ::tolower);
-    
-    size_t pos = 0;
-    while ((pos = textLower.find(oldWordLower, pos)) != string::npos) {
-        // Check if it's a whole word (not part of another word)
-        bool isWholeWord = true;
-        
-        // Check character before
-        if (pos > 0 && isalnum(textLower[pos - 1])) {
-            isWholeWord = false;
+// args[0] is "bench"
+int runBenchMode(const vector<string>& args) {
+    BenchOptions options;
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (i + 1 >= args.size()) {
+            cout << " Error: Missing value for " << arg << "\n";
+            return 1;
         }
-        
-        // Check character after
-        if (pos + oldWordLower.length() < textLower.length() && 
-            isalnum(textLower[pos + oldWordLower.length()])) {
-            isWholeWord = false;
+        const string& value = args[++i];
+        bool known;
+        if (!parseCorpusOption(arg, value, options.corpus, known)) {
+            return 1;
         }
-        
-        if (isWholeWord) {
-            // Replace in the original text (preserving original case)
-            result.replace(pos, oldWord.length(), newWord);
-            textLower.replace(pos, oldWordLower.length(), newWord);
-            pos += newWord.length();
+        if (known) {
+            continue;
+        }
+        if (arg == "--repeat") {
+            if (!parseCount(arg, value, options.repeat)) {
+                return 1;
+            }
+            options.repeat = max<size_t>(options.repeat, 1);
+        } else if (arg == "--baseline") {
+            options.baselinePath = value;
+        } else if (arg == "--save-baseline") {
+            options.savePath = value;
+        } else if (arg == "--tolerance") {
+            if (!parseNumber(arg, value, options.tolerance)) {
+                return 1;
+            }
         } else {
-            pos += oldWordLower.length();
+            cout << " Error: Unknown option " << arg << "\n";
+            printUsage();
+            return 1;
         }
     }
     
-    return result;
+    const CorpusOptions& corpus = options.corpus;
+    cout << "\n BENCHMARKS (" << fixed << setprecision(1) << corpus.sizeBytes / double(1 << 20) << " MiB corpus, "
+         << corpus.vocabulary << " words, zipf " << setprecision(2) << corpus.zipfExponent << ", "
+         << sentenceLengthsName(corpus.lengths) << " sentences of " << corpus.sentenceWords << " words, seed "
+         << corpus.seed << ", " << options.repeat << " runs)\n";
+    printSeparator('-', 80);
+    vector<BenchResult> results = runBenchmarks(options);
+    cout << left << setw(18) << "Stage" << setw(12) << "Median us" << setw(12) << "p90 us" << setw(10) << "MB/s"
+         << setw(11) << "Mtokens/s" << setw(11) << "Allocs" << "MB allocated\n";
+    for (const BenchResult& result : results) {
+        double median = benchPercentile(result, 50);
+        cout << left << setw(18) << result.stage << fixed << setprecision(2) << setw(12) << median * 1e6
+             << setw(12) << benchPercentile(result, 90) * 1e6;
+        if (result.bytes > 0) {
+            cout << setw(10) << result.bytes / median / 1e6;
+        } else {
+            cout << setw(10) << "-";
+        }
+        cout << setw(11) << result.tokens / median / 1e6;
+        if (kCountAllocations) {
+            cout << setw(11) << result.allocations << result.allocatedBytes / 1e6 << "\n";
+        } else {
+            cout << setw(11) << "-" << "-\n";
+        }
+    }
+    if (!kCountAllocations) {
+        cout << " (allocations are counted in builds with -DTEXTCMP_COUNT_ALLOCATIONS, as made by 'make bench')\n";
+    }
+    
+    bool passed = true;
+    if (!options.baselinePath.empty()) {
+        passed = compareBenchBaseline(results, options);
+    }
+    if (!options.savePath.empty() && !writeBenchBaseline(results, options)) {
+        return 1;
+    }
+    return passed ? 0 : 1;
 }
 
-int countWordOccurrences(const string& text, const string& word) {
-    int count = 0;
-    string wordLower = word;
-    transform(wordLower.begin(), wordLower.end(), wordLower.begin(), ::tolower);
-    
-    string textLower = text;
-    transform(textLower.begin(), textLower.end(), textLower.begin(), ::tolower);
-    
-    size_t pos = 0;
-    while ((pos = textLower.find(wordLower, pos)) != string::npos) {
-        // Check if it's a whole word
-        bool isWholeWord = true;
-        
-        if (pos > 0 && isalnum(textLower[pos - 1])) {
-            isWholeWord = false;
+// args[0] is "generate" and args[1] the output file ("-" for stdout)
+int runGenerateMode(const vector<string>& args) {
+    if (args.size() < 2) {
+        printUsage();
+        return 1;
+    }
+    CorpusOptions corpus;
+    for (size_t i = 2; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (i + 1 >= args.size()) {
+            cout << " Error: Missing value for " << arg << "\n";
+            return 1;
         }
-        
-        if (pos + wordLower.length() < textLower.length() && 
-            isalnum(textLower[pos + wordLower.length()])) {
-            isWholeWord = false;
+        bool known;
+        if (!parseCorpusOption(arg, args[++i], corpus, known)) {
+            return 1;
         }
-        
-        if (isWholeWord) {
-            count++;
+        if (!known) {
+            cout << " Error: Unknown option " << arg << "\n";
+            printUsage();
+            return 1;
         }
-        pos += wordLower.length();
     }
-    
-    return count;
+    ReportBuffer out;
+    out << generateCorpus(corpus);
+    if (!out.save(args[1])) {
+        cout << " Error: Cannot create " << args[1] << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+void printUsage() {
+    cout << "Usage:\n"
+         << "  text_comparator [--verify-updates]          interactive comparison of two documents\n"
+         << "  text_comparator analyze <file>...           statistics of each document\n"
+         << "  text_comparator compare <file1> <file2>     comparison table, common words and report\n"
+         << "  text_comparator report <file1> <file2>      detailed report only\n"
+         << "  text_comparator replace <file1> <file2> --words <old,...> --with <new,...>\n"
+         << "  text_comparator passages <file1> <file2>    passages copied between the documents, with byte offsets\n"
+         << "  text_comparator diff <file1> <file2>        word or sentence differences (unified or side by side)\n"
+         << "  text_comparator batch <dir|manifest> [options]\n"
+         << "  text_comparator jobs <jobfile|->            run one command per line, keeping documents in memory\n"
+         << "  text_comparator serve <dir|manifest> [options] answer top-k similarity queries against an indexed corpus\n"
+         << "  text_comparator bench [options]             time each analysis stage on a synthetic corpus\n"
+         << "  text_comparator generate <file|-> [options] write a synthetic corpus\n"
+         << "\nDocument options:\n"
+         << "  --output <file>    report file (default result.<ext>, result_updated.<ext> for replace; '-' for stdout)\n"
+         << "  --format <f>       report format: 'text' (default), 'json' or 'csv'\n"
+         << "  --no-report        compare without writing the report file\n"
+         << "  --in <target>      replace in 'both' documents (default), 'first' or 'second' only\n"
+         << "  --verify           check incremental updates after replace against a full analysis\n"
+         << "  --metric <names>   extra similarity metrics for compare and report, comma-separated or 'all':\n"
+         << "                     weighted-jaccard, cosine, tfidf, containment, overlap (jaccard is always shown)\n"
+         << "\nDiff options:\n"
+         << "  --by <unit>        'word' (default) or 'sentence'\n"
+         << "  --format <f>       'unified' (default) or 'side-by-side'\n"
+         << "  --context <n>      equal tokens shown around each change (default 3)\n"
+         << "\nPassage options:\n"
+         << "  --shingle <k>      words per shingle (default 5)\n"
+         << "  --window <w>       winnowing window in shingles (default 4); passages of k + w - 1 words are always found\n"
+         << "  --limit <n>        passages to list (default 20)\n"
+         << "\nNormalization options (analyze, compare, report, replace, batch, serve):\n"
+         << "  --stop-words       leave common English words ('the', 'is', ...) out of the vocabulary\n"
+         << "  --stem             count words by their Porter stem ('connected', 'connection' -> 'connect')\n"
+         << "\nStreaming options (analyze, compare, report, batch):\n"
+         << "  --stream           read documents in chunks with bounded memory instead of loading them\n"
+         << "  --chunk-mb <n>     chunk size in MiB (default 16)\n"
+         << "  --max-vocabulary <n>  count at most n distinct words exactly, sketch the rest\n"
+         << "\nBatch options:\n"
+         << "  --output <file>    matrix file (default similarity_matrix.tsv, .csv or .json)\n"
+         << "  --format <f>       'text' (tab-separated, default), 'csv' or 'json'\n"
+         << "  --top-k <k>        write the k most similar documents per row instead of the dense matrix\n"
+         << "  --threads <n>      worker threads (default: all hardware threads)\n"
+         << "  --tile <n>         documents per cache tile (default 64)\n"
+         << "  --lsh <percent>    only report pairs whose similarity reaches percent, found with MinHash/LSH\n"
+         << "  --exact            with --lsh, re-check candidates with the exact Jaccard similarity\n"
+         << "  --metric <name>    similarity metric of the matrix (default jaccard; IDF comes from the whole corpus)\n"
+         << "  --cache-dir <dir>  where analyzed documents are cached (default .text_comparator_cache)\n"
+         << "  --no-cache         analyze every document from scratch and write no cache entries\n"
+         << "\nServe options:\n"
+         << "  --socket <path>    listen on a Unix domain socket instead of answering stdin on stdout\n"
+         << "  --top-k <k>        documents per query (default 10; 'top <k>' changes it per connection)\n"
+         << "  --metric <name>    'tfidf' (default) or 'cosine'\n"
+         << "  --threads, --cache-dir, --no-cache, --stop-words, --stem  as for batch\n"
+         << "\nCorpus options (bench, generate):\n"
+         << "  --size-mb <n>      corpus size in MiB (default 16)\n"
+         << "  --vocabulary <n>   distinct words (default 50000)\n"
+         << "  --zipf <s>         Zipf exponent of the word frequencies (default 1.0)\n"
+         << "  --sentence-words <n>  mean sentence length (default 15)\n"
+         << "  --lengths <d>      sentence length distribution: 'geometric' (default), 'uniform' or 'fixed'\n"
+         << "  --seed <n>         generator seed (default 1); the same seed gives the same corpus\n"
+         << "\nBench options:\n"
+         << "  --repeat <n>       timed runs per stage (default 5)\n"
+         << "  --baseline <file>  fail when a stage is slower, or allocates more, than in this baseline\n"
+         << "  --save-baseline <file>  write the results as a baseline\n"
+         << "  --tolerance <pct>  allowed slowdown against the baseline (default 10)\n";
 }
-map<string, pair<int, int>> getCommonWordsWithCounts(const DocumentStats& doc1, const DocumentStats& doc2) {
-    map<string, pair<int, int>> commonWords;
+
+// args[0] is "batch" (or "--batch") and args[1] the source
+int runBatchMode(const vector<string>& args) {
+    BatchOptions options;
+    if (args.size() < 2) {
+        printUsage();
+        return 1;
+    }
+    options.source = args[1];
     
-    for (const auto& word1 : doc1.wordFrequency) {
-        auto it = doc2.wordFrequency.find(word1.first);
-        if (it != doc2.wordFrequency.end()) {
-            commonWords[word1.first] = make_pair(word1.second, it->second);
+    for (size_t i = 2; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (arg == "--exact") {
+            options.exactCheck = true;
+            continue;
+        }
+        if (arg == "--no-cache") {
+            options.useCache = false;
+            continue;
+        }
+        if (arg == "--stream") {
+            options.stream.enabled = true;
+            continue;
+        }
+        if (arg == "--stop-words") {
+            sharedNormalization().stopWords = true;
+            continue;
+        }
+        if (arg == "--stem") {
+            sharedNormalization().stem = true;
+            continue;
+        }
+        if (i + 1 >= args.size()) {
+            cout << " Error: Missing value for " << arg << "\n";
+            return 1;
+        }
+        const string& value = args[++i];
+        if (arg == "--output") {
+            options.outputPath = value;
+        } else if (arg == "--top-k") {
+            if (!parseCount(arg, value, options.topK)) {
+                return 1;
+            }
+        } else if (arg == "--threads") {
+            if (!parseCount(arg, value, options.threads)) {
+                return 1;
+            }
+        } else if (arg == "--tile") {
+            if (!parseCount(arg, value, options.tileSize)) {
+                return 1;
+            }
+        } else if (arg == "--lsh") {
+            if (!parseNumber(arg, value, options.lshThreshold)) {
+                return 1;
+            }
+        } else if (arg == "--cache-dir") {
+            options.cacheDirectory = value;
+        } else if (arg == "--metric") {
+            vector<SimilarityMetric> metrics;
+            if (!parseSimilarityMetrics(value, metrics) || metrics.size() != 1) {
+                cout << " Error: batch takes exactly one --metric\n";
+                return 1;
+            }
+            options.metric = metrics[0];
+        } else if (arg == "--format") {
+            if (!parseReportFormat(value, options.format)) {
+                return 1;
+            }
+        } else if (arg == "--chunk-mb") {
+            if (!parseMegabytes(arg, value, options.stream.chunkSize)) {
+                return 1;
+            }
+        } else if (arg == "--max-vocabulary") {
+            if (!parseCount(arg, value, options.stream.maxVocabulary)) {
+                return 1;
+            }
+        } else {
+            cout << " Error: Unknown option " << arg << "\n";
+            printUsage();
+            return 1;
         }
     }
     
-    return commonWords;
-}
-void printCommonWordsAnalysis(const DocumentStats& doc1, const DocumentStats& doc2) {
-    cout << "\n COMMON WORDS DETAILED ANALYSIS\n";
-    printSeparator('=', 70);
-    
-    auto commonWords = getCommonWordsWithCounts(doc1, doc2);
-    
-    if (commonWords.empty()) {
-        cout << " No common words found between the documents.\n";
-        return;
+    if (options.outputPath.empty()) {
+        options.outputPath = options.format == REPORT_TEXT ? "similarity_matrix.tsv" : defaultReportPath("similarity_matrix", options.format);
     }
-    // Sort by total frequency (sum of both documents)
-    vector<pair<string, pair<int, int>>> sortedCommon(commonWords.begin(), commonWords.end());
-    sort(sortedCommon.begin(), sortedCommon.end(), 
-         [](const auto& a, const auto& b) {
-             return (a.second.first + a.second.second) > (b.second.first + b.second.second);
-         });
-    
-    cout << left << setw(15) << "Word" 
-         << setw(12) << "Doc A Count" 
-         << setw(12) << "Doc B Count"
-         << setw(15) << "Total Uses"
-         << setw(15) << "Frequency %" << "\n";
-    printSeparator('-', 70);
-    
-    int totalWordsDoc1 = doc1.wordCount;
-    int totalWordsDoc2 = doc2.wordCount;
-    
-    for (size_t i = 0; i < min(size_t(15), sortedCommon.size()); i++) {
-        const string& word = sortedCommon[i].first;
-        int count1 = sortedCommon[i].second.first;
-        int count2 = sortedCommon[i].second.second;
-        int totalUses = count1 + count2;
-        
-        double freq1 = (static_cast<double>(count1) / totalWordsDoc1) * 100;
-        double freq2 = (static_cast<double>(count2) / totalWordsDoc2) * 100;
-        double avgFreq = (freq1 + freq2) / 2;
-        
-        cout << left << setw(15) << word
-             << setw(12) << count1
-             << setw(12) << count2
-             << setw(15) << totalUses
-             << setw(15) << (to_string(avgFreq).substr(0, 4) + "%") << "\n";
+    if (options.lshThreshold > 0 && options.metric != METRIC_JACCARD) {
+        cout << " Error: --lsh only estimates the Jaccard similarity\n";
+        return 1;
     }
+    sharedDocumentCache().configure(options.cacheDirectory, options.useCache);
+    return runBatchComparison(options) ? 0 : 1;
 }
 
-void generateUpdatedReport(const string& file1, const string& file2, const string& oldWord, const string& newWord) {
-    cout << " Analyzing updated documents...\n";
-    
-    // Analyze both documents
-    DocumentStats doc1 = analyzeDocument(file1);
-    DocumentStats doc2 = analyzeDocument(file2);
-    
-    if (doc1.wordCount == 0 || doc2.wordCount == 0) {
-        cout << " Error: Could not process one or both updated documents.\n";
-        return;
+// Runs one command line (without the program name); every line of a job file
+// goes through here as well, sharing the store
+int runCommand(const vector<string>& args, DocumentStore& store) {
+    const string& command = args[0];
+    sharedNormalization() = WordNormalization();
+    if (command == "--help" || command == "-h" || command == "help") {
+        printUsage();
+        return 0;
     }
-    
-    // Calculate similarity
-    double similarity = jaccardSimilarity(doc1.uniqueWords, doc2.uniqueWords);
-    
-    // Find common words
-    set<string> commonWords = findCommonWords(doc1.uniqueWords, doc2.uniqueWords);
-    
-    // Create updated report filename
-    string reportFilename = "result_updated.txt";
-    
-    ofstream report(reportFilename);
-    if (!report.is_open()) {
-        cout << " Error: Cannot create " << reportFilename << "\n";
-        return;
+    if (command == "batch" || command == "--batch") {
+        return runBatchMode(args);
     }
-    
-    report << "TEXT COMPARATOR - UPDATED ANALYSIS REPORT\n";
-    report << "==========================================\n\n";
-    
-    report << "WORD REPLACEMENT SUMMARY\n";
-    report << "------------------------\n";
-    report << "Replaced word: '" << oldWord << "' -> '" << newWord << "'\n";
-    report << "Documents analyzed: " << file1 << " and " << file2 << "\n\n";
-    
-    report << "DOCUMENT ANALYSIS (AFTER REPLACEMENT)\n";
-    report << "------------------------------------\n\n";
-    
-    // Document A Analysis
-    report << "Document A: " << doc1.filename << "\n";
-    report << "- Word Count: " << doc1.wordCount << "\n";
-    report << "- Sentence Count: " << doc1.sentenceCount << "\n";
-    report << "- Unique Words: " << doc1.uniqueWords.size() << "\n";
-    report << "- Average Sentence Length: " << fixed << setprecision(2) << doc1.avgSentenceLength << " words\n";
-    report << "- Longest Sentence: " << doc1.longestSentenceWordCount << " words\n";
-    report << "- Top 5 Words: ";
-    for (int i = 0; i < min(5, (int)doc1.topWords.size()); i++) {
-        report << doc1.topWords[i].first << "(" << doc1.topWords[i].second << ")";
-        if (i < min(4, (int)doc1.topWords.size() - 1)) report << ", ";
-    }
-    report << "\n\n";
-    
-    // Document B Analysis
-    report << "Document B: " << doc2.filename << "\n";
-    report << "- Word Count: " << doc2.wordCount << "\n";
-    report << "- Sentence Count: " << doc2.sentenceCount << "\n";
-    report << "- Unique Words: " << doc2.uniqueWords.size() << "\n";
-    report << "- Average Sentence Length: " << fixed << setprecision(2) << doc2.avgSentenceLength << " words\n";
-    report << "- Longest Sentence: " << doc2.longestSentenceWordCount << " words\n";
-    report << "- Top 5 Words: ";
-    for (int i = 0; i < min(5, (int)doc2.topWords.size()); i++) {
-        report << doc2.topWords[i].first << "(" << doc2.topWords[i].second << ")";
-        if (i < min(4, (int)doc2.topWords.size() - 1)) report << ", ";
-    }
-    report << "\n\n";
-    
-    // Comparison Analysis
-    report << "COMPARISON ANALYSIS (AFTER REPLACEMENT)\n";
-    report << "---------------------------------------\n\n";
-    report << "Jaccard Similarity: " << fixed << setprecision(2) << similarity << "%\n";
-    report << "Common Words Count: " << commonWords.size() << "\n\n";
-    
-    report << "Common Words: ";
-    int count = 0;
-    for (const string& word : commonWords) {
-        if (count > 0) report << ", ";
-        report << word;
-        count++;
-        if (count >= 20) {
-            report << "... (and " << (commonWords.size() - 20) << " more)";
-            break;
+    if (command == "bench") {
+        return runBenchMode(args);
+    }
+    if (command == "generate") {
+        return runGenerateMode(args);
+    }
+    if (command == "serve") {
+        return runServeMode(args);
+    }
+    if (command == "jobs") {
+        if (args.size() != 2) {
+            printUsage();
+            return 1;
         }
+        return runJobFile(args[1], store);
+    }
+    if (command != "analyze" && command != "compare" && command != "report" && command != "replace" &&
+        command != "passages" && command != "diff") {
+        cout << " Error: Unknown command " << command << "\n";
+        printUsage();
+        return 1;
     }
-    report << "\n\n";
     
-    report << "LONGEST SENTENCES (AFTER REPLACEMENT)\n";
-    report << "------------------------------------\n\n";
-    report << "Document A longest sentence (" << doc1.longestSentenceWordCount << " words):\n";
-    report << doc1.longestSentence << "\n\n";
-    report << "Document B longest sentence (" << doc2.longestSentenceWordCount << " words):\n";
-    report << doc2.longestSentence << "\n\n";
+    vector<string> files;
+    string output, oldWords, newWords, target = "both";
+    bool verifyUpdates = false;
+    bool writeReport = true;
+    StreamOptions stream;
+    vector<SimilarityMetric> metrics;
+    size_t shingleWords = 5, window = 4, limit = 20;
+    string granularity = "word", format;
+    size_t context = 3;
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (arg == "--verify") {
+            verifyUpdates = true;
+            continue;
+        }
+        if (arg == "--stream") {
+            stream.enabled = true;
+            continue;
+        }
+        if (arg == "--no-report") {
+            writeReport = false;
+            continue;
+        }
+        if (arg == "--stop-words") {
+            sharedNormalization().stopWords = true;
+            continue;
+        }
+        if (arg == "--stem") {
+            sharedNormalization().stem = true;
+            continue;
+        }
+        if (arg.compare(0, 2, "--") != 0) {
+            files.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= args.size()) {
+            cout << " Error: Missing value for " << arg << "\n";
+            return 1;
+        }
+        const string& value = args[++i];
+        if (arg == "--output") {
+            output = value;
+        } else if (arg == "--words") {
+            oldWords = value;
+        } else if (arg == "--with") {
+            newWords = value;
+        } else if (arg == "--in") {
+            target = value;
+        } else if (arg == "--metric") {
+            if (!parseSimilarityMetrics(value, metrics)) {
+                return 1;
+            }
+        } else if (arg == "--shingle") {
+            if (!parseCount(arg, value, shingleWords)) {
+                return 1;
+            }
+            shingleWords = max<size_t>(1, shingleWords);
+        } else if (arg == "--window") {
+            if (!parseCount(arg, value, window)) {
+                return 1;
+            }
+            window = max<size_t>(1, window);
+        } else if (arg == "--limit") {
+            if (!parseCount(arg, value, limit)) {
+                return 1;
+            }
+        } else if (arg == "--by") {
+            granularity = value;
+        } else if (arg == "--format") {
+            format = value;
+        } else if (arg == "--context") {
+            if (!parseCount(arg, value, context)) {
+                return 1;
+            }
+        } else if (arg == "--chunk-mb") {
+            if (!parseMegabytes(arg, value, stream.chunkSize)) {
+                return 1;
+            }
+        } else if (arg == "--max-vocabulary") {
+            if (!parseCount(arg, value, stream.maxVocabulary)) {
+                return 1;
+            }
+        } else {
+            cout << " Error: Unknown option " << arg << "\n";
+            printUsage();
+            return 1;
+        }
+    }
     
-    // Check if replacement word appears in analysis
-    bool newWordInDoc1 = doc1.wordFrequency.find(newWord) != doc1.wordFrequency.end();
-    bool newWordInDoc2 = doc2.wordFrequency.find(newWord) != doc2.wordFrequency.end();
+    ReportFormat reportFormat = REPORT_TEXT;
+    if (command != "diff" && !format.empty() && !parseReportFormat(format, reportFormat)) {
+        return 1;
+    }
     
-    if (newWordInDoc1 || newWordInDoc2) {
-        report << "REPLACEMENT WORD ANALYSIS\n";
-        report << "------------------------\n";
-        if (newWordInDoc1) {
-            report << "'" << newWord << "' appears " << doc1.wordFrequency.at(newWord) << " times in Document A\n";
+    if (command == "analyze") {
+        if (files.empty()) {
+            printUsage();
+            return 1;
+        }
+        // Text sections are written as each document is analyzed; JSON and
+        // CSV describe all documents in one block
+        int status = 0;
+        vector<const DocumentStats*> docs;
+        ReportBuffer out;
+        out.open(reportFormat == REPORT_TEXT || output.empty() ? "-" : output);
+        for (const string& filename : files) {
+            const DocumentStats* doc = store.get(filename, stream);
+            if (!doc) {
+                status = 1;
+            } else if (reportFormat == REPORT_TEXT) {
+                writeDocumentSection(out, "Document", *doc);
+                out.close();
+                out.open("-");
+            } else {
+                docs.push_back(doc);
+            }
         }
-        if (newWordInDoc2) {
-            report << "'" << newWord << "' appears " << doc2.wordFrequency.at(newWord) << " times in Document B\n";
+        if (reportFormat != REPORT_TEXT) {
+            renderDocuments(out, docs, reportFormat);
         }
-        report << "\n";
+        if (!out.close()) {
+            cout << " Error: Cannot create " << output << "\n";
+            return 1;
+        }
+        return status;
     }
     
-    report << "End of Updated Report\n";
-    report.close();
+    if (files.size() != 2) {
+        cout << " Error: " << command << " takes two documents\n";
+        return 1;
+    }
+    if ((command == "replace" || command == "passages" || command == "diff") && stream.enabled) {
+        cout << " Error: " << command << " needs whole documents and cannot be streamed\n";
+        return 1;
+    }
+    if (command == "diff") {
+        if (format.empty()) {
+            format = "unified";
+        }
+        if ((granularity != "word" && granularity != "sentence") || (format != "unified" && format != "side-by-side")) {
+            cout << " Error: diff takes --by word|sentence and --format unified|side-by-side\n";
+            return 1;
+        }
+        FileBuffer buffer1, buffer2;
+        if (!buffer1.open(files[0]) || !buffer2.open(files[1])) {
+            cout << " Error: Cannot open '" << (buffer1.empty() ? files[0] : files[1]) << "'\n";
+            return 1;
+        }
+        WordTable words;
+        unordered_map<uint64_t, uint32_t> sentences;
+        DiffSequence seq1 = granularity == "word" ? wordSequence(buffer1.text(), words) : sentenceSequence(buffer1.text(), sentences);
+        DiffSequence seq2 = granularity == "word" ? wordSequence(buffer2.text(), words) : sentenceSequence(buffer2.text(), sentences);
+        vector<DiffRun> runs = diffSequences(seq1.ids, seq2.ids);
+        
+        ofstream file;
+        if (!output.empty()) {
+            file.open(output);
+            if (!file.is_open()) {
+                cout << " Error: Cannot create " << output << "\n";
+                return 1;
+            }
+        }
+        writeDiff(output.empty() ? cout : file, runs, seq1, seq2, buffer1.text(), buffer2.text(), files[0], files[1],
+                  format == "side-by-side", context);
+        size_t counts[3] = {0, 0, 0};
+        for (const DiffRun& run : runs) {
+            counts[run.kind] += run.length;
+        }
+        cout << " " << granularity << "s: " << counts[DIFF_EQUAL] << " equal, " << counts[DIFF_DELETE] << " deleted, "
+             << counts[DIFF_INSERT] << " inserted\n";
+        if (!output.empty()) {
+            cout << " Diff saved to '" << output << "'\n";
+        }
+        return 0;
+    }
+    if (command == "passages") {
+        FileBuffer buffer1, buffer2;
+        if (!loadFile(files[0], buffer1) || !loadFile(files[1], buffer2)) {
+            return 1;
+        }
+        ShingledDocument shingled1 = winnowDocument(buffer1.text(), shingleWords, window);
+        ShingledDocument shingled2 = winnowDocument(buffer2.text(), shingleWords, window);
+        vector<PassageMatch> passages = findMatchingPassages(shingled1, shingled2, shingleWords);
+        cout << "\n MATCHING PASSAGES (" << shingleWords << "-word shingles, window " << window << ")\n";
+        printSeparator('-', 80);
+        cout << " Fingerprints: A " << shingled1.fingerprints.size() << ", B " << shingled2.fingerprints.size()
+             << "   Passages: " << passages.size() << "\n\n";
+        printMatchingPassages(passages, buffer1.text(), limit);
+        return 0;
+    }
+    // compare, report and replace print their tables and progress to stderr
+    // when the report itself goes to stdout
+    ConsoleToStderr console(output == "-");
+    const DocumentStats* doc1 = store.get(files[0], stream);
+    const DocumentStats* doc2 = store.get(files[1], stream);
+    if (!doc1 || !doc2) {
+        return 1;
+    }
+    vector<CommonWordCount> commonWords = getCommonWordsWithCounts(*doc1, *doc2);
+    VocabularyOverlap overlap(doc1->uniqueWords.size(), doc2->uniqueWords.size(), commonWords.size());
     
-    cout << "Updated analysis report generated: " << reportFilename << "\n";
+    if (command == "replace") {
+        vector<pair<string, string>> replacements = parseReplacements(oldWords, newWords);
+        int option = target == "both" ? 1 : target == "first" ? 2 : target == "second" ? 3 : 0;
+        if (option == 0 || replacements.empty()) {
+            cout << " Error: replace needs --words and --with lists of equal length and --in both|first|second\n";
+            return 1;
+        }
+        for (DocumentStats& updated : replaceInDocuments(*doc1, *doc2, commonWords, replacements, option, verifyUpdates,
+                                                         output.empty() ? defaultReportPath("result_updated", reportFormat) : output,
+                                                         reportFormat)) {
+            store.put(move(updated));
+        }
+        return 0;
+    }
     
-    // Also display brief updated comparison on screen
-    cout << "\n UPDATED COMPARISON SUMMARY:\n";
-    printSeparator('-', 40);
-    cout << " Document A Word Count: " << doc1.wordCount << "\n";
-    cout << " Document B Word Count: " << doc2.wordCount << "\n";
-    cout << " Updated Similarity: " << fixed << setprecision(2) << similarity << "%\n";
-    cout << " Common Words: " << commonWords.size() << "\n";
+    string reportFilename = output.empty() ? defaultReportPath("result", reportFormat) : output;
+    vector<SimilarityScore> scores = scoreDocuments(*doc1, *doc2, metrics);
+    if (command == "compare") {
+        printComparisonTable(*doc1, *doc2, overlap, scores);
+        printCommonWordsAnalysis(*doc1, *doc2, commonWords);
+    }
+    if (writeReport) {
+        writeReportToFile(*doc1, *doc2, overlap, commonWords, reportFilename, scores, reportFormat);
+        if (reportFilename != "-") {
+            cout << " Detailed report saved to '" << reportFilename << "'\n";
+        }
+    }
+    return 0;
+}
+
+// Runs one command per line of a job file ("-" reads stdin). Arguments are
+// separated by whitespace; blank lines and lines starting with '#' are
+// skipped. A failing line is reported and the remaining lines still run.
+int runJobFile(const string& path, DocumentStore& store) {
+    ifstream file;
+    istream* input = &cin;
+    if (path != "-") {
+        file.open(path);
+        if (!file.is_open()) {
+            cout << " Error: Cannot open job file '" << path << "'\n";
+            return 1;
+        }
+        input = &file;
+    }
     
-    if (newWordInDoc1 || newWordInDoc2) {
-        cout << "\n REPLACEMENT VERIFICATION:\n";
-        if (newWordInDoc1) {
-            cout << " '" << newWord << "' found " << doc1.wordFrequency.at(newWord) << " times in updated " << file1 << "\n";
+    string line;
+    size_t lineNumber = 0;
+    size_t failures = 0;
+    while (getline(*input, line)) {
+        lineNumber++;
+        istringstream words(line);
+        vector<string> args;
+        string word;
+        while (words >> word) {
+            args.push_back(word);
         }
-        if (newWordInDoc2) {
-            cout << " '" << newWord << "' found " << doc2.wordFrequency.at(newWord) << " times in updated " << file2 << "\n";
+        if (args.empty() || args[0][0] == '#') {
+            continue;
+        }
+        // Anything a command throws fails only its own line
+        int status = 1;
+        if (args[0] != "jobs") {
+            try {
+                status = runCommand(args, store);
+            } catch (const exception& error) {
+                cout << " Error: " << error.what() << "\n";
+            }
+        }
+        if (status != 0) {
+            cout << " Error: Job line " << lineNumber << " failed: " << line << "\n";
+            failures++;
         }
     }
-}
\ No newline at end of file
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""Generates unicode_tables.h, the tokenizer's Unicode tables.
+
+Every code point gets a tokenizer class (the CharClass values in main.cpp)
+and its simple case folding, packed into one two-stage lookup table:
+
+    entry  = kUnicodeStage2[(kUnicodeStage1[cp >> kUnicodeShift] << kUnicodeShift) | (cp & mask)]
+    class  = entry & 7
+    folded = cp + kUnicodeFoldDelta[entry >> 3]
+
+for cp < kUnicodeLimit. The planes above (unassigned, tags, variation
+selectors and private use) are dropped, which needs no table.
+
+Identical blocks of the second stage are stored once, and the block size is
+chosen to make the two stages smallest. The data comes from Python's
+unicodedata module, so the Unicode version is the one of the Python used.
+
+Usage: python3 tools/gen_unicode_tables.py > unicode_tables.h
+"""
+
+import sys
+import unicodedata
+
+DROP, LETTER, TERMINATOR, SEPARATOR, IDEOGRAPH = range(5)
+
+# Sentence terminators besides '.', '!' and '?': Armenian, Arabic and
+# Devanagari full stops and question marks, the ideographic full stop and the
+# fullwidth and halfwidth forms
+TERMINATORS = {0x0589, 0x061F, 0x06D4, 0x0964, 0x0965, 0x3002, 0xFF01, 0xFF0E, 0xFF1F, 0xFF61}
+
+# Scripts written without spaces between words where every character is a
+# word of its own (as in Unicode word segmentation): Han ideographs and Hiragana
+IDEOGRAPHIC_RANGES = [
+    (0x3041, 0x309F),     # Hiragana
+    (0x3400, 0x4DBF),     # CJK Unified Ideographs Extension A
+    (0x4E00, 0x9FFF),     # CJK Unified Ideographs
+    (0xF900, 0xFAFF),     # CJK Compatibility Ideographs
+    (0x20000, 0x3FFFF),   # Supplementary and Tertiary Ideographic Planes
+]
+
+
+def ascii_class(c):
+    # Must match buildCharTable() in main.cpp
+    if ord('a') <= c <= ord('z') or ord('A') <= c <= ord('Z'):
+        return LETTER
+    if chr(c) in '.!?':
+        return TERMINATOR
+    if c == 0x20 or 0x09 <= c <= 0x0D or (0x20 < c < 0x7F and not ord('0') <= c <= ord('9')):
+        return SEPARATOR
+    return DROP
+
+
+def classify(cp):
+    if cp < 0x80:
+        return ascii_class(cp)
+    if cp in TERMINATORS:
+        return TERMINATOR
+    if 0xD800 <= cp <= 0xDFFF:
+        return DROP
+    category = unicodedata.category(chr(cp))
+    if category[0] == 'L':
+        if any(low <= cp <= high for low, high in IDEOGRAPHIC_RANGES):
+            return IDEOGRAPH
+        return LETTER
+    if category[0] == 'M':
+        return LETTER     # combining marks stay inside their word
+    if category[0] in 'PSZ' or cp == 0x85:
+        return SEPARATOR
+    return DROP           # digits, other numbers, controls, format characters, unassigned
+
+
+def simple_fold(cp):
+    """Simple case folding (statuses C and S of CaseFolding.txt)."""
+    ch = chr(cp)
+    folded = ch.casefold()
+    if len(folded) == 1:
+        return ord(folded)
+    # Characters with a multi-character full folding; their simple folding,
+    # where there is one, is the single-character lowercase mapping
+    lowered = ch.lower()
+    if len(lowered) == 1:
+        return ord(lowered)
+    return cp
+
+
+LIMIT = 0x40000          # planes 0 to 3
+
+
+def build():
+    deltas = [0]
+    delta_index = {0: 0}
+    entries = []
+    for cp in range(LIMIT):
+        cls = classify(cp)
+        delta = 0
+        if cls in (LETTER, IDEOGRAPH) and not 0xD800 <= cp <= 0xDFFF:
+            delta = simple_fold(cp) - cp
+        if delta not in delta_index:
+            delta_index[delta] = len(deltas)
+            deltas.append(delta)
+        entries.append(cls | (delta_index[delta] << 3))
+    assert len(deltas) < (1 << 13)
+
+    best = None
+    for shift in range(4, 11):
+        size = 1 << shift
+        blocks = {}
+        stage1 = []
+        stage2 = []
+        for start in range(0, len(entries), size):
+            block = tuple(entries[start:start + size])
+            if block not in blocks:
+                blocks[block] = len(blocks)
+                stage2.extend(block)
+            stage1.append(blocks[block])
+        total = 2 * len(stage1) + 2 * len(stage2)
+        if best is None or total < best[0]:
+            best = (total, shift, stage1, stage2)
+    return best, deltas
+
+
+def emit_array(out, ctype, name, values, per_line=16):
+    out.write('constexpr %s %s[%d] = {\n' % (ctype, name, len(values)))
+    for start in range(0, len(values), per_line):
+        out.write('    ' + ', '.join(str(v) for v in values[start:start + per_line]) + ',\n')
+    out.write('};\n\n')
+
+
+def main():
+    (total, shift, stage1, stage2), deltas = build()
+    out = sys.stdout
+    out.write('// Generated by tools/gen_unicode_tables.py from Unicode %s; do not edit.\n' % unicodedata.unidata_version)
+    out.write('// Tokenizer class (CharClass) and simple case folding of every code point,\n')
+    out.write('// %d bytes in two stages plus %d folding deltas.\n\n' % (total, len(deltas)))
+    out.write('#pragma once\n\n#include <cstdint>\n\n')
+    out.write('constexpr unsigned kUnicodeShift = %d;\n' % shift)
+    out.write('constexpr uint32_t kUnicodeLimit = 0x%X;\n\n' % LIMIT)
+    emit_array(out, 'uint16_t', 'kUnicodeStage1', stage1)
+    emit_array(out, 'uint16_t', 'kUnicodeStage2', stage2)
+    emit_array(out, 'int32_t', 'kUnicodeFoldDelta', deltas, 8)
+
+
+if __name__ == '__main__':
+    main()